@@ -0,0 +1,188 @@
+#include "loopback_server.h"
+
+#include "executor.h"
+#include "url_parser.h"
+#include "http_client.h"
+#include "connection_pool.h"
+#include "resolver_cache.h"
+#include "coro_client.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+size_t allocations=0;
+
+}
+
+void* operator new(size_t size)
+{
+    ++allocations;
+    if(auto ptr=std::malloc(size)) {
+
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+// Out of line, so GCC does not see free() on memory from operator new
+[[gnu::noinline]] void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+namespace
+{
+
+constexpr uint64_t PAGE_SIZE=4*1024; //bytes
+
+struct Totals
+{
+    size_t requests=0;
+    size_t failed=0;
+    uint64_t checksum=0;
+};
+
+// The callback client as page_loader drives it: a client per request on pooled connections
+class CallbackRunner
+{
+private:
+    Loop& m_loop;
+    const std::vector<std::string>& m_urls;
+    ConnectionPool m_pool;
+    ResolverCache m_resolver;
+    std::vector<std::unique_ptr<HttpClient>> m_clients;
+    size_t m_next;
+    Totals& m_totals;
+
+private:
+    void start(size_t slot)
+    {
+        if(m_next == m_urls.size()) {
+
+            return;
+        }
+
+        auto [error_url, url]=HttpUrlParser::parse(m_urls[m_next++]);
+        auto& client=m_clients[slot];
+        client=std::make_unique<HttpClient>(m_loop, std::move(url), HttpTimeouts(), &m_pool, &m_resolver);
+        client->set_content_coding(ContentCoding::IDENTITY);
+        client->load_stream([this](std::string_view part_body, const Error& error) {
+
+            m_totals.checksum+=part_body.size();
+        }, [this, slot](const Error& error) {
+
+            ++m_totals.requests;
+            m_totals.failed+=error || m_clients[slot]->response_header().status_code != 200;
+
+            // The client is on the call stack, replace it on the next iteration
+            m_loop.post([this, slot]() {
+
+                start(slot);
+            });
+        });
+    }
+
+public:
+    CallbackRunner(Loop& loop, const std::vector<std::string>& urls, size_t concurrency, Totals& totals):
+        m_loop(loop),
+        m_urls(urls),
+        m_pool(loop, concurrency, concurrency),
+        m_resolver(loop),
+        m_clients(concurrency),
+        m_next(0),
+        m_totals(totals)
+    {}
+
+    void run()
+    {
+        for(size_t slot=0; slot < m_clients.size(); ++slot) {
+
+            start(slot);
+        }
+        m_loop.run();
+    }
+};
+
+// The same requests as straight-line coroutines, one keep-alive client per worker
+CoTask<> fetch(Loop& loop, CoHttpClient& client, const std::vector<std::string>& urls, size_t& next, Totals& totals)
+{
+    while(next < urls.size()) {
+
+        auto [error_url, url]=HttpUrlParser::parse(urls[next++]);
+        auto response=co_await client.get(std::move(url));
+        ++totals.requests;
+        totals.failed+=response.error || response.status_code != 200;
+        totals.checksum+=response.body.size();
+    }
+}
+
+void run_coroutines(Loop& loop, const std::vector<std::string>& urls, size_t concurrency, Totals& totals)
+{
+    std::vector<std::unique_ptr<CoHttpClient>> clients;
+    size_t next=0;
+    for(size_t i=0; i < concurrency; ++i) {
+
+        clients.push_back(std::make_unique<CoHttpClient>(loop));
+        spawn(loop, fetch(loop, *clients.back(), urls, next, totals), []() {});
+    }
+    loop.run();
+}
+
+template<typename R>
+void measure(const char* name, const LoopbackServer& server, size_t requests, size_t concurrency, R&& run)
+{
+    std::vector<std::string> urls(requests, server.url(PAGE_SIZE));
+    Loop loop;
+
+    // Warm the pools so only steady state allocations are counted
+    Totals warm;
+    run(loop, std::vector<std::string>(concurrency*4, server.url(PAGE_SIZE)), concurrency, warm);
+
+    Totals totals;
+    auto start_allocations=allocations;
+    auto start=std::chrono::steady_clock::now();
+    run(loop, urls, concurrency, totals);
+    auto elapsed=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+    std::cout << name
+        << " concurrency=" << concurrency
+        << " requests=" << totals.requests
+        << " failed=" << totals.failed+warm.failed
+        << " req/s=" << totals.requests/elapsed
+        << " allocations/request=" << double(allocations-start_allocations)/totals.requests
+        << " frames=" << loop.frames().allocated()
+        << " checksum=" << totals.checksum
+        << std::endl;
+}
+
+}
+
+int main(int argc, const char* args[])
+{
+    size_t requests=argc > 1 ? std::strtoul(args[1], nullptr, 10) : 20000;
+
+    LoopbackServer server;
+    for(size_t concurrency : {1, 16}) {
+
+        measure("callback ", server, requests, concurrency, [](Loop& loop, const std::vector<std::string>& urls, size_t concurrency, Totals& totals) {
+
+            CallbackRunner(loop, urls, concurrency, totals).run();
+        });
+        measure("coroutine", server, requests, concurrency, run_coroutines);
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include "executor.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <new>
+#include <thread>
+
+namespace
+{
+
+size_t allocations=0;
+
+}
+
+void* operator new(size_t size)
+{
+    ++allocations;
+    if(auto ptr=std::malloc(size)) {
+
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+namespace
+{
+
+// The executor as it was before the epoll reactor: a list of polled std::function
+class ListLoop
+{
+private:
+    std::list<std::function<bool()>> m_queue;
+
+public:
+    template<typename T>
+    void post(T&& task)
+    {
+        m_queue.push_back(std::forward<T>(task));
+    }
+
+    void run()
+    {
+        while(!m_queue.empty())
+        {
+            auto it = m_queue.begin();
+            for(; it!=m_queue.end(); ) {
+
+                auto& task=*it;
+                if(task()){
+
+                    it=m_queue.erase(it);
+                } else {
+
+                    ++it;
+                }
+            }
+            std::this_thread::sleep_for (std::chrono::duration<int,std::ratio<1,1>>());
+        }
+    }
+};
+
+// Mimics a read_some continuation: a handler, the stream and the buffer
+struct Chain
+{
+    size_t remaining;
+    size_t checksum;
+};
+
+void post_list(ListLoop& loop, Chain& chain, char* data, size_t len)
+{
+    loop.post([&loop, &chain, data, len, tail=[&chain](size_t n) { chain.checksum+=n; }]() {
+
+        tail(len);
+        if(--chain.remaining > 0) {
+
+            post_list(loop, chain, data, len);
+        }
+        return true;
+    });
+}
+
+void post_loop(Loop& loop, Chain& chain, char* data, size_t len)
+{
+    loop.post([&loop, &chain, data, len, tail=[&chain](size_t n) { chain.checksum+=n; }]() {
+
+        tail(len);
+        if(--chain.remaining > 0) {
+
+            post_loop(loop, chain, data, len);
+        }
+    });
+}
+
+template<typename L, typename P>
+void measure(const char* name, size_t chains, size_t steps, P&& post)
+{
+    L loop;
+    std::vector<Chain> state(chains, Chain{steps, 0});
+    char buffer[1024];
+
+    for(auto& chain : state) {
+
+        post(loop, chain, buffer, sizeof(buffer));
+    }
+
+    // Warm the queue so only steady state allocations are counted
+    loop.run();
+    for(auto& chain : state) {
+
+        chain.remaining=steps;
+        post(loop, chain, buffer, sizeof(buffer));
+    }
+
+    auto start_allocations=allocations;
+    auto start=std::chrono::steady_clock::now();
+    loop.run();
+    auto elapsed=std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now()-start).count();
+
+    auto tasks=double(chains*steps);
+    std::cout << name
+        << " chains=" << chains
+        << " tasks=" << size_t(tasks)
+        << " ns/task=" << elapsed/tasks
+        << " allocations/task=" << double(allocations-start_allocations)/tasks
+        << std::endl;
+}
+
+}
+
+int main(int argc, const char* args[])
+{
+    size_t steps=argc > 1 ? std::strtoul(args[1], nullptr, 10) : 100000;
+
+    for(size_t chains : {1, 16, 1024}) {
+
+        measure<ListLoop>("list<function>", chains, steps/chains, post_list);
+        measure<Loop>("ring<inline>  ", chains, steps/chains, post_loop);
+    }
+
+    return 0;
+}
\ No newline at end of file
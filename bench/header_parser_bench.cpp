@@ -0,0 +1,184 @@
+#include "http_client.h"
+#include "corpus.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+// The parser as it was before it became incremental: the reader looked for the
+// terminator in every read and parse() scanned the whole header once more
+class LegacyHeaderParser
+{
+public:
+    static std::tuple<bool, ResponseHeader> parse(std::string_view data)
+    {
+        ResponseHeader header;
+
+        auto pos=size_t(0);
+        const auto status_line=data.substr(pos, data.find("\r\n"sv, pos));
+        if(auto [error, version, ppos]=ResponseHeaderParser::parse_version(status_line, pos); !error) {
+
+            pos=ppos;
+            header.version=version;
+        } else {
+
+            return {true, {}};
+        }
+
+        if(auto [error, status_code, ppos]=ResponseHeaderParser::parse_status_code(status_line, pos); !error) {
+
+            pos=ppos;
+            header.status_code=status_code;
+        } else {
+
+            return {true, {}};
+        }
+
+        header.reason_phrase = status_line.substr(pos);
+        pos=status_line.size()+2;
+        for(;pos < data.size();){
+
+            if(auto ppos=data.find(':', pos); ppos!=std::string_view::npos) {
+
+                ++ppos;
+                if(auto pppos=data.find("\r\n"sv, ppos); pppos!=std::string_view::npos) {
+
+                    auto value=std::min(data.find_first_not_of(' ', ppos), pppos);
+                    header.add(data.substr(pos, ppos-pos-1), data.substr(value, pppos-value));
+                    pos=pppos+2;
+                } else {
+
+                    return {true, {}};
+                }
+            } else {
+
+                return {true, {}};
+            }
+        }
+
+        return {false, header};
+    }
+};
+
+size_t legacy_parse(std::vector<char>& buffer, std::string_view response, size_t read_size)
+{
+    buffer.clear();
+    for(size_t pos=0; pos < response.size(); pos+=read_size) {
+
+        auto part=response.substr(pos, read_size);
+        auto old_size=buffer.size();
+        buffer.insert(buffer.end(), part.begin(), part.end());
+
+        auto buffered=std::string_view(buffer.data(), buffer.size());
+        if(auto end=buffered.find("\r\n\r\n"sv, old_size >= 3 ? old_size-3 : 0); end!=std::string_view::npos) {
+
+            auto [error, header]=LegacyHeaderParser::parse(buffered.substr(0, end+2));
+            return error ? 0 : header.status_code;
+        }
+    }
+    return 0;
+}
+
+size_t incremental_parse(std::vector<char>& buffer, ResponseHeaderParser& parser, std::string_view response, size_t read_size)
+{
+    buffer.clear();
+    parser.reset();
+    ResponseHeader header;
+    for(size_t pos=0; pos < response.size(); pos+=read_size) {
+
+        auto part=response.substr(pos, read_size);
+        buffer.insert(buffer.end(), part.begin(), part.end());
+
+        auto [error, header_size]=parser.parse(std::string_view(buffer.data(), buffer.size()), header);
+        if(error) {
+
+            return 0;
+        } else if(header_size > 0) {
+
+            return header.status_code;
+        }
+    }
+    return 0;
+}
+
+template<typename F>
+void measure(const char* name, std::string_view set, size_t size, size_t iterations, F&& run)
+{
+    size_t checksum=0;
+    auto start=std::chrono::steady_clock::now();
+    for(size_t i=0; i<iterations; ++i) {
+
+        checksum+=run();
+    }
+    auto elapsed=std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now()-start).count();
+
+    std::cout << name
+        << " set=" << set
+        << " bytes=" << size
+        << " ns/header=" << elapsed/iterations
+        << " MB/s=" << double(size)*iterations/elapsed*1000
+        << " checksum=" << checksum
+        << std::endl;
+}
+
+}
+
+int main(int argc, const char* args[])
+{
+    size_t iterations=argc > 1 ? std::strtoul(args[1], nullptr, 10) : 200000;
+
+    std::vector<char> buffer;
+    buffer.reserve(ResponseReader::MAX_HEADER_SIZE);
+    ResponseHeaderParser parser;
+
+    for(auto& [name, text] : HEADER_SETS) {
+
+        auto response=std::string(text)+std::string(512, 'x');
+        auto header_size=std::string_view(text).size();
+
+        for(size_t read_size : {size_t(1024), size_t(64)}) {
+
+            std::cout << "read_size=" << read_size << std::endl;
+            measure("  legacy     ", name, header_size, iterations, [&]() {
+
+                return legacy_parse(buffer, response, read_size);
+            });
+            measure("  incremental", name, header_size, iterations, [&]() {
+
+                return incremental_parse(buffer, parser, response, read_size);
+            });
+        }
+
+        auto begin=text;
+        auto end=text+header_size;
+        auto scan=[begin, end](FindControl find) {
+
+            size_t lines=0;
+            for(auto p=find(begin, end); p!=end; p=find(p+1, end)) {
+
+                ++lines;
+            }
+            return lines;
+        };
+
+        std::cout << "line scan" << std::endl;
+        measure("  scalar     ", name, header_size, iterations, [&]() { return scan(&find_control_scalar); });
+#ifdef PAGE_LOADER_X86
+        if(__builtin_cpu_supports("sse4.2")) {
+
+            measure("  sse4.2     ", name, header_size, iterations, [&]() { return scan(&find_control_sse42); });
+        }
+        if(__builtin_cpu_supports("avx2")) {
+
+            measure("  avx2       ", name, header_size, iterations, [&]() { return scan(&find_control_avx2); });
+        }
+#endif
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,400 @@
+#pragma once
+
+#include "error.h"
+#include "linux_fd.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+using namespace std::literals;
+
+// Stand-in HTTP/1.1 server on 127.0.0.1 for benchmarks, one thread per connection.
+// The target tells what to answer: "/<size>" sends that many body bytes, "chunked"
+// in the query frames them in chunks instead of a Content-Length, "chunk=<bytes>"
+// sets the chunk size, CHUNK_SIZE by default, and "delay=<ns>" paces the body to that many nanoseconds per byte. At most max_connections are
+// served at once, later ones wait in the listen backlog; a kept alive connection
+// holds its place until it is closed.
+class LoopbackServer
+{
+public:
+    static constexpr size_t BLOCK_SIZE=64*1024; //bytes
+    static constexpr size_t CHUNK_SIZE=16*1024; //bytes
+    static constexpr size_t MAX_REQUEST_SIZE=8*1024; //bytes
+
+private:
+    struct Worker
+    {
+        std::thread thread;
+        int fd=-1;
+        bool done=false;
+    };
+
+    LinuxFd m_listen;
+    uint16_t m_port;
+    size_t m_max_connections;
+    std::string m_pattern;
+    std::mutex m_mutex;
+    std::condition_variable m_slot_freed;
+    std::list<Worker> m_workers;
+    size_t m_open;
+    bool m_stopping;
+    std::thread m_acceptor;
+
+private:
+    static bool send_all(int fd, std::string_view data, int flags=0)
+    {
+        while(!data.empty()) {
+
+            auto size=send(fd, data.data(), data.size(), flags | MSG_NOSIGNAL);
+            if(size==-1 && errno==EINTR) {
+
+                continue;
+            } else if(size<=0) {
+
+                return false;
+            }
+            data.remove_prefix(size_t(size));
+        }
+        return true;
+    }
+
+    // "?chunked&delay=100" style, unknown parameters are ignored
+    static bool parse_target(std::string_view target, uint64_t& size, bool& chunked, size_t& chunk_size, uint64_t& delay_ns)
+    {
+        if(target.empty() || target[0]!='/') {
+
+            return false;
+        }
+
+        auto end=target.data()+target.size();
+        auto [p, ec]=std::from_chars(target.data()+1, end, size);
+        if(ec!=std::errc()) {
+
+            return false;
+        }
+
+        auto query=std::string_view(p, size_t(end-p));
+        chunked=query.find("chunked"sv)!=std::string_view::npos;
+        delay_ns=0;
+        if(auto pos=query.find("delay="sv); pos!=std::string_view::npos) {
+
+            std::from_chars(query.data()+pos+6, end, delay_ns);
+        }
+
+        chunk_size=CHUNK_SIZE;
+        if(auto pos=query.find("chunk="sv); pos!=std::string_view::npos) {
+
+            std::from_chars(query.data()+pos+6, end, chunk_size);
+            chunk_size=std::clamp<size_t>(chunk_size, 1, CHUNK_SIZE);
+        }
+        return true;
+    }
+
+    bool send_body(int fd, std::string& out, uint64_t size, bool chunked, size_t chunk_size, uint64_t delay_ns)
+    {
+        auto start=std::chrono::steady_clock::now();
+        uint64_t sent=0;
+        while(sent < size) {
+
+            auto block=size_t(std::min<uint64_t>(size-sent, BLOCK_SIZE));
+            if(chunked) {
+
+                for(size_t pos=0; pos<block; pos+=chunk_size) {
+
+                    auto piece=std::min(block-pos, chunk_size);
+                    char line[24];
+                    out.append(line, size_t(snprintf(line, sizeof(line), "%zx\r\n", piece)));
+                    out.append(m_pattern.data()+pos, piece);
+                    out.append("\r\n"sv);
+                }
+                sent+=block;
+                if(sent==size) {
+
+                    out.append("0\r\n\r\n"sv);
+                }
+                if(!send_all(fd, out)) {
+
+                    return false;
+                }
+            } else {
+
+                // The header goes out with the first block
+                if(!send_all(fd, out, MSG_MORE) || !send_all(fd, std::string_view(m_pattern.data(), block))) {
+
+                    return false;
+                }
+                sent+=block;
+            }
+            out.clear();
+
+            if(delay_ns > 0) {
+
+                std::this_thread::sleep_until(start+std::chrono::nanoseconds(sent*delay_ns));
+            }
+        }
+
+        if(chunked && size==0) {
+
+            out.append("0\r\n\r\n"sv);
+        }
+        return out.empty() || send_all(fd, out);
+    }
+
+    bool respond(int fd, std::string_view head, bool keep_alive)
+    {
+        // "GET <target> HTTP/1.1"
+        auto line=head.substr(0, head.find("\r\n"sv));
+        auto begin=line.find(' ');
+        auto end=line.rfind(' ');
+        uint64_t size=0;
+        auto chunked=false;
+        size_t chunk_size=CHUNK_SIZE;
+        uint64_t delay_ns=0;
+        if(line.substr(0, begin)!="GET"sv || begin==end || !parse_target(line.substr(begin+1, end-begin-1), size, chunked, chunk_size, delay_ns)) {
+
+            send_all(fd, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"sv);
+            return false;
+        }
+
+        std::string out;
+        out.append("HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"sv);
+        if(chunked) {
+
+            out.append("Transfer-Encoding: chunked\r\n"sv);
+        } else {
+
+            out.append("Content-Length: "sv);
+            out.append(std::to_string(size));
+            out.append("\r\n"sv);
+        }
+        out.append(keep_alive ? "\r\n"sv : "Connection: close\r\n\r\n"sv);
+
+        return send_body(fd, out, size, chunked, chunk_size, delay_ns);
+    }
+
+    void serve(int fd)
+    {
+        std::string request;
+        char buffer[4096];
+        for(;;) {
+
+            auto end=request.find("\r\n\r\n"sv);
+            if(end==std::string::npos) {
+
+                if(request.size() > MAX_REQUEST_SIZE) {
+
+                    return;
+                }
+
+                auto size=recv(fd, buffer, sizeof(buffer), 0);
+                if(size==-1 && errno==EINTR) {
+
+                    continue;
+                } else if(size<=0) {
+
+                    return;
+                }
+                request.append(buffer, size_t(size));
+                continue;
+            }
+
+            auto head=std::string_view(request).substr(0, end+2);
+            auto keep_alive=head.find("\r\nConnection: close\r\n"sv)==std::string_view::npos;
+            if(!respond(fd, head, keep_alive) || !keep_alive) {
+
+                return;
+            }
+            request.erase(0, end+4);
+        }
+    }
+
+    void finished(std::list<Worker>::iterator worker)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            close(worker->fd);
+            worker->fd=-1;
+            worker->done=true;
+            --m_open;
+        }
+        m_slot_freed.notify_one();
+    }
+
+    void reap()
+    {
+        std::list<Worker> done;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for(auto it=m_workers.begin(); it!=m_workers.end(); ) {
+
+                auto next=std::next(it);
+                if(it->done) {
+
+                    done.splice(done.end(), m_workers, it);
+                }
+                it=next;
+            }
+        }
+
+        for(auto& worker : done) {
+
+            worker.thread.join();
+        }
+    }
+
+    void accept_connections()
+    {
+        for(;;) {
+
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_slot_freed.wait(lock, [this]() {
+
+                    return m_stopping || m_max_connections==0 || m_open < m_max_connections;
+                });
+                if(m_stopping) {
+
+                    return;
+                }
+            }
+            reap();
+
+            auto fd=accept4(m_listen.get(), nullptr, nullptr, SOCK_CLOEXEC);
+            if(fd==-1) {
+
+                if(errno==EINTR || errno==ECONNABORTED) {
+
+                    continue;
+                }
+                // The listen socket was shut down
+                return;
+            }
+
+            int one=1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if(m_stopping) {
+
+                close(fd);
+                return;
+            }
+
+            ++m_open;
+            auto worker=m_workers.emplace(m_workers.end());
+            worker->fd=fd;
+            worker->thread=std::thread([this, worker, fd]() {
+
+                serve(fd);
+                finished(worker);
+            });
+        }
+    }
+
+public:
+    // Zero max_connections serves any number at once
+    explicit LoopbackServer(size_t max_connections=0):
+        m_listen(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)),
+        m_port(0),
+        m_max_connections(max_connections),
+        m_pattern(BLOCK_SIZE, '\0'),
+        m_open(0),
+        m_stopping(false)
+    {
+        if(m_listen.get()==-1) {
+
+            throw Error(Error::err_init_socket, strerror(errno));
+        }
+
+        for(size_t i=0; i<m_pattern.size(); ++i) {
+
+            m_pattern[i]="abcdefghijklmnopqrstuvwxyz0123456789\n"[i % 37];
+        }
+
+        int one=1;
+        setsockopt(m_listen.get(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        sockaddr_in address{};
+        address.sin_family=AF_INET;
+        address.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        socklen_t length=sizeof(address);
+        if(bind(m_listen.get(), reinterpret_cast<sockaddr*>(&address), sizeof(address))==-1
+            || listen(m_listen.get(), SOMAXCONN)==-1
+            || getsockname(m_listen.get(), reinterpret_cast<sockaddr*>(&address), &length)==-1) {
+
+            throw Error(Error::err_init_socket, strerror(errno));
+        }
+        m_port=ntohs(address.sin_port);
+
+        m_acceptor=std::thread([this]() {
+
+            accept_connections();
+        });
+    }
+
+    LoopbackServer(const LoopbackServer&) = delete;
+    LoopbackServer& operator=(const LoopbackServer&) = delete;
+
+    // Drops the open connections, whatever they were sending
+    ~LoopbackServer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping=true;
+            for(auto& worker : m_workers) {
+
+                if(worker.fd!=-1) {
+
+                    shutdown(worker.fd, SHUT_RDWR);
+                }
+            }
+        }
+        m_slot_freed.notify_all();
+        shutdown(m_listen.get(), SHUT_RDWR);
+        m_acceptor.join();
+
+        for(auto& worker : m_workers) {
+
+            worker.thread.join();
+        }
+    }
+
+    uint16_t port() const
+    {
+        return m_port;
+    }
+
+    // A chunk size of zero keeps CHUNK_SIZE
+    static std::string target(uint64_t size, bool chunked=false, uint64_t delay_ns=0, size_t chunk_size=0)
+    {
+        auto text="/"+std::to_string(size)+(chunked ? "?chunked"s : "?fixed"s);
+        if(delay_ns > 0) {
+
+            text+="&delay="+std::to_string(delay_ns);
+        }
+        if(chunked && chunk_size > 0) {
+
+            text+="&chunk="+std::to_string(chunk_size);
+        }
+        return text;
+    }
+
+    std::string url(uint64_t size, bool chunked=false, uint64_t delay_ns=0, size_t chunk_size=0) const
+    {
+        return "http://127.0.0.1:"+std::to_string(m_port)+target(size, chunked, delay_ns, chunk_size);
+    }
+};
\ No newline at end of file
@@ -0,0 +1,361 @@
+#include "loopback_server.h"
+
+#include "executor.h"
+#include "url_parser.h"
+#include "http_client.h"
+#include "connection_pool.h"
+#include "resolver_cache.h"
+
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef PAGE_LOADER_VERSION
+#define PAGE_LOADER_VERSION "unknown"
+#endif
+
+namespace
+{
+
+constexpr uint64_t MB=1024*1024; //bytes
+
+struct Body
+{
+    uint64_t size;
+    bool chunked;
+    uint64_t delay_ns;
+    size_t chunk_size=0;
+};
+
+struct Scenario
+{
+    const char* name;
+    size_t requests;
+    size_t concurrency;
+    // Pooled keep-alive connections, otherwise one connection per request
+    bool keep_alive;
+    size_t max_connections;
+    std::function<Body(size_t)> body;
+    // Bodies go through the type-erased FunctionSink instead of a sink the client calls directly
+    bool function_sink=false;
+};
+
+// Milliseconds spent in each phase by the requests that succeeded
+struct Phases
+{
+    std::vector<double> connect;
+    std::vector<double> wait;
+    std::vector<double> transfer;
+    std::vector<double> total;
+};
+
+struct Result
+{
+    size_t failed=0;
+    uint64_t bytes=0;
+    double seconds=0;
+    double cpu_seconds=0;
+    std::string backend;
+    Phases phases;
+};
+
+double thread_cpu_seconds()
+{
+    rusage usage{};
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec+usage.ru_stime.tv_sec+(usage.ru_utime.tv_usec+usage.ru_stime.tv_usec)/1e6;
+}
+
+double milliseconds(HttpTimings::Clock::time_point from, HttpTimings::Clock::time_point to)
+{
+    return std::chrono::duration<double, std::milli>(to-from).count();
+}
+
+// Keeps `concurrency` requests in flight on one loop until all of them are done
+template<bool FUNCTION_SINK>
+class Runner
+{
+private:
+    struct Request;
+
+    class Sink
+    {
+    private:
+        Runner* m_runner;
+        size_t m_id;
+        Request* m_request;
+
+    public:
+        Sink(Runner* runner, size_t id, Request* request):
+            m_runner(runner),
+            m_id(id),
+            m_request(request)
+        {}
+
+        Error on_header(const ResponseHeader& header)
+        {
+            return Error(Error::ok);
+        }
+
+        void on_body(std::string_view part_body)
+        {
+            m_request->received+=part_body.size();
+        }
+
+        void on_error(const Error& error)
+        {}
+
+        void on_complete(const Error& error)
+        {
+            m_runner->done(m_id, error);
+        }
+    };
+
+    using Client=std::conditional_t<FUNCTION_SINK, HttpClient, BasicHttpClient<Sink>>;
+
+    struct Request
+    {
+        std::unique_ptr<Client> client;
+        uint64_t expected=0;
+        uint64_t received=0;
+    };
+
+    Loop m_loop;
+    const Scenario& m_scenario;
+    const LoopbackServer& m_server;
+    ConnectionPool m_pool;
+    ResolverCache m_resolver;
+    std::unordered_map<size_t, Request> m_running;
+    size_t m_next;
+    Result m_result;
+
+private:
+    void done(size_t id, const Error& error)
+    {
+        auto& request=m_running[id];
+        auto& timings=request.client->timings();
+        m_result.bytes+=request.received;
+        if(error || request.client->response_header().status_code!=200 || request.received!=request.expected) {
+
+            ++m_result.failed;
+        } else {
+
+            m_result.phases.connect.push_back(milliseconds(timings.start, timings.connected));
+            m_result.phases.wait.push_back(milliseconds(timings.connected, timings.header));
+            m_result.phases.transfer.push_back(milliseconds(timings.header, timings.done));
+            m_result.phases.total.push_back(milliseconds(timings.start, timings.done));
+        }
+
+        // The client is on the call stack, release it on the next iteration
+        m_loop.post([this, id]() {
+
+            m_running.erase(id);
+            start();
+        });
+    }
+
+    void start()
+    {
+        while(m_running.size() < m_scenario.concurrency && m_next < m_scenario.requests) {
+
+            auto id=m_next++;
+            auto body=m_scenario.body(id);
+            auto [error_url, url]=HttpUrlParser::parse(m_server.url(body.size, body.chunked, body.delay_ns, body.chunk_size));
+            auto pool=m_scenario.keep_alive ? &m_pool : nullptr;
+
+            auto& request=m_running[id];
+            request.expected=body.size;
+            if constexpr(FUNCTION_SINK) {
+
+                request.client=std::make_unique<Client>(m_loop, std::move(url), HttpTimeouts(), pool, &m_resolver);
+                request.client->set_content_coding(ContentCoding::IDENTITY);
+                request.client->load_stream([&request](std::string_view part_body, const Error& error) {
+
+                    request.received+=part_body.size();
+                }, [this, id](const Error& error) {
+
+                    done(id, error);
+                });
+            } else {
+
+                request.client=std::make_unique<Client>(m_loop, std::move(url), HttpTimeouts(), pool, &m_resolver, Sink(this, id, &request));
+                request.client->set_content_coding(ContentCoding::IDENTITY);
+                request.client->load();
+            }
+        }
+    }
+
+public:
+    Runner(const Scenario& scenario, const LoopbackServer& server):
+        m_scenario(scenario),
+        m_server(server),
+        m_pool(m_loop, scenario.concurrency, scenario.concurrency),
+        m_resolver(m_loop),
+        m_next(0)
+    {
+        m_result.backend=m_loop.ring() ? "io_uring" : "epoll";
+    }
+
+    Result run()
+    {
+        auto cpu=thread_cpu_seconds();
+        auto begin=std::chrono::steady_clock::now();
+        start();
+        m_loop.run();
+        m_result.seconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        m_result.cpu_seconds=thread_cpu_seconds()-cpu;
+        return std::move(m_result);
+    }
+};
+
+// Nearest rank
+double percentile(const std::vector<double>& sorted, double p)
+{
+    if(sorted.empty()) {
+
+        return 0;
+    }
+    auto rank=size_t(std::ceil(p*sorted.size()));
+    return sorted[std::max<size_t>(rank, 1)-1];
+}
+
+void write_percentiles(std::ostream& out, const char* name, std::vector<double>& values, bool last=false)
+{
+    std::sort(values.begin(), values.end());
+    out << "        \"" << name << "\": {"
+        << "\"p50\": " << percentile(values, 0.5)
+        << ", \"p90\": " << percentile(values, 0.9)
+        << ", \"p99\": " << percentile(values, 0.99)
+        << ", \"max\": " << (values.empty() ? 0 : values.back())
+        << "}" << (last ? "\n" : ",\n");
+}
+
+void write_result(std::ostream& out, const Scenario& scenario, Result& result, bool last)
+{
+    auto requests=scenario.requests-result.failed;
+    auto mb=double(result.bytes)/MB;
+    out << "    {\n"
+        << "      \"name\": \"" << scenario.name << "\",\n"
+        << "      \"requests\": " << scenario.requests << ",\n"
+        << "      \"concurrency\": " << scenario.concurrency << ",\n"
+        << "      \"keep_alive\": " << (scenario.keep_alive ? "true" : "false") << ",\n"
+        << "      \"max_connections\": " << scenario.max_connections << ",\n"
+        << "      \"failed\": " << result.failed << ",\n"
+        << "      \"bytes\": " << result.bytes << ",\n"
+        << "      \"seconds\": " << result.seconds << ",\n"
+        << "      \"mb_per_s\": " << mb/result.seconds << ",\n"
+        << "      \"requests_per_s\": " << requests/result.seconds << ",\n"
+        << "      \"cpu_seconds\": " << result.cpu_seconds << ",\n"
+        << "      \"cpu_ms_per_mb\": " << (mb > 0 ? result.cpu_seconds*1000/mb : 0) << ",\n"
+        << "      \"latency_ms\": {\n";
+    write_percentiles(out, "connect", result.phases.connect);
+    write_percentiles(out, "wait", result.phases.wait);
+    write_percentiles(out, "transfer", result.phases.transfer);
+    write_percentiles(out, "total", result.phases.total, true);
+    out << "      }\n"
+        << "    }" << (last ? "\n" : ",\n");
+}
+
+std::vector<Scenario> make_scenarios(double scale)
+{
+    auto scaled=[scale](double value) {
+
+        return std::max<uint64_t>(uint64_t(value*scale), 1);
+    };
+
+    auto large=scaled(256*MB);
+    auto small_pages=scaled(20000);
+    auto mixed=scaled(4000);
+    auto throttled=scaled(64);
+    auto small_chunks=scaled(64*MB);
+
+    static constexpr uint64_t MIXED_SIZES[]={512, 4*1024, 32*1024, 256*1024, 2*MB};
+
+    return {
+        {"large_fixed", 1, 1, true, 0, [large](size_t) { return Body{large, false, 0}; }},
+        {"large_chunked", 1, 1, true, 0, [large](size_t) { return Body{large, true, 0}; }},
+        {"small_pages", small_pages, 16, true, 0, [](size_t) { return Body{4*1024, false, 0}; }},
+        {"mixed", mixed, 256, false, 128, [](size_t i) {
+
+            return Body{MIXED_SIZES[i % std::size(MIXED_SIZES)], i % 2 == 1, 0};
+        }},
+        // 20 MB/s per connection, more clients than the server takes at once
+        {"throttled", throttled, 32, false, 8, [](size_t) { return Body{MB, false, 50}; }},
+        // One body part per 64 byte chunk: the cost of calling the sink shows
+        {"small_chunks", 1, 1, true, 0, [small_chunks](size_t) { return Body{small_chunks, true, 0, 64}; }},
+        {"small_chunks_function", 1, 1, true, 0, [small_chunks](size_t) { return Body{small_chunks, true, 0, 64}; }, true},
+    };
+}
+
+}
+
+// page_loader_bench [scale] [json file]; the scale multiplies request counts and the
+// large body size, the results go to stdout unless a file is given
+int main(int argc, const char* args[])
+{
+    auto scale=argc > 1 ? std::strtod(args[1], nullptr) : 1.0;
+    if(scale <= 0) {
+
+        std::cerr << "Bad input. Correct: page_loader_bench [scale] [json file]" << std::endl;
+        return 1;
+    }
+
+    std::ofstream file;
+    if(argc > 2) {
+
+        file.open(args[2]);
+        if(!file) {
+
+            std::cerr << "Can't open " << args[2] << std::endl;
+            return 1;
+        }
+    }
+    auto& out=file.is_open() ? file : std::cout;
+
+    auto scenarios=make_scenarios(scale);
+    std::vector<Result> results;
+    try {
+
+        for(auto& scenario : scenarios) {
+
+            LoopbackServer server(scenario.max_connections);
+            results.push_back(scenario.function_sink ? Runner<true>(scenario, server).run() : Runner<false>(scenario, server).run());
+
+            auto& result=results.back();
+            std::cerr << scenario.name << ": " << double(result.bytes)/MB/result.seconds << " MB/s, "
+                << (scenario.requests-result.failed)/result.seconds << " req/s, failed " << result.failed << std::endl;
+        }
+    } catch(const Error& error) {
+
+        std::cerr << "Error: " << error.message() << std::endl;
+        return 1;
+    }
+
+    out << "{\n"
+        << "  \"version\": \"" << PAGE_LOADER_VERSION << "\",\n"
+        << "  \"backend\": \"" << results.front().backend << "\",\n"
+        << "  \"scale\": " << scale << ",\n"
+        << "  \"scenarios\": [\n";
+    for(size_t i=0; i<scenarios.size(); ++i) {
+
+        write_result(out, scenarios[i], results[i], i+1==scenarios.size());
+    }
+    out << "  ]\n"
+        << "}" << std::endl;
+
+    size_t failed=0;
+    for(auto& result : results) {
+
+        failed+=result.failed;
+    }
+    return failed == 0 ? 0 : 2;
+}
\ No newline at end of file
@@ -0,0 +1,105 @@
+#include "url_parser.h"
+#include "http_client.h"
+#include "corpus.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+namespace
+{
+
+// items is how many urls, lines or headers one run parses and size their total length
+template<typename F>
+void measure(const char* name, std::string_view set, const char* unit, size_t items, size_t size, size_t iterations, F&& run)
+{
+    size_t checksum=0;
+    auto start=std::chrono::steady_clock::now();
+    for(size_t i=0; i<iterations; ++i) {
+
+        checksum+=run();
+    }
+    auto elapsed=std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now()-start).count();
+
+    std::cout << name
+        << " set=" << set
+        << " bytes=" << size
+        << " ns/" << unit << "=" << elapsed/iterations/items
+        << " ns/byte=" << elapsed/iterations/size
+        << " checksum=" << checksum
+        << std::endl;
+}
+
+size_t parse_url(std::string_view text)
+{
+    auto [error, url]=HttpUrlParser::parse(text);
+    return error ? 0 : url.port+url.host.size()+url.target.size();
+}
+
+size_t parse_status_line(std::string_view line)
+{
+    auto [error_version, version, pos]=ResponseHeaderParser::parse_version(line, 0);
+    if(error_version) {
+
+        return 0;
+    }
+    auto [error_status, status_code, end]=ResponseHeaderParser::parse_status_code(line, pos);
+    return error_status ? 0 : status_code+end;
+}
+
+size_t parse_header(ResponseHeaderParser& parser, std::string_view text)
+{
+    ResponseHeader header;
+    parser.reset();
+    auto [error, header_size]=parser.parse(text, header);
+    return error ? 0 : header_size+header.status_code+header.content_length().value_or(0);
+}
+
+}
+
+int main(int argc, const char* args[])
+{
+    size_t iterations=argc > 1 ? std::strtoul(args[1], nullptr, 10) : 200000;
+
+    std::cout << "url" << std::endl;
+    size_t total_size=0;
+    for(auto text : URL_SET) {
+
+        auto url=std::string_view(text);
+        total_size+=url.size();
+        measure("  parse      ", url.substr(7, url.find('/', 7)-7), "url", 1, url.size(), iterations, [url]() {
+
+            return parse_url(url);
+        });
+    }
+    measure("  parse      ", "all", "url", std::size(URL_SET), total_size, iterations, []() {
+
+        size_t sum=0;
+        for(auto text : URL_SET) {
+
+            sum+=parse_url(text);
+        }
+        return sum;
+    });
+
+    ResponseHeaderParser parser;
+    for(auto& [name, text] : HEADER_SETS) {
+
+        auto header=std::string_view(text);
+        auto line=header.substr(0, header.find("\r\n"sv));
+
+        std::cout << "response " << name << std::endl;
+        measure("  status line", name, "line", 1, line.size(), iterations, [line]() {
+
+            return parse_status_line(line);
+        });
+        measure("  header     ", name, "header", 1, header.size(), iterations, [&parser, header]() {
+
+            return parse_header(parser, header);
+        });
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,49 @@
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+// Stands in for libFuzzer where it is missing: runs the harness once on every file
+// given, directories are walked, so corpora and crash inputs can be replayed
+int main(int argc, const char* args[])
+{
+    if(argc < 2) {
+
+        std::cerr << "Bad input. Correct: " << args[0] << " <file|directory>..." << std::endl;
+        return 1;
+    }
+
+    size_t runs=0;
+    auto run=[&runs](const std::filesystem::path& path) {
+
+        std::ifstream file(path, std::ios::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+        ++runs;
+    };
+
+    for(int i=1; i<argc; ++i) {
+
+        if(std::filesystem::is_directory(args[i])) {
+
+            for(auto& entry : std::filesystem::recursive_directory_iterator(args[i])) {
+
+                if(entry.is_regular_file()) {
+
+                    run(entry.path());
+                }
+            }
+        } else {
+
+            run(args[i]);
+        }
+    }
+
+    std::cerr << "Executed " << runs << " inputs" << std::endl;
+    return 0;
+}
\ No newline at end of file
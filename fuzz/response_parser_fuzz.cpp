@@ -0,0 +1,107 @@
+#include "http_client.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string_view>
+
+namespace
+{
+
+void check(bool condition)
+{
+    if(!condition) {
+
+        std::abort();
+    }
+}
+
+// Fed in one piece or a few bytes at a time, the header parses the same
+void parse_header(std::string_view data, size_t step)
+{
+    ResponseHeaderParser whole_parser;
+    ResponseHeader whole;
+    auto [whole_error, whole_size]=whole_parser.parse(data, whole);
+
+    ResponseHeaderParser split_parser;
+    ResponseHeader split;
+    auto split_error=false;
+    size_t split_size=0;
+    for(size_t end=std::min(step, data.size()); ; end=std::min(end+step, data.size())) {
+
+        std::tie(split_error, split_size)=split_parser.parse(data.substr(0, end), split);
+        if(split_error || split_size > 0 || end==data.size()) {
+
+            break;
+        }
+    }
+
+    check(whole_error==split_error && whole_size==split_size && whole_size <= data.size());
+    if(!whole_error && whole_size > 0) {
+
+        check(whole.status_code>=100 && whole.status_code<600);
+        check(whole.status_code==split.status_code && whole.version==split.version && whole.reason_phrase==split.reason_phrase);
+        check(whole.content_length()==split.content_length() && whole.is_chunked()==split.is_chunked());
+        check(whole.get(HeaderField::content_encoding)==split.get(HeaderField::content_encoding));
+    }
+}
+
+// Splits the data into responses the way a pipelined connection does
+void read_responses(std::string_view data, size_t step, bool decode)
+{
+    ResponseReader reader;
+    reader.set_decoding(decode);
+    uint64_t delivered=0;
+    while(!data.empty()) {
+
+        auto piece=data.substr(0, step);
+        auto [error, consumed]=reader.feed(piece, [&delivered](std::string_view part_body) {
+
+            delivered+=part_body.size();
+        });
+        if(error) {
+
+            return;
+        }
+
+        // Only the end of a response leaves bytes over
+        check(consumed==piece.size() || (reader.is_done() && consumed < piece.size()));
+        if(!decode) {
+
+            check(delivered==reader.body_size());
+        }
+        data.remove_prefix(consumed);
+
+        if(reader.is_done()) {
+
+            auto length=reader.header().content_length();
+            if(!decode && length && !reader.header().has_transfer_encoding() && reader.header().status_code!=204 && reader.header().status_code!=304 && reader.header().status_code>=200) {
+
+                check(reader.body_size()==*length);
+            }
+            reader.reset();
+            delivered=0;
+        }
+    }
+    reader.finish_on_eof();
+}
+
+}
+
+// The first byte picks the read size and whether bodies are decoded
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    if(size==0) {
+
+        return 0;
+    }
+
+    auto step=size_t(data[0] & 0x7f)+1;
+    auto decode=(data[0] & 0x80)!=0;
+    auto text=std::string_view(reinterpret_cast<const char*>(data)+1, size-1);
+
+    parse_header(text, step);
+    read_responses(text, step, decode);
+    return 0;
+}
\ No newline at end of file
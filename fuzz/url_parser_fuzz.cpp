@@ -0,0 +1,31 @@
+#include "url_parser.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+// Anything accepted must describe itself: the url put back together from the
+// parts parses to the same parts
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    auto text=std::string_view(reinterpret_cast<const char*>(data), size);
+    auto [error, url]=HttpUrlParser::parse(text);
+    if(error) {
+
+        return 0;
+    }
+
+    if(url.scheme!="http" || url.target.empty() || url.target[0]!='/' || url.host.find_first_of(":/"sv)!=std::string::npos) {
+
+        std::abort();
+    }
+
+    auto rebuilt="http://"+url.host+":"+std::to_string(url.port)+url.target;
+    auto [error_again, again]=HttpUrlParser::parse(rebuilt);
+    if(error_again || again.host!=url.host || again.port!=url.port || again.target!=url.target) {
+
+        std::abort();
+    }
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,336 @@
+#pragma once
+
+#include "executor.h"
+#include "stream.h"
+#include "url_parser.h"
+#include "http_client.h"
+#include "connection_pool.h"
+#include "resolver_cache.h"
+#include "pipeline_client.h"
+
+#include <deque>
+#include <istream>
+#include <ostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <cctype>
+
+// Streams URLs from the input and keeps up to `concurrency` downloads in flight on one loop.
+// With a pipeline depth requests to the same host share one pipelined connection.
+class BatchLoader
+{
+private:
+    static constexpr size_t MAX_NAME_SIZE=128; //chars
+    static constexpr size_t PREFETCH_AHEAD=64; //urls
+
+    struct Job
+    {
+        size_t id;
+        std::string url;
+        std::string path;
+        std::unique_ptr<OutFileStream> out;
+        std::unique_ptr<HttpClient> client;
+        PipelineClient* pipeline=nullptr;
+        size_t bytes=0;
+        size_t pending_writes=0;
+        StatusCode status=0;
+        bool loaded=false;
+        Error error=Error(Error::ok);
+    };
+
+    Loop& m_loop;
+    std::istream& m_input;
+    std::ostream& m_status;
+    std::string m_out_dir;
+    size_t m_concurrency;
+    size_t m_pipeline_depth;
+    ContentCoding m_coding;
+    uint64_t m_write_buffer;
+    HttpTimeouts m_timeouts;
+    Metrics* m_metrics;
+    ConnectionPool m_pool;
+    ResolverCache m_resolver;
+    std::deque<std::string> m_lookahead;
+    std::unordered_map<size_t, std::unique_ptr<Job>> m_jobs;
+    std::unordered_map<std::string, std::unique_ptr<PipelineClient>> m_pipelines;
+    size_t m_next_id;
+    size_t m_failed;
+
+private:
+    static std::string_view trim(std::string_view line)
+    {
+        auto begin=line.find_first_not_of(" \t\r"sv);
+        if(begin==std::string_view::npos) {
+
+            return {};
+        }
+        return line.substr(begin, line.find_last_not_of(" \t\r"sv)-begin+1);
+    }
+
+    std::string make_path(size_t id, const HttpUrl& url) const
+    {
+        auto name=std::to_string(id)+"_"+url.host+url.target;
+        if(name.size() > MAX_NAME_SIZE) {
+
+            name.resize(MAX_NAME_SIZE);
+        }
+
+        std::replace_if(name.begin(), name.end(), [](char c) {
+
+            return !std::isalnum(static_cast<unsigned char>(c)) && c!='.' && c!='-' && c!='_';
+        }, '_');
+
+        return m_out_dir+"/"+name;
+    }
+
+    void report(size_t id, std::string_view url, StatusCode status, size_t bytes, std::string_view path, const Error& error)
+    {
+        if(error) {
+
+            ++m_failed;
+        }
+
+        m_status << id << '\t' << status << '\t' << bytes << '\t' << path << '\t' << url << '\t'
+            << (error ? error.message() : "ok"s) << '\n';
+    }
+
+    void try_complete(Job& job)
+    {
+        if(!job.loaded || job.pending_writes>0) {
+
+            return;
+        }
+
+        report(job.id, job.url, job.status, job.bytes, job.path, job.error);
+
+        // The client may still be on the call stack, release it on the next iteration
+        m_loop.post([this, id=job.id]() {
+
+            m_jobs.erase(id);
+            start_jobs();
+            release_pipelines();
+        });
+    }
+
+    void release_pipelines()
+    {
+        for(auto it=m_pipelines.begin(); it!=m_pipelines.end(); ) {
+
+            it=it->second->is_idle() ? m_pipelines.erase(it) : std::next(it);
+        }
+    }
+
+    void write_part(Job& job, std::string_view part_body)
+    {
+        if(part_body.empty()) {
+
+            return;
+        }
+
+        ++job.pending_writes;
+        job.out->write(part_body, [this, &job](size_t transferd_bytes, const Error& error) {
+
+            --job.pending_writes;
+            job.bytes+=transferd_bytes;
+            if(error && !job.error) {
+
+                job.error=error;
+            }
+            try_complete(job);
+        });
+
+        // The pipeline is shared, it waits for this file and then reads on
+        if(job.pipeline && job.out->is_congested()) {
+
+            job.pipeline->pause();
+            job.out->when_drained(&job, [pipeline=job.pipeline]() {
+
+                pipeline->resume();
+            });
+        }
+    }
+
+    void loaded(Job& job, StatusCode status, const Error& error)
+    {
+        job.loaded=true;
+        job.status=status;
+        if(error) {
+
+            job.error=error;
+        }
+        try_complete(job);
+    }
+
+    PipelineClient& pipeline(const HttpUrl& url)
+    {
+        auto key=url.host+":"+std::to_string(url.port);
+        auto it=m_pipelines.find(key);
+        if(it==m_pipelines.end()) {
+
+            it=m_pipelines.emplace(key, std::make_unique<PipelineClient>(m_loop, url.host, url.port, m_pipeline_depth, m_timeouts, &m_pool, &m_resolver)).first;
+            it->second->set_content_coding(m_coding);
+            it->second->set_metrics(m_metrics);
+        }
+        return *it->second;
+    }
+
+    void start(std::string_view line)
+    {
+        auto id=m_next_id++;
+        auto [error_url, url]=HttpUrlParser::parse(line);
+        if(error_url) {
+
+            report(id, line, 0, 0, {}, Error(Error::err_undefined, "bad url"));
+            return;
+        }
+
+        auto job=std::make_unique<Job>();
+        job->id=id;
+        job->url=std::string(line.begin(), line.end());
+        job->path=make_path(id, url);
+
+        try {
+
+            job->out=std::make_unique<OutFileStream>(m_loop, job->path.c_str());
+            job->out->set_watermarks(m_write_buffer, m_write_buffer/4);
+            if(m_pipeline_depth==0) {
+
+                job->client=std::make_unique<HttpClient>(m_loop, std::move(url), m_timeouts, &m_pool, &m_resolver);
+                job->client->set_content_coding(m_coding);
+                job->client->set_metrics(m_metrics);
+            }
+        } catch(const Error& error) {
+
+            report(id, line, 0, 0, job->path, error);
+            return;
+        }
+
+        auto& ref=*job;
+        m_jobs.emplace(id, std::move(job));
+
+        if(m_pipeline_depth > 0) {
+
+            ref.pipeline=&pipeline(url);
+            ref.pipeline->get(url.target, [this, &ref](std::string_view part_body) {
+
+                write_part(ref, part_body);
+            }, [this, &ref](const ResponseHeader& header, const Error& error) {
+
+                loaded(ref, header.status_code, error);
+            });
+            return;
+        }
+
+        ref.client->load_file(*ref.out, [this, &ref](const Error& error) {
+
+            ref.bytes=ref.client->file_size();
+            loaded(ref, ref.client->response_header().status_code, error);
+        });
+    }
+
+    // Reads ahead of the running jobs so upcoming hostnames resolve in the background
+    bool next_url(std::string& url)
+    {
+        std::string line;
+        while(m_lookahead.size() < PREFETCH_AHEAD && std::getline(m_input, line)) {
+
+            auto trimmed=trim(line);
+            if(trimmed.empty() || trimmed.front()=='#') {
+
+                continue;
+            }
+
+            if(auto [error, parsed]=HttpUrlParser::parse(trimmed); !error) {
+
+                m_resolver.prefetch(parsed.host);
+            }
+            m_lookahead.emplace_back(trimmed);
+        }
+
+        if(m_lookahead.empty()) {
+
+            return false;
+        }
+
+        url=std::move(m_lookahead.front());
+        m_lookahead.pop_front();
+        return true;
+    }
+
+    void start_jobs()
+    {
+        std::string url;
+        while(m_jobs.size() < m_concurrency && next_url(url)) {
+
+            start(url);
+        }
+    }
+
+public:
+    BatchLoader(Loop& loop, std::istream& input, std::ostream& status, std::string out_dir, size_t concurrency, size_t max_idle_per_host=8, size_t pipeline_depth=0, const HttpTimeouts& timeouts=HttpTimeouts()):
+        m_loop(loop),
+        m_input(input),
+        m_status(status),
+        m_out_dir(std::move(out_dir)),
+        m_concurrency(std::max<size_t>(concurrency, 1)),
+        m_pipeline_depth(pipeline_depth),
+        m_coding(ContentCoding::DECODE),
+        m_write_buffer(OutFileStream::HIGH_WATER),
+        m_timeouts(timeouts),
+        m_metrics(nullptr),
+        m_pool(loop, max_idle_per_host, std::max<size_t>(concurrency, max_idle_per_host)),
+        m_resolver(loop),
+        m_next_id(0),
+        m_failed(0)
+    {}
+
+    BatchLoader(const BatchLoader&) = delete;
+    BatchLoader& operator=(const BatchLoader&) = delete;
+
+    // Call before run()
+    void set_content_coding(ContentCoding coding)
+    {
+        m_coding=coding;
+    }
+
+    // Bytes each file may have queued before its download waits for the disk; call before run()
+    void set_write_buffer(uint64_t bytes)
+    {
+        m_write_buffer=bytes;
+    }
+
+    // Every download is recorded there, pipelined ones under the host of their pipeline; call before run()
+    void set_metrics(Metrics* metrics)
+    {
+        m_metrics=metrics;
+    }
+
+    void run()
+    {
+        start_jobs();
+        m_loop.run();
+        m_status.flush();
+    }
+
+    const PoolStats& pool_stats() const
+    {
+        return m_pool.stats();
+    }
+
+    const ResolverStats& resolver_stats() const
+    {
+        return m_resolver.stats();
+    }
+
+    size_t failed() const
+    {
+        return m_failed;
+    }
+
+    size_t total() const
+    {
+        return m_next_id;
+    }
+};
\ No newline at end of file
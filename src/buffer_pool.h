@@ -0,0 +1,318 @@
+#pragma once
+
+#include "error.h"
+
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
+#include <array>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+class BufferPool;
+
+// A block borrowed from the pool; it goes back when the handle is destroyed
+class PooledBuffer
+{
+friend class BufferPool;
+
+private:
+    BufferPool* m_pool;
+    char* m_data;
+    size_t m_size;
+
+private:
+    PooledBuffer(BufferPool* pool, char* data, size_t size):
+        m_pool(pool),
+        m_data(data),
+        m_size(size)
+    {}
+
+public:
+    PooledBuffer():
+        PooledBuffer(nullptr, nullptr, 0)
+    {}
+
+    PooledBuffer(PooledBuffer&& other):
+        PooledBuffer(other.m_pool, other.m_data, other.m_size)
+    {
+        other.m_pool=nullptr;
+        other.m_data=nullptr;
+        other.m_size=0;
+    }
+
+    PooledBuffer& operator=(PooledBuffer&& other)
+    {
+        if(this != &other) {
+
+            reset();
+            std::swap(m_pool, other.m_pool);
+            std::swap(m_data, other.m_data);
+            std::swap(m_size, other.m_size);
+        }
+        return *this;
+    }
+
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    ~PooledBuffer()
+    {
+        reset();
+    }
+
+    inline void reset();
+
+    char* data() const
+    {
+        return m_data;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+};
+
+// Receive buffers shared by the clients of a loop. Blocks come in power of two
+// sizes from MIN_BLOCK to MAX_BLOCK and are carved from slabs that are never
+// returned while the pool lives; slabs are advised to use transparent huge pages.
+class BufferPool
+{
+public:
+    static constexpr size_t MIN_BLOCK=4*1024; //bytes
+    static constexpr size_t MAX_BLOCK=256*1024; //bytes
+    static constexpr size_t SLAB_SIZE=2*1024*1024; //bytes
+
+private:
+    static constexpr size_t CLASSES=7;
+
+    static_assert(MIN_BLOCK << (CLASSES-1) == MAX_BLOCK, "a class for every block size");
+
+    struct Slab
+    {
+        void* data;
+
+        explicit Slab(void* memory):
+            data(memory)
+        {}
+
+        Slab(Slab&& other):
+            data(other.data)
+        {
+            other.data=nullptr;
+        }
+
+        Slab(const Slab&) = delete;
+        Slab& operator=(const Slab&) = delete;
+
+        ~Slab()
+        {
+            if(data) {
+
+                munmap(data, SLAB_SIZE);
+            }
+        }
+    };
+
+    std::vector<Slab> m_slabs;
+    std::array<std::vector<char*>, CLASSES> m_free;
+    size_t m_in_use;
+
+private:
+    static size_t class_of(size_t size)
+    {
+        size_t index=0;
+        for(auto block=MIN_BLOCK; block < size && index+1 < CLASSES; block*=2) {
+
+            ++index;
+        }
+        return index;
+    }
+
+    void add_slab(size_t index)
+    {
+        auto memory=mmap(nullptr, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(memory == MAP_FAILED) {
+
+            throw Error(Error::err_init_loop, strerror(errno));
+        }
+
+        // Only a hint: fewer TLB misses when the system allows it
+        madvise(memory, SLAB_SIZE, MADV_HUGEPAGE);
+        m_slabs.emplace_back(memory);
+
+        auto block=MIN_BLOCK << index;
+        auto& free=m_free[index];
+        for(auto offset=SLAB_SIZE; offset >= block; offset-=block) {
+
+            free.push_back(static_cast<char*>(memory)+offset-block);
+        }
+    }
+
+public:
+    BufferPool():
+        m_in_use(0)
+    {}
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // The block is at least size bytes up to MAX_BLOCK
+    PooledBuffer acquire(size_t size)
+    {
+        auto index=class_of(size);
+        if(m_free[index].empty()) {
+
+            add_slab(index);
+        }
+
+        auto data=m_free[index].back();
+        m_free[index].pop_back();
+        m_in_use+=MIN_BLOCK << index;
+        return PooledBuffer(this, data, MIN_BLOCK << index);
+    }
+
+    void release(char* data, size_t size)
+    {
+        m_free[class_of(size)].push_back(data);
+        m_in_use-=size;
+    }
+
+    // Bytes lent out right now
+    size_t in_use() const
+    {
+        return m_in_use;
+    }
+
+    size_t reserved() const
+    {
+        return m_slabs.size()*SLAB_SIZE;
+    }
+};
+
+void PooledBuffer::reset()
+{
+    if(m_pool) {
+
+        m_pool->release(m_data, m_size);
+        m_pool=nullptr;
+        m_data=nullptr;
+        m_size=0;
+    }
+}
+
+// Coroutine frames of a loop. A freed frame goes on the free list of its size
+// class and the next frame of that class reuses it, so a steady state of requests
+// does not allocate; frames above MAX_FRAME come from the heap.
+class FramePool
+{
+public:
+    static constexpr size_t GRANULE=64; //bytes
+    static constexpr size_t MAX_FRAME=4096; //bytes
+
+private:
+    static constexpr size_t CLASSES=MAX_FRAME/GRANULE;
+
+    std::array<std::vector<void*>, CLASSES> m_free;
+    size_t m_allocated;
+    size_t m_in_use;
+
+public:
+    FramePool():
+        m_allocated(0),
+        m_in_use(0)
+    {}
+
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    ~FramePool()
+    {
+        for(auto& free : m_free) {
+
+            for(auto frame : free) {
+
+                ::operator delete(frame);
+            }
+        }
+    }
+
+    void* allocate(size_t size)
+    {
+        ++m_in_use;
+        if(size > MAX_FRAME) {
+
+            ++m_allocated;
+            return ::operator new(size);
+        }
+
+        auto& free=m_free[(size-1)/GRANULE];
+        if(free.empty()) {
+
+            ++m_allocated;
+            return ::operator new(((size-1)/GRANULE+1)*GRANULE);
+        }
+
+        auto frame=free.back();
+        free.pop_back();
+        return frame;
+    }
+
+    void deallocate(void* frame, size_t size)
+    {
+        --m_in_use;
+        if(size > MAX_FRAME) {
+
+            ::operator delete(frame);
+            return;
+        }
+        m_free[(size-1)/GRANULE].push_back(frame);
+    }
+
+    // Frames taken from the heap so far; it stops growing once the pool is warm
+    size_t allocated() const
+    {
+        return m_allocated;
+    }
+
+    size_t in_use() const
+    {
+        return m_in_use;
+    }
+};
+
+// Read size that follows the transfer: it doubles while reads fill the buffer
+// and halves when they come back mostly empty
+class AdaptiveReadSize
+{
+private:
+    size_t m_size;
+
+public:
+    AdaptiveReadSize():
+        m_size(BufferPool::MIN_BLOCK)
+    {}
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    void update(size_t bytes)
+    {
+        if(bytes >= m_size && m_size < BufferPool::MAX_BLOCK) {
+
+            m_size*=2;
+        } else if(bytes < m_size/4 && m_size > BufferPool::MIN_BLOCK) {
+
+            m_size/=2;
+        }
+    }
+
+    void reset()
+    {
+        m_size=BufferPool::MIN_BLOCK;
+    }
+};
\ No newline at end of file
@@ -0,0 +1,188 @@
+#pragma once
+
+#include "error.h"
+
+#include <cstdint>
+#include <string_view>
+#include <tuple>
+
+// Incremental Transfer-Encoding: chunked decoder. Framing is parsed byte by byte
+// with the state kept between calls, so a chunk-size line may span any number
+// of buffers; chunk payload is handed out as views into the input.
+class ChunkedDecoder
+{
+public:
+    static constexpr uint32_t MAX_SIZE_DIGITS=15;
+    static constexpr uint32_t MAX_TRAILER_SIZE=4096; //bytes
+
+private:
+    enum State
+    {
+        SIZE,
+        EXTENSION,
+        SIZE_LF,
+        DATA,
+        DATA_CR,
+        DATA_LF,
+        TRAILER,
+        TRAILER_FIELD,
+        TRAILER_LF,
+        DONE
+    };
+
+    State m_state;
+    uint64_t m_chunk_left;
+    uint32_t m_digits;
+    uint32_t m_trailer_size;
+
+private:
+    static int hex_value(char c)
+    {
+        if(c >= '0' && c <= '9') {
+
+            return c-'0';
+        } else if(c >= 'a' && c <= 'f') {
+
+            return c-'a'+10;
+        } else if(c >= 'A' && c <= 'F') {
+
+            return c-'A'+10;
+        }
+        return -1;
+    }
+
+    bool size_line_done()
+    {
+        if(m_digits==0) {
+
+            return false;
+        }
+
+        m_state=m_chunk_left>0 ? DATA : TRAILER;
+        return true;
+    }
+
+    // Advances the framing by one byte, false on malformed input
+    bool step(char c)
+    {
+        switch(m_state) {
+        case SIZE:
+            if(auto value=hex_value(c); value >= 0) {
+
+                if(++m_digits > MAX_SIZE_DIGITS) {
+
+                    return false;
+                }
+                m_chunk_left=m_chunk_left*16+value;
+                return true;
+            } else if(c==';' || c==' ' || c=='\t') {
+
+                m_state=EXTENSION;
+                return m_digits>0;
+            } else if(c=='\r') {
+
+                m_state=SIZE_LF;
+                return true;
+            } else if(c=='\n') {
+
+                return size_line_done();
+            }
+            return false;
+        case EXTENSION:
+            if(c=='\n') {
+
+                return size_line_done();
+            }
+            return true;
+        case SIZE_LF:
+            return c=='\n' && size_line_done();
+        case DATA_CR:
+            if(c=='\r') {
+
+                m_state=DATA_LF;
+                return true;
+            }
+            m_state=SIZE;
+            return c=='\n';
+        case DATA_LF:
+            m_state=SIZE;
+            return c=='\n';
+        case TRAILER:
+        case TRAILER_FIELD:
+        case TRAILER_LF:
+            if(++m_trailer_size > MAX_TRAILER_SIZE) {
+
+                return false;
+            }
+
+            if(m_state==TRAILER_LF) {
+
+                m_state=DONE;
+                return c=='\n';
+            } else if(m_state==TRAILER_FIELD) {
+
+                m_state=c=='\n' ? TRAILER : TRAILER_FIELD;
+            } else if(c=='\r') {
+
+                m_state=TRAILER_LF;
+            } else {
+
+                m_state=c=='\n' ? DONE : TRAILER_FIELD;
+            }
+            return true;
+        default:
+            return false;
+        }
+    }
+
+public:
+    ChunkedDecoder():
+        m_state(SIZE),
+        m_chunk_left(0),
+        m_digits(0),
+        m_trailer_size(0)
+    {}
+
+    void reset()
+    {
+        m_state=SIZE;
+        m_chunk_left=0;
+        m_digits=0;
+        m_trailer_size=0;
+    }
+
+    // Returns how many bytes of data belong to the chunked body; payload goes to handler
+    template<typename T>
+    std::tuple<Error, size_t> feed(std::string_view data, T&& handler)
+    {
+        auto pos=size_t(0);
+        while(pos < data.size() && m_state!=DONE) {
+
+            if(m_state==DATA) {
+
+                auto size=size_t(std::min<uint64_t>(data.size()-pos, m_chunk_left));
+                handler(data.substr(pos, size));
+                pos+=size;
+                m_chunk_left-=size;
+                if(m_chunk_left==0) {
+
+                    m_state=DATA_CR;
+                    m_digits=0;
+                }
+                continue;
+            }
+
+            if(!step(data[pos])) {
+
+                return {Error(Error::err_parse_chunk), pos};
+            }
+            ++pos;
+        }
+        return {Error(Error::ok), pos};
+    }
+
+    bool is_done() const
+    {
+        return m_state==DONE;
+    }
+};
\ No newline at end of file
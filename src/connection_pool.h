@@ -0,0 +1,172 @@
+#pragma once
+
+#include "executor.h"
+#include "endpoint.h"
+#include "stream.h"
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+
+struct PoolStats
+{
+    size_t created=0;
+    size_t reused=0;
+    size_t released=0;
+    size_t stale=0;
+    size_t evicted=0;
+    size_t closed=0;
+
+    double reuse_rate() const
+    {
+        return created+reused > 0 ? double(reused)/double(created+reused) : 0.0;
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, const PoolStats& stats)
+    {
+        return out << "connections: created=" << stats.created
+            << " reused=" << stats.reused
+            << " released=" << stats.released
+            << " stale=" << stats.stale
+            << " evicted=" << stats.evicted
+            << " closed=" << stats.closed
+            << " reuse_rate=" << stats.reuse_rate();
+    }
+};
+
+// Idle keep-alive connections keyed by resolved address and port
+class ConnectionPool
+{
+public:
+    using Clock=std::chrono::steady_clock;
+
+private:
+    struct Idle
+    {
+        std::unique_ptr<TcpStream> stream;
+        Clock::time_point since;
+    };
+
+    Loop& m_loop;
+    size_t m_max_idle_per_host;
+    size_t m_max_idle;
+    std::chrono::milliseconds m_idle_timeout;
+    std::unordered_map<TcpEndpoint, std::deque<Idle>, TcpEndpointHash> m_idle;
+    size_t m_idle_count;
+    PoolStats m_stats;
+
+private:
+    void evict_oldest()
+    {
+        auto oldest=m_idle.end();
+        for(auto it=m_idle.begin(); it!=m_idle.end(); ++it) {
+
+            if(!it->second.empty() && (oldest==m_idle.end() || it->second.front().since < oldest->second.front().since)) {
+
+                oldest=it;
+            }
+        }
+
+        if(oldest!=m_idle.end()) {
+
+            oldest->second.pop_front();
+            --m_idle_count;
+            ++m_stats.evicted;
+        }
+    }
+
+public:
+    explicit ConnectionPool(Loop& loop, size_t max_idle_per_host=8, size_t max_idle=256, std::chrono::milliseconds idle_timeout=std::chrono::seconds(30)):
+        m_loop(loop),
+        m_max_idle_per_host(max_idle_per_host),
+        m_max_idle(max_idle),
+        m_idle_timeout(idle_timeout),
+        m_idle_count(0)
+    {}
+
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    // Returns the most recently used idle connection that is still open, or a new unconnected stream
+    std::tuple<bool, std::unique_ptr<TcpStream>> acquire(const TcpEndpoint& ep)
+    {
+        if(auto stream=find(ep)) {
+
+            return {true, std::move(stream)};
+        }
+
+        return {false, create()};
+    }
+
+    // Like acquire, but null when no idle connection to the endpoint is left
+    std::unique_ptr<TcpStream> find(const TcpEndpoint& ep)
+    {
+        if(auto it=m_idle.find(ep); it!=m_idle.end()) {
+
+            auto& idle=it->second;
+            auto now=Clock::now();
+            while(!idle.empty()) {
+
+                auto entry=std::move(idle.back());
+                idle.pop_back();
+                --m_idle_count;
+
+                if(now-entry.since < m_idle_timeout && entry.stream->is_open()) {
+
+                    ++m_stats.reused;
+                    return std::move(entry.stream);
+                }
+                ++m_stats.stale;
+            }
+        }
+
+        return nullptr;
+    }
+
+    std::unique_ptr<TcpStream> create()
+    {
+        ++m_stats.created;
+        return std::make_unique<TcpStream>(m_loop);
+    }
+
+    // Only streams that finished a response with known framing and without leftovers may come back
+    void release(const TcpEndpoint& ep, std::unique_ptr<TcpStream> stream)
+    {
+        if(m_max_idle_per_host == 0 || m_max_idle == 0) {
+
+            ++m_stats.closed;
+            return;
+        }
+
+        auto& idle=m_idle[ep];
+        if(idle.size() >= m_max_idle_per_host) {
+
+            idle.pop_front();
+            --m_idle_count;
+            ++m_stats.evicted;
+        } else if(m_idle_count >= m_max_idle) {
+
+            evict_oldest();
+        }
+
+        idle.push_back(Idle{std::move(stream), Clock::now()});
+        ++m_idle_count;
+        ++m_stats.released;
+    }
+
+    void discard()
+    {
+        ++m_stats.closed;
+    }
+
+    size_t idle() const
+    {
+        return m_idle_count;
+    }
+
+    const PoolStats& stats() const
+    {
+        return m_stats;
+    }
+};
\ No newline at end of file
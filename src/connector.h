@@ -0,0 +1,151 @@
+#pragma once
+
+#include "executor.h"
+#include "endpoint.h"
+#include "stream.h"
+#include "connection_pool.h"
+#include "timer.h"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Races connection attempts over the resolved addresses in the manner of RFC 8305:
+// a new attempt starts every ATTEMPT_DELAY, or right away when the last one failed.
+// The first stream to connect wins and the attempts still running are dropped.
+class Connector
+{
+public:
+    static constexpr std::chrono::milliseconds ATTEMPT_DELAY=std::chrono::milliseconds(250);
+
+    using Handler=std::function<void(const Error&, std::unique_ptr<TcpStream>, const TcpEndpoint&)>;
+
+private:
+    Loop& m_loop;
+    ConnectionPool* m_pool;
+    std::chrono::milliseconds m_delay;
+    std::vector<TcpEndpoint> m_endpoints;
+    std::vector<std::unique_ptr<TcpStream>> m_attempts;
+    Handler m_handler;
+    Timer m_timer;
+    size_t m_next;
+    size_t m_running;
+    Error m_error;
+
+private:
+    // The stream may be the caller of the current handler, close it on the next iteration
+    void retire(size_t index)
+    {
+        if(auto& stream=m_attempts[index]) {
+
+            stream->cancel();
+            m_loop.post([stream=std::move(stream)]() {});
+        }
+    }
+
+    void start_next()
+    {
+        m_timer.cancel();
+        auto index=m_next++;
+        m_attempts[index]=m_pool ? m_pool->create() : std::make_unique<TcpStream>(m_loop);
+        ++m_running;
+
+        if(m_next < m_endpoints.size()) {
+
+            m_loop.start_timer(m_timer, m_delay, [this]() {
+
+                start_next();
+            });
+        }
+
+        // Nothing is touched after connect, its handler may already have finished the race
+        m_attempts[index]->connect(m_endpoints[index], [this, index](const Error& error) {
+
+            on_attempt(index, error);
+        });
+    }
+
+    void on_attempt(size_t index, const Error& error)
+    {
+        --m_running;
+        if(error) {
+
+            retire(index);
+            m_error=error;
+            if(m_next < m_endpoints.size()) {
+
+                start_next();
+            } else if(m_running == 0) {
+
+                complete(m_error, nullptr, m_endpoints[index]);
+            }
+            return;
+        }
+
+        auto stream=std::move(m_attempts[index]);
+        complete(error, std::move(stream), m_endpoints[index]);
+    }
+
+    void complete(const Error& error, std::unique_ptr<TcpStream> stream, TcpEndpoint endpoint)
+    {
+        auto handler=std::move(m_handler);
+        cancel();
+        handler(error, std::move(stream), endpoint);
+    }
+
+public:
+    explicit Connector(Loop& loop, ConnectionPool* pool=nullptr, std::chrono::milliseconds delay=ATTEMPT_DELAY):
+        m_loop(loop),
+        m_pool(pool),
+        m_delay(delay),
+        m_next(0),
+        m_running(0),
+        m_error(Error::ok)
+    {}
+
+    Connector(const Connector&) = delete;
+    Connector& operator=(const Connector&) = delete;
+
+    ~Connector()
+    {
+        cancel();
+    }
+
+    // The endpoints are tried in the given order, the handler gets the winner and its address
+    template<typename T>
+    void start(std::vector<TcpEndpoint> endpoints, T&& handler)
+    {
+        cancel();
+        if(endpoints.empty()) {
+
+            handler(Error(Error::err_connect, "no address to connect to"), nullptr, TcpEndpoint());
+            return;
+        }
+
+        m_endpoints=std::move(endpoints);
+        m_attempts.resize(m_endpoints.size());
+        m_handler=std::forward<T>(handler);
+        m_error=Error(Error::ok);
+        start_next();
+    }
+
+    // Drops the attempts still running, the handler is not called
+    void cancel()
+    {
+        m_timer.cancel();
+        m_handler=nullptr;
+        for(size_t i=0; i < m_attempts.size(); ++i) {
+
+            retire(i);
+        }
+        m_attempts.clear();
+        m_next=0;
+        m_running=0;
+    }
+
+    bool is_running() const
+    {
+        return m_handler != nullptr;
+    }
+};
\ No newline at end of file
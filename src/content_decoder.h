@@ -0,0 +1,196 @@
+#pragma once
+
+#include "error.h"
+#include "http_fields.h"
+
+#include <zlib.h>
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+// What a client does about Content-Encoding
+enum class ContentCoding
+{
+    DECODE,     // asks for gzip or deflate and passes the decoded body on
+    RAW,        // asks for them but passes the body on as sent
+    IDENTITY    // asks for the body as is, byte offsets then match the resource
+};
+
+// Incremental gzip and deflate decoder. Output is handed out in pieces of at most
+// OUTPUT_SIZE bytes from one buffer kept for the life of the decoder, and the
+// zlib state is reset rather than rebuilt between bodies.
+class ContentDecoder
+{
+public:
+    static constexpr size_t OUTPUT_SIZE=64*1024; //bytes
+
+    enum Format
+    {
+        NONE,
+        GZIP,
+        DEFLATE
+    };
+
+private:
+    z_stream m_stream;
+    std::unique_ptr<char[]> m_output;
+    Format m_format;
+    bool m_initialized;
+    bool m_started;
+    bool m_done;
+    uint64_t m_decoded_size;
+
+private:
+    // "deflate" should be zlib wrapped, but some servers send the raw stream
+    static bool is_zlib_header(std::string_view data)
+    {
+        auto cmf=uint8_t(data[0]);
+        if((cmf & 0x0f)!=8 || (cmf >> 4) > 7) {
+
+            return false;
+        }
+        return data.size() < 2 || ((cmf << 8) | uint8_t(data[1])) % 31 == 0;
+    }
+
+    Error start(std::string_view data)
+    {
+        auto window_bits=m_format==GZIP ? MAX_WBITS+16 : is_zlib_header(data) ? MAX_WBITS : -MAX_WBITS;
+        auto result=m_initialized ? inflateReset2(&m_stream, window_bits) : inflateInit2(&m_stream, window_bits);
+        if(result!=Z_OK) {
+
+            return Error(Error::err_decode_body, "can't init zlib");
+        }
+
+        m_initialized=true;
+        m_started=true;
+        if(!m_output) {
+
+            m_output=std::make_unique<char[]>(OUTPUT_SIZE);
+        }
+        return Error(Error::ok);
+    }
+
+public:
+    ContentDecoder():
+        m_stream(),
+        m_format(NONE),
+        m_initialized(false),
+        m_started(false),
+        m_done(false),
+        m_decoded_size(0)
+    {}
+
+    ContentDecoder(const ContentDecoder&) = delete;
+    ContentDecoder& operator=(const ContentDecoder&) = delete;
+
+    ~ContentDecoder()
+    {
+        if(m_initialized) {
+
+            inflateEnd(&m_stream);
+        }
+    }
+
+    // NONE for identity, unknown and stacked codings: those bodies are passed on as sent
+    static Format format_of(std::string_view content_encoding)
+    {
+        auto begin=content_encoding.find_first_not_of(" \t"sv);
+        if(begin==std::string_view::npos) {
+
+            return NONE;
+        }
+
+        auto coding=content_encoding.substr(begin, content_encoding.find_last_not_of(" \t"sv)-begin+1);
+        if(equals_nocase(coding, "gzip"sv) || equals_nocase(coding, "x-gzip"sv)) {
+
+            return GZIP;
+        } else if(equals_nocase(coding, "deflate"sv)) {
+
+            return DEFLATE;
+        }
+        return NONE;
+    }
+
+    // Prepares for the next body
+    void reset(Format format)
+    {
+        m_format=format;
+        m_started=false;
+        m_done=false;
+        m_decoded_size=0;
+    }
+
+    // Decodes a piece of the body; the output given to handler is valid during the call only
+    template<typename T>
+    Error feed(std::string_view data, T&& handler)
+    {
+        if(!m_started && !data.empty()) {
+
+            if(auto error=start(data)) {
+
+                return error;
+            }
+        }
+
+        while(!data.empty()) {
+
+            if(m_done) {
+
+                // Another gzip member may follow, anything else after the end is ignored
+                if(m_format!=GZIP || uint8_t(data[0])!=0x1f) {
+
+                    return Error(Error::ok);
+                }
+                inflateReset(&m_stream);
+                m_done=false;
+            }
+
+            m_stream.next_in=reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+            auto chunk=std::min<size_t>(data.size(), UINT_MAX);
+            m_stream.avail_in=uInt(chunk);
+            auto result=Z_OK;
+            do {
+
+                m_stream.next_out=reinterpret_cast<Bytef*>(m_output.get());
+                m_stream.avail_out=OUTPUT_SIZE;
+                result=inflate(&m_stream, Z_NO_FLUSH);
+                if(result!=Z_OK && result!=Z_STREAM_END && result!=Z_BUF_ERROR) {
+
+                    return Error(Error::err_decode_body, m_stream.msg ? m_stream.msg : "bad compressed data");
+                }
+
+                if(auto size=OUTPUT_SIZE-m_stream.avail_out; size > 0) {
+
+                    m_decoded_size+=size;
+                    handler(std::string_view(m_output.get(), size));
+                }
+            } while(result==Z_OK && m_stream.avail_out==0);
+
+            data.remove_prefix(chunk-m_stream.avail_in);
+            m_done=result==Z_STREAM_END;
+            if(!m_done && m_stream.avail_in > 0) {
+
+                return Error(Error::err_decode_body, "compressed data stalled");
+            }
+        }
+        return Error(Error::ok);
+    }
+
+    bool is_active() const
+    {
+        return m_format!=NONE;
+    }
+
+    // The compressed stream ended, or nothing was fed yet
+    bool is_complete() const
+    {
+        return !m_started || m_done;
+    }
+
+    uint64_t decoded_size() const
+    {
+        return m_decoded_size;
+    }
+};
\ No newline at end of file
@@ -0,0 +1,562 @@
+#pragma once
+
+#if __cplusplus < 202002L
+#error "coro.h needs C++20"
+#endif
+
+#include "executor.h"
+#include "resolver.h"
+#include "stream.h"
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// The loop a coroutine runs on comes from its first parameter: the loop itself or,
+// for member coroutines, an object with loop()
+inline Loop& loop_of(Loop& loop)
+{
+    return loop;
+}
+
+template<typename T>
+auto loop_of(T& object) -> decltype(object.loop())
+{
+    return object.loop();
+}
+
+// Frames come from the pool of the loop, which is kept in front of the frame for
+// the way back. There is no plain operator new: a coroutine without a loop does
+// not compile.
+class CoPromiseBase
+{
+private:
+    static constexpr size_t HEADER=alignof(std::max_align_t); //bytes
+
+    static_assert(HEADER >= sizeof(FramePool*), "the pool fits in front of the frame");
+
+protected:
+    Loop* m_loop;
+
+public:
+    template<typename First, typename... Rest>
+    CoPromiseBase(First& first, Rest&...):
+        m_loop(&loop_of(first))
+    {}
+
+    // Frames are always freed by the usual operator delete, which cannot be a template
+    // like this one; inlined, GCC sees the pool rather than a mismatched pair
+    template<typename First, typename... Rest>
+    [[gnu::always_inline]] static void* operator new(size_t size, First& first, Rest&...)
+    {
+        auto& pool=loop_of(first).frames();
+        auto memory=static_cast<char*>(pool.allocate(size+HEADER));
+        *reinterpret_cast<FramePool**>(memory)=&pool;
+        return memory+HEADER;
+    }
+
+    static void operator delete(void* frame, size_t size)
+    {
+        auto memory=static_cast<char*>(frame)-HEADER;
+        (*reinterpret_cast<FramePool**>(memory))->deallocate(memory, size+HEADER);
+    }
+
+    Loop& loop()
+    {
+        return *m_loop;
+    }
+};
+
+template<typename T>
+class CoResult
+{
+private:
+    std::optional<T> m_value;
+    std::exception_ptr m_exception;
+
+public:
+    template<typename U>
+    void return_value(U&& value)
+    {
+        m_value.emplace(std::forward<U>(value));
+    }
+
+    void unhandled_exception()
+    {
+        m_exception=std::current_exception();
+    }
+
+    T take()
+    {
+        if(m_exception) {
+
+            std::rethrow_exception(m_exception);
+        }
+        return std::move(*m_value);
+    }
+};
+
+template<>
+class CoResult<void>
+{
+private:
+    std::exception_ptr m_exception;
+
+public:
+    void return_void()
+    {}
+
+    void unhandled_exception()
+    {
+        m_exception=std::current_exception();
+    }
+
+    void take()
+    {
+        if(m_exception) {
+
+            std::rethrow_exception(m_exception);
+        }
+    }
+};
+
+// A coroutine that starts when awaited and hands its result to the awaiting one
+// without going through the loop. Its frame is freed on the next iteration: it
+// may own the stream whose handler resumed it last.
+template<typename T=void>
+class CoTask
+{
+public:
+    class promise_type : public CoPromiseBase, public CoResult<T>
+    {
+    friend class CoTask;
+
+    private:
+        std::coroutine_handle<> m_continuation;
+
+        struct Final
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+            {
+                auto continuation=handle.promise().m_continuation;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+
+            void await_resume() noexcept
+            {}
+        };
+
+    public:
+        using CoPromiseBase::CoPromiseBase;
+
+        CoTask get_return_object()
+        {
+            return CoTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        Final final_suspend() noexcept
+        {
+            return {};
+        }
+    };
+
+private:
+    using Handle=std::coroutine_handle<promise_type>;
+
+    Handle m_handle;
+
+private:
+    explicit CoTask(Handle handle):
+        m_handle(handle)
+    {}
+
+    void reset()
+    {
+        if(!m_handle) {
+
+            return;
+        }
+
+        if(m_handle.done()) {
+
+            m_handle.promise().loop().post([handle=m_handle]() {
+
+                handle.destroy();
+            });
+        } else {
+
+            m_handle.destroy();
+        }
+        m_handle=nullptr;
+    }
+
+public:
+    CoTask(CoTask&& other) noexcept:
+        m_handle(std::exchange(other.m_handle, nullptr))
+    {}
+
+    CoTask& operator=(CoTask&& other) noexcept
+    {
+        if(this != &other) {
+
+            reset();
+            m_handle=std::exchange(other.m_handle, nullptr);
+        }
+        return *this;
+    }
+
+    CoTask(const CoTask&) = delete;
+    CoTask& operator=(const CoTask&) = delete;
+
+    ~CoTask()
+    {
+        reset();
+    }
+
+    auto operator co_await() noexcept
+    {
+        struct Awaiter
+        {
+            Handle handle;
+
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+            {
+                handle.promise().m_continuation=continuation;
+                return handle;
+            }
+
+            T await_resume()
+            {
+                return handle.promise().take();
+            }
+        };
+        return Awaiter{m_handle};
+    }
+};
+
+// Runs on its own from the start and frees itself on the iteration after it ends
+class CoDetached
+{
+public:
+    class promise_type : public CoPromiseBase
+    {
+    private:
+        struct Final
+        {
+            Loop* loop;
+
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<> handle) noexcept
+            {
+                loop->post([handle]() {
+
+                    handle.destroy();
+                });
+            }
+
+            void await_resume() noexcept
+            {}
+        };
+
+    public:
+        using CoPromiseBase::CoPromiseBase;
+
+        CoDetached get_return_object()
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        Final final_suspend() noexcept
+        {
+            return {m_loop};
+        }
+
+        void return_void()
+        {}
+
+        // Nobody is left to take it
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+// Starts the task on the loop and passes its result to the handler
+template<typename T, typename F>
+CoDetached spawn(Loop& loop, CoTask<T> task, F handler)
+{
+    if constexpr(std::is_void_v<T>) {
+
+        co_await std::move(task);
+        handler();
+    } else {
+
+        handler(co_await std::move(task));
+    }
+}
+
+// Awaits a handler based operation: the handler stores the result and resumes the
+// coroutine, unless it ran before the coroutine suspended, as a failed connect does
+class CoOperation
+{
+private:
+    std::coroutine_handle<> m_handle;
+    bool m_done=false;
+
+protected:
+    void complete()
+    {
+        m_done=true;
+        if(m_handle) {
+
+            m_handle.resume();
+        }
+    }
+
+    bool suspend(std::coroutine_handle<> handle)
+    {
+        if(m_done) {
+
+            return false;
+        }
+
+        m_handle=handle;
+        return true;
+    }
+
+public:
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    // Suspended and not completed: the frame is destroyed while the operation waits
+    bool is_pending() const
+    {
+        return m_handle && !m_done;
+    }
+};
+
+class CoConnect : public CoOperation
+{
+private:
+    TcpStream& m_stream;
+    const TcpEndpoint& m_endpoint;
+    Error m_error;
+
+public:
+    CoConnect(TcpStream& stream, const TcpEndpoint& endpoint):
+        m_stream(stream),
+        m_endpoint(endpoint),
+        m_error(Error::ok)
+    {}
+
+    CoConnect(const CoConnect&) = delete;
+    CoConnect& operator=(const CoConnect&) = delete;
+
+    // A frame destroyed while suspended takes the handler with it
+    ~CoConnect()
+    {
+        if(is_pending()) {
+
+            m_stream.cancel_connect();
+        }
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        m_stream.connect(m_endpoint, [this](const Error& error) {
+
+            m_error=error;
+            complete();
+        });
+        return suspend(handle);
+    }
+
+    Error await_resume()
+    {
+        return m_error;
+    }
+};
+
+class CoWrite : public CoOperation
+{
+private:
+    TcpStream& m_stream;
+    std::string& m_data;
+    Error m_error;
+
+public:
+    CoWrite(TcpStream& stream, std::string& data):
+        m_stream(stream),
+        m_data(data),
+        m_error(Error::ok)
+    {}
+
+    CoWrite(const CoWrite&) = delete;
+    CoWrite& operator=(const CoWrite&) = delete;
+
+    ~CoWrite()
+    {
+        if(is_pending()) {
+
+            m_stream.cancel_write();
+        }
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        m_stream.write(m_data, [this](const Error& error) {
+
+            m_error=error;
+            complete();
+        });
+        return suspend(handle);
+    }
+
+    Error await_resume()
+    {
+        return m_error;
+    }
+};
+
+class CoReadSome : public CoOperation
+{
+private:
+    TcpStream& m_stream;
+    char* m_data;
+    size_t m_size;
+    size_t m_read;
+    Error m_error;
+
+public:
+    CoReadSome(TcpStream& stream, char* data, size_t size):
+        m_stream(stream),
+        m_data(data),
+        m_size(size),
+        m_read(0),
+        m_error(Error::ok)
+    {}
+
+    CoReadSome(const CoReadSome&) = delete;
+    CoReadSome& operator=(const CoReadSome&) = delete;
+
+    ~CoReadSome()
+    {
+        if(is_pending()) {
+
+            m_stream.cancel_read();
+        }
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        m_stream.read_some(m_data, m_size, [this](size_t size, const Error& error) {
+
+            m_read=size;
+            m_error=error;
+            complete();
+        });
+        return suspend(handle);
+    }
+
+    std::tuple<size_t, Error> await_resume()
+    {
+        return {m_read, m_error};
+    }
+};
+
+// The hostname has to outlive the lookup, as with resolve()
+class CoResolve : public CoOperation
+{
+private:
+    Loop& m_loop;
+    std::string_view m_hostname;
+    std::vector<Endpoint> m_endpoints;
+    Error m_error;
+    ResolveHandle m_resolving;
+
+public:
+    CoResolve(Loop& loop, std::string_view hostname):
+        m_loop(loop),
+        m_hostname(hostname),
+        m_error(Error::ok)
+    {}
+
+    CoResolve(const CoResolve&) = delete;
+    CoResolve& operator=(const CoResolve&) = delete;
+
+    // A coroutine dropped while resolving leaves the lookup without a handler
+    ~CoResolve()
+    {
+        m_resolving.cancel();
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        m_resolving=resolve(m_loop, m_hostname, [this](const std::vector<Endpoint>& endpoints, const Error& error) {
+
+            m_endpoints=endpoints;
+            m_error=error;
+            complete();
+        });
+        return suspend(handle);
+    }
+
+    std::tuple<std::vector<Endpoint>, Error> await_resume()
+    {
+        return {std::move(m_endpoints), m_error};
+    }
+};
+
+inline CoConnect async_connect(TcpStream& stream, const TcpEndpoint& endpoint)
+{
+    return CoConnect(stream, endpoint);
+}
+
+inline CoWrite async_write(TcpStream& stream, std::string& data)
+{
+    return CoWrite(stream, data);
+}
+
+inline CoReadSome async_read_some(TcpStream& stream, char* data, size_t size)
+{
+    return CoReadSome(stream, data, size);
+}
+
+inline CoResolve async_resolve(Loop& loop, std::string_view hostname)
+{
+    return CoResolve(loop, hostname);
+}
\ No newline at end of file
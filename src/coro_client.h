@@ -0,0 +1,166 @@
+#pragma once
+
+#include "coro.h"
+#include "http_client.h"
+#include "url_parser.h"
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+struct CoResponse
+{
+    Error error=Error(Error::ok);
+    StatusCode status_code=0;
+    std::string body;
+};
+
+// GETs as straight-line coroutines over one keep-alive connection, opened again
+// when the server closes it or the next url is on another host. One request at a
+// time; the header of the last response stays valid until the next one.
+class CoHttpClient
+{
+public:
+    static constexpr size_t READ_SIZE=64*1024; //bytes
+
+private:
+    Loop& m_loop;
+    std::unique_ptr<TcpStream> m_stream;
+    std::string m_host;
+    uint16_t m_port;
+    ResponseReader m_reader;
+    std::string m_request;
+    PooledBuffer m_buffer;
+
+private:
+    // The stream may be the caller of the current handler, close it on the next iteration
+    void retire_stream()
+    {
+        if(m_stream) {
+
+            m_loop.post([stream=std::move(m_stream)]() {});
+        }
+    }
+
+    CoTask<Error> open(const HttpUrl& url)
+    {
+        auto [endpoints, error]=co_await async_resolve(m_loop, url.host);
+        if(error) {
+
+            co_return error;
+        }
+
+        for(auto& endpoint : endpoints) {
+
+            m_stream=std::make_unique<TcpStream>(m_loop);
+            error=co_await async_connect(*m_stream, TcpEndpoint(endpoint, url.port));
+            if(!error) {
+
+                m_host=url.host;
+                m_port=url.port;
+                co_return error;
+            }
+            retire_stream();
+        }
+        co_return endpoints.empty() ? Error(Error::err_hostname_resolve) : error;
+    }
+
+    CoTask<Error> exchange(const HttpUrl& url, std::string& body)
+    {
+        m_reader.reset();
+        m_request.clear();
+        append_get_request(m_request, url.host, url.target, true);
+        if(auto error=co_await async_write(*m_stream, m_request)) {
+
+            co_return error;
+        }
+
+        while(!m_reader.is_done()) {
+
+            auto [size, error]=co_await async_read_some(*m_stream, m_buffer.data(), m_buffer.size());
+            if(error.code()==Error::err_eof && m_reader.finish_on_eof()) {
+
+                break;
+            } else if(error) {
+
+                co_return error;
+            }
+
+            auto data=std::string_view(m_buffer.data(), size);
+            auto [feed_error, consumed]=m_reader.feed(data, [&body](std::string_view part_body) {
+
+                body.append(part_body);
+            });
+            if(feed_error) {
+
+                co_return feed_error;
+            } else if(consumed < data.size()) {
+
+                // Bytes past the response: the connection is out of step
+                retire_stream();
+            }
+        }
+        co_return Error(Error::ok);
+    }
+
+public:
+    explicit CoHttpClient(Loop& loop):
+        m_loop(loop),
+        m_port(0)
+    {}
+
+    CoHttpClient(const CoHttpClient&) = delete;
+    CoHttpClient& operator=(const CoHttpClient&) = delete;
+
+    Loop& loop()
+    {
+        return m_loop;
+    }
+
+    const ResponseHeader& response_header() const
+    {
+        return m_reader.header();
+    }
+
+    // The url is kept in the frame, the caller's copy may go meanwhile
+    CoTask<CoResponse> get(HttpUrl url)
+    {
+        CoResponse response;
+        if(m_stream && (m_host != url.host || m_port != url.port || !m_stream->is_open())) {
+
+            retire_stream();
+        }
+
+        if(!m_buffer.data()) {
+
+            m_buffer=m_loop.buffers().acquire(READ_SIZE);
+        }
+
+        // A kept connection may have been closed by the server while idle: one more try on a new one
+        for(auto reused=bool(m_stream); ; reused=false) {
+
+            if(!m_stream) {
+
+                if(auto error=co_await open(url)) {
+
+                    response.error=error;
+                    co_return response;
+                }
+            }
+
+            response.error=co_await exchange(url, response.body);
+            if(!response.error || !reused || m_reader.is_started()) {
+
+                break;
+            }
+            retire_stream();
+        }
+
+        response.status_code=m_reader.header().status_code;
+        if(response.error || !m_reader.is_reusable() || !m_reader.header().keep_alive()) {
+
+            retire_stream();
+        }
+        co_return response;
+    }
+};
\ No newline at end of file
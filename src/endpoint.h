@@ -1,61 +1,156 @@
+#pragma once
+
 #include <ostream>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <cstring>
+#include <functional>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 
+// An IPv4 or IPv6 address kept as a socket address, so it can be handed to
+// connect() as is and copied without allocations
 class Endpoint
 {
-private:
-    std::string m_addr_str;
-    uint32_t m_addr;
+protected:
+    sockaddr_storage m_addr;
+    socklen_t m_size;
 
 public:
-    explicit Endpoint(std::string addr) :
-        m_addr_str(std::move(addr)),
-        m_addr(inet_addr(m_addr_str.data()))
+    Endpoint():
+        m_addr(),
+        m_size(0)
     {}
 
-    explicit Endpoint(std::string_view addr) :
-        m_addr_str(addr.data(), addr.size()),
-        m_addr(inet_addr(m_addr_str.data()))
-    {}
+    Endpoint(const sockaddr* addr, socklen_t size):
+        m_addr(),
+        m_size(std::min<socklen_t>(size, sizeof(m_addr)))
+    {
+        memcpy(&m_addr, addr, m_size);
+    }
 
-    Endpoint(const Endpoint& other) :
-        Endpoint(other.m_addr_str)
-    {}
+    // A numeric address, an empty endpoint when it does not parse
+    explicit Endpoint(std::string_view addr):
+        Endpoint()
+    {
+        char text[INET6_ADDRSTRLEN]={};
+        if(addr.size() >= sizeof(text)) {
 
-    Endpoint(Endpoint&& other)
-    {}
+            return;
+        }
+        memcpy(text, addr.data(), addr.size());
+
+        auto v4=reinterpret_cast<sockaddr_in*>(&m_addr);
+        auto v6=reinterpret_cast<sockaddr_in6*>(&m_addr);
+        if(inet_pton(AF_INET, text, &v4->sin_addr) == 1) {
+
+            v4->sin_family=AF_INET;
+            m_size=sizeof(sockaddr_in);
+        } else if(inet_pton(AF_INET6, text, &v6->sin6_addr) == 1) {
+
+            v6->sin6_family=AF_INET6;
+            m_size=sizeof(sockaddr_in6);
+        }
+    }
 
-    uint32_t addr() const
+    int family() const
     {
-        return m_addr;
+        return m_addr.ss_family;
+    }
+
+    const sockaddr* address() const
+    {
+        return reinterpret_cast<const sockaddr*>(&m_addr);
+    }
+
+    socklen_t size() const
+    {
+        return m_size;
+    }
+
+    // Port excluded
+    bool same_address(const Endpoint& other) const
+    {
+        if(family() != other.family()) {
+
+            return false;
+        } else if(family() == AF_INET) {
+
+            return reinterpret_cast<const sockaddr_in&>(m_addr).sin_addr.s_addr
+                == reinterpret_cast<const sockaddr_in&>(other.m_addr).sin_addr.s_addr;
+        }
+
+        return memcmp(&reinterpret_cast<const sockaddr_in6&>(m_addr).sin6_addr,
+            &reinterpret_cast<const sockaddr_in6&>(other.m_addr).sin6_addr, sizeof(in6_addr)) == 0;
     }
 
     friend std::ostream& operator<<(std::ostream& out, const Endpoint& ep)
     {
-        return out << ep.m_addr_str;
+        char text[INET6_ADDRSTRLEN]={};
+        if(ep.family() == AF_INET) {
+
+            inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in&>(ep.m_addr).sin_addr, text, sizeof(text));
+        } else if(ep.family() == AF_INET6) {
+
+            inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6&>(ep.m_addr).sin6_addr, text, sizeof(text));
+        }
+        return out << text;
     }
 };
 
 class TcpEndpoint : public Endpoint
 {
-private:
-    uint16_t m_port;
-
 public:
+    TcpEndpoint()
+    {}
+
     TcpEndpoint(const Endpoint& endpoint, uint16_t port) :
-        Endpoint(endpoint),
-        m_port(port)
+        Endpoint(endpoint)
     {
+        if(family() == AF_INET6) {
+
+            reinterpret_cast<sockaddr_in6&>(m_addr).sin6_port=htons(port);
+        } else {
+
+            reinterpret_cast<sockaddr_in&>(m_addr).sin_port=htons(port);
+        }
     }
 
-    TcpEndpoint(Endpoint&& endpoint, uint16_t port) :
-        Endpoint(std::forward<Endpoint>(endpoint)),
-        m_port(port)
+    uint16_t port() const
     {
+        return ntohs(family() == AF_INET6
+            ? reinterpret_cast<const sockaddr_in6&>(m_addr).sin6_port
+            : reinterpret_cast<const sockaddr_in&>(m_addr).sin_port);
     }
 
-    uint16_t port() const
+    bool operator==(const TcpEndpoint& other) const
     {
-        return m_port;
+        return same_address(other) && port() == other.port();
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, const TcpEndpoint& ep)
+    {
+        if(ep.family() == AF_INET6) {
+
+            return out << '[' << static_cast<const Endpoint&>(ep) << "]:" << ep.port();
+        }
+        return out << static_cast<const Endpoint&>(ep) << ':' << ep.port();
+    }
+};
+
+struct TcpEndpointHash
+{
+    size_t operator()(const TcpEndpoint& ep) const
+    {
+        if(ep.family() == AF_INET) {
+
+            auto addr=reinterpret_cast<const sockaddr_in*>(ep.address())->sin_addr.s_addr;
+            return std::hash<uint64_t>()((uint64_t(addr) << 16) | ep.port());
+        }
+
+        auto& addr=reinterpret_cast<const sockaddr_in6*>(ep.address())->sin6_addr;
+        return std::hash<std::string_view>()(std::string_view(reinterpret_cast<const char*>(&addr), sizeof(addr))) ^ ep.port();
     }
 };
\ No newline at end of file
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <string>
 
 class Error
@@ -16,6 +18,15 @@ public:
         err_parse_header,
         err_large_header,
         err_large_body,
+        err_init_loop,
+        err_timeout_resolve,
+        err_timeout_connect,
+        err_timeout_first_byte,
+        err_timeout_idle,
+        err_timeout_total,
+        err_parse_chunk,
+        err_init_pipe,
+        err_decode_body,
         err_undefined
     };
 
@@ -45,6 +56,11 @@ public:
     }
 
 public:
+    Code code() const
+    {
+        return m_code;
+    }
+
     const std::string& message() const
     {
         return m_msg;
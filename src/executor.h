@@ -1,42 +1,521 @@
 #pragma once
 
+#include "linux_fd.h"
+#include "error.h"
+#include "timer.h"
+#include "task.h"
+#include "io_ring.h"
+#include "buffer_pool.h"
+#include "metrics.h"
+#include "trace.h"
+
 #include <functional>
-#include <list>
-#include <thread>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <poll.h>
+
+using Task=InlineFunction<void()>;
+using Queue=RingQueue<Task>;
 
-using Task=std::function<bool()>;
-using Queue=std::list<Task>;
+class EventHandler
+{
+public:
+    virtual void on_events(uint32_t events)=0;
+
+protected:
+    ~EventHandler()=default;
+};
 
 class Loop
 {
 private:
+    static constexpr int MAX_EVENTS=64;
+
+    using Ready=std::vector<std::pair<EventHandler*, uint32_t>>;
+
+    BufferPool m_buffers;
+    FramePool m_frames;
+    LinuxFd m_epfd;
     Queue m_queue;
+    Ready m_ready;
+    Ready m_running;
+    std::array<epoll_event, MAX_EVENTS> m_events;
+    int m_nevents;
+    size_t m_waiting;
+    TimerWheel m_timers;
+    std::unique_ptr<IoRing> m_ring;
+    IoCallback m_epoll_ready;
+    Metrics* m_metrics;
+    std::chrono::steady_clock::duration m_waited;
+    Tracer* m_tracer;
+    size_t m_handled;
+
+private:
+    // io_uring unless it is compiled out, disabled with PAGE_LOADER_BACKEND=epoll or not supported
+    static std::unique_ptr<IoRing> create_ring()
+    {
+#ifndef PAGE_LOADER_NO_IO_URING
+        auto backend=getenv("PAGE_LOADER_BACKEND");
+        if(!backend || strcmp(backend, "epoll") != 0) {
+
+            try {
+
+                return std::make_unique<IoRing>();
+            } catch(const Error& error) {
+
+                // Every loop falls back the same way, say it once
+                static std::once_flag logged;
+                std::call_once(logged, [&error]() {
+
+                    std::cerr << "io_uring is not available, using epoll: " << error.message() << std::endl;
+                });
+            }
+        }
+#endif
+        return nullptr;
+    }
+
+    LinuxFd create_epoll()
+    {
+        int epfd=epoll_create1(EPOLL_CLOEXEC);
+        if(epfd < 0) {
+
+            throw Error(Error::err_init_loop, strerror(errno));
+        }
+
+        return LinuxFd(epfd);
+    }
+
+    void control(int op, int fd, uint32_t events, EventHandler* handler)
+    {
+        epoll_event ev;
+        ev.events=events;
+        ev.data.ptr=handler;
+        if(epoll_ctl(m_epfd.get(), op, fd, &ev) < 0) {
+
+            throw Error(Error::err_init_loop, strerror(errno));
+        }
+    }
+
+    size_t run_tasks()
+    {
+        auto tasks=m_queue.size();
+        for(auto count=tasks; count>0; --count) {
+
+            auto task=std::move(m_queue.front());
+            m_queue.pop_front();
+            if(m_tracer) {
+
+                auto begin=Tracer::Clock::now();
+                task();
+                m_tracer->complete("task", "loop", begin, Tracer::Clock::now());
+            } else {
+
+                task();
+            }
+        }
+        return tasks;
+    }
+
+    void run_ready()
+    {
+        m_running.swap(m_ready);
+        for(size_t i=0; i<m_running.size(); ++i) {
+
+            if(auto [handler, events]=m_running[i]; handler) {
+
+                ++m_handled;
+                handler->on_events(events);
+            }
+        }
+        m_running.clear();
+    }
+
+    // Time blocked in the kernel, for metrics and the trace
+    template<typename F>
+    void blocking(int timeout, F&& wait)
+    {
+        if(!m_metrics && !m_tracer) {
+
+            wait();
+            return;
+        }
+
+        auto begin=std::chrono::steady_clock::now();
+        wait();
+        auto end=std::chrono::steady_clock::now();
+        m_waited+=end-begin;
+        if(m_tracer) {
+
+            m_tracer->complete("poll", "loop", begin, end, {{"timeout_ms", timeout}});
+        }
+    }
+
+    int poll_events(int timeout)
+    {
+        blocking(timeout, [this, timeout]() {
+
+            m_nevents=epoll_wait(m_epfd.get(), m_events.data(), m_events.size(), timeout);
+        });
+        if(m_nevents < 0) {
+
+            m_nevents=0;
+            if(errno != EINTR) {
+
+                throw Error(Error::err_init_loop, strerror(errno));
+            }
+        }
+
+        for(int i=0; i<m_nevents; ++i) {
+
+            if(auto handler=static_cast<EventHandler*>(m_events[i].data.ptr); handler) {
+
+                ++m_handled;
+                handler->on_events(m_events[i].events);
+            }
+        }
+
+        auto count=m_nevents;
+        m_nevents=0;
+        return count;
+    }
+
+    void wait_events(int timeout)
+    {
+        if(!m_ring) {
+
+            poll_events(timeout);
+            return;
+        }
+
+        // The epoll descriptor is watched by a multishot poll on the ring
+        if(!m_epoll_ready.in_flight()) {
+
+            auto sqe=m_ring->prepare(IORING_OP_POLL_ADD, m_epfd.get(), &m_epoll_ready);
+            sqe->poll32_events=POLLIN;
+            sqe->len=IORING_POLL_ADD_MULTI;
+        }
+
+        blocking(timeout, [this, timeout]() {
+
+            m_ring->wait(timeout);
+        });
+        m_ring->reap();
+        m_handled+=m_ring->dispatch();
+    }
+
+    bool is_idle() const
+    {
+        return m_queue.empty() && m_ready.empty();
+    }
+
+    bool is_alive() const
+    {
+        return m_waiting>0 || m_timers.size()>0 || !is_idle();
+    }
 
 public:
+    Loop():
+        m_epfd(create_epoll()),
+        m_nevents(0),
+        m_waiting(0),
+        m_ring(create_ring()),
+        m_epoll_ready([this](int32_t result, uint32_t flags) {
+
+            // A full batch may leave events behind and the poll only fires on new ones
+            while(poll_events(0) == MAX_EVENTS) {}
+        }),
+        m_metrics(nullptr),
+        m_waited(0),
+        m_tracer(nullptr),
+        m_handled(0)
+    {
+        m_ready.reserve(MAX_EVENTS);
+        m_running.reserve(MAX_EVENTS);
+    }
+
+    Loop(const Loop&) = delete;
+    Loop& operator=(const Loop&) = delete;
+
+    // Null when the loop runs on epoll alone
+    IoRing* ring()
+    {
+        return m_ring.get();
+    }
+
+    // Receive buffers shared by everything running on the loop
+    BufferPool& buffers()
+    {
+        return m_buffers;
+    }
+
+    // Coroutine frames of everything running on the loop
+    FramePool& frames()
+    {
+        return m_frames;
+    }
 
     template<typename T>
     void post(T&& task)
     {
-        m_queue.push_back(std::forward<T>(task));
+        m_queue.emplace_back(std::forward<T>(task));
+    }
+
+    void add(int fd, uint32_t events, EventHandler* handler)
+    {
+        control(EPOLL_CTL_ADD, fd, events, handler);
+    }
+
+    void modify(int fd, uint32_t events, EventHandler* handler)
+    {
+        control(EPOLL_CTL_MOD, fd, events, handler);
+    }
+
+    void remove(int fd, EventHandler* handler)
+    {
+        epoll_ctl(m_epfd.get(), EPOLL_CTL_DEL, fd, nullptr);
+        forget(handler);
+    }
+
+    // Deliver events to the handler on the next iteration without asking the kernel
+    void schedule(EventHandler* handler, uint32_t events)
+    {
+        m_ready.emplace_back(handler, events);
+    }
+
+    // Drop every event already harvested or scheduled for the handler
+    void forget(EventHandler* handler)
+    {
+        for(int i=0; i<m_nevents; ++i) {
+
+            if(m_events[i].data.ptr == handler) {
+
+                m_events[i].data.ptr=nullptr;
+            }
+        }
+
+        for(auto ready : {&m_ready, &m_running}) {
+
+            for(auto& item : *ready) {
+
+                if(item.first == handler) {
+
+                    item.first=nullptr;
+                }
+            }
+        }
+    }
+
+    // Operations waiting for the kernel keep the loop running
+    void hold()
+    {
+        ++m_waiting;
+    }
+
+    void release()
+    {
+        --m_waiting;
+    }
+
+    // Active timers keep the loop running as well
+    template<typename T>
+    void start_timer(Timer& timer, std::chrono::milliseconds timeout, T&& handler)
+    {
+        m_timers.start(timer, timeout, std::forward<T>(handler));
+    }
+
+    // Each iteration is recorded there, split into time busy and time waiting; call before run()
+    void set_metrics(Metrics* metrics)
+    {
+        m_metrics=metrics;
+    }
+
+    // Spans of iterations, tasks and waits go there, as do callbacks and requests that
+    // trace themselves; call before run()
+    void set_tracer(Tracer* tracer)
+    {
+        m_tracer=tracer;
+    }
+
+    Tracer* tracer()
+    {
+        return m_tracer;
     }
 
     void run()
     {
-        while(!m_queue.empty())
+        auto mark=std::chrono::steady_clock::now();
+        while(is_alive())
         {
-            auto it = m_queue.begin();
-            for(; it!=m_queue.end(); ) {
+            auto begin=m_tracer ? Tracer::Clock::now() : Tracer::Clock::time_point();
+            auto callbacks=m_tracer ? m_tracer->callbacks() : 0;
+            m_handled=0;
 
-                auto& task=*it;
-                if(task()){
+            auto tasks=run_tasks();
+            run_ready();
 
-                    it=m_queue.erase(it);
-                } else {
+            if(m_waiting>0 || (is_idle() && is_alive())) {
 
-                    ++it;
-                }
+                wait_events(is_idle() ? m_timers.timeout() : 0);
+            }
+            m_timers.advance();
+
+            if(m_metrics) {
+
+                auto now=std::chrono::steady_clock::now();
+                auto waited=std::chrono::duration_cast<std::chrono::nanoseconds>(m_waited).count();
+                auto total=std::chrono::duration_cast<std::chrono::nanoseconds>(now-mark).count();
+                m_metrics->record_loop(uint64_t(std::max(total-waited, decltype(total)(0))), uint64_t(waited));
+                mark=now;
             }
-            std::this_thread::sleep_for (std::chrono::duration<int,std::ratio<1,1>>());
+            m_waited=std::chrono::steady_clock::duration(0);
+
+            if(m_tracer) {
+
+                m_tracer->iteration(begin, tasks, m_handled, m_tracer->callbacks()-callbacks);
+            }
+        }
+    }
+};
+
+// Wakes the loop from any thread; the handler runs on the loop thread
+class Notifier : public EventHandler
+{
+private:
+    Loop& m_loop;
+    LinuxFd m_fd;
+    std::function<void(uint64_t)> m_handler;
+
+private:
+    LinuxFd create_eventfd()
+    {
+        int fd=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(fd < 0) {
+
+            throw Error(Error::err_init_loop, strerror(errno));
+        }
+
+        return LinuxFd(fd);
+    }
+
+public:
+    template<typename T>
+    Notifier(Loop& loop, T&& handler):
+        m_loop(loop),
+        m_fd(create_eventfd()),
+        m_handler(std::forward<T>(handler))
+    {
+        m_loop.add(m_fd.get(), EPOLLIN, this);
+    }
+
+    ~Notifier()
+    {
+        m_loop.remove(m_fd.get(), this);
+    }
+
+    Notifier(const Notifier&) = delete;
+    Notifier& operator=(const Notifier&) = delete;
+
+    void notify()
+    {
+        uint64_t value=1;
+        while(::write(m_fd.get(), &value, sizeof(value)) < 0 && errno == EINTR) {}
+    }
+
+    void on_events(uint32_t events) override
+    {
+        uint64_t value;
+        if(::read(m_fd.get(), &value, sizeof(value)) == sizeof(value)) {
+
+            m_handler(value);
+        }
+    }
+
+    // Blocks until the next notification and returns how many arrived
+    uint64_t wait()
+    {
+        pollfd pfd={m_fd.get(), POLLIN, 0};
+        uint64_t value=0;
+        while(::read(m_fd.get(), &value, sizeof(value)) != sizeof(value)) {
+
+            ::poll(&pfd, 1, -1);
+        }
+        return value;
+    }
+};
+
+// Takes a signal as an event on the loop rather than as an interrupt. The signal
+// stays blocked in the creating thread, so create the watcher before any other
+// thread starts and they inherit the mask.
+class SignalWatcher : public EventHandler
+{
+private:
+    Loop& m_loop;
+    LinuxFd m_fd;
+    std::function<void()> m_handler;
+
+private:
+    static LinuxFd create_signalfd(int signal)
+    {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, signal);
+        if(pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0) {
+
+            throw Error(Error::err_init_loop, "can't block signal");
+        }
+
+        int fd=signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if(fd < 0) {
+
+            throw Error(Error::err_init_loop, strerror(errno));
+        }
+
+        return LinuxFd(fd);
+    }
+
+public:
+    template<typename T>
+    SignalWatcher(Loop& loop, int signal, T&& handler):
+        m_loop(loop),
+        m_fd(create_signalfd(signal)),
+        m_handler(std::forward<T>(handler))
+    {
+        m_loop.add(m_fd.get(), EPOLLIN, this);
+    }
+
+    ~SignalWatcher()
+    {
+        m_loop.remove(m_fd.get(), this);
+    }
+
+    SignalWatcher(const SignalWatcher&) = delete;
+    SignalWatcher& operator=(const SignalWatcher&) = delete;
+
+    // Signals that arrive together are handled once
+    void on_events(uint32_t events) override
+    {
+        signalfd_siginfo info;
+        auto received=false;
+        while(::read(m_fd.get(), &info, sizeof(info)) == sizeof(info)) {
+
+            received=true;
+        }
+
+        if(received) {
+
+            m_handler();
         }
     }
 };
\ No newline at end of file
@@ -3,9 +3,20 @@
 #include "url_parser.h"
 #include "stream.h"
 #include "executor.h"
-#include "resolver.h"
-
+#include "resolver_cache.h"
+#include "connection_pool.h"
+#include "connector.h"
+#include "chunked_decoder.h"
+#include "content_decoder.h"
+#include "simd_scan.h"
+#include "http_fields.h"
+#include "metrics.h"
+
+#include <algorithm>
 #include <deque>
+#include <functional>
+#include <type_traits>
+#include <utility>
 
 enum class HttpVersion
 {
@@ -13,88 +24,135 @@ enum class HttpVersion
     HTTP_10=10
 };
 
-using StatusCode=uint8_t;
+using StatusCode=uint16_t;
 
-class Fields
+// Comma separated list elements, without surrounding whitespace
+template<typename T>
+void for_each_token(std::string_view list, T&& handler)
 {
-private:
-    std::unordered_map<std::string_view, std::string_view> m_params;
+    while(!list.empty()) {
 
-public:
-    void add(std::string_view key, std::string_view value)
-    {
-        m_params.emplace(key, value);
+        auto token=list.substr(0, list.find(','));
+        list.remove_prefix(std::min(list.size(), token.size()+1));
+
+        auto begin=token.find_first_not_of(" \t"sv);
+        if(begin!=std::string_view::npos) {
+
+            handler(token.substr(begin, token.find_last_not_of(" \t"sv)-begin+1));
+        }
     }
+}
+
+struct ResponseHeader : public Fields
+{
+    HttpVersion version=HttpVersion::HTTP_11;
+    StatusCode status_code=0;
+    std::string_view reason_phrase;
 
-    std::string_view operator[](std::string_view key)
+    // Empty when the field is missing or is not a plain decimal number
+    std::optional<uint64_t> content_length() const
     {
-        return m_params[key];
+        auto value=get(HeaderField::content_length);
+        uint64_t number=0;
+        if(auto [ptr, ec] = std::from_chars(value.data(), value.data()+value.size(), number); ec==std::errc() && ptr==value.data()+value.size()) {
+
+            return number;
+        }
+        return std::nullopt;
     }
 
-    auto find(std::string_view key) const
+    bool has_content_length() const
     {
-        return m_params.find(key);
+        return has(HeaderField::content_length);
     }
 
-    auto begin() const
+    bool has_transfer_encoding() const
     {
-        return m_params.begin();
+        return has(HeaderField::transfer_encoding);
     }
 
-    auto end() const
+    // Chunked has to be the last coding applied, anything else is delimited by close.
+    // Repeated fields make one list, as if their values were joined with commas.
+    bool is_chunked() const
     {
-        return m_params.end();
-    }
-};
+        auto chunked=false;
+        for_each_value(HeaderField::transfer_encoding, [&chunked](std::string_view value) {
 
-struct ResponseHeader : public Fields
-{
-private:
-    mutable std::optional<size_t> m_content_length;
+            for_each_token(value, [&chunked](std::string_view coding) {
 
-public:
-    HttpVersion version;
-    StatusCode status_code;
-    std::string_view reason_phrase;
+                chunked=equals_nocase(coding, "chunked"sv);
+            });
+        });
+        return chunked;
+    }
 
-    size_t content_length() const
+    bool accepts_ranges() const
     {
-        if(m_content_length){
+        auto bytes=false;
+        for_each_token(get(HeaderField::accept_ranges), [&bytes](std::string_view unit) {
 
-            return *m_content_length;
-        }
+            bytes=bytes || equals_nocase(unit, "bytes"sv);
+        });
+        return bytes;
+    }
 
-        auto it=find("Content-Length"sv);
-        if(it==end()) {
+    // First and last byte of "Content-Range: bytes first-last/length", empty when malformed
+    std::optional<std::pair<uint64_t, uint64_t>> content_range() const
+    {
+        auto value=get(HeaderField::content_range);
+        if(value.size() < 6 || !equals_nocase(value.substr(0, 6), "bytes "sv)) {
 
-            it=find("content-length"sv);
+            return std::nullopt;
         }
 
-        if(it!=end()) {
+        uint64_t first=0;
+        uint64_t last=0;
+        auto end=value.data()+value.size();
+        auto [dash, ec_first]=std::from_chars(value.data()+6, end, first);
+        if(ec_first!=std::errc() || dash==end || *dash!='-') {
 
-            uint32_t number=0;
+            return std::nullopt;
+        }
 
-            if(auto [ptr, ec] = std::from_chars(it->second.data(), it->second.data()+it->second.size(), number); ec==std::errc()) {
+        auto [slash, ec_last]=std::from_chars(dash+1, end, last);
+        if(ec_last!=std::errc() || slash==end || *slash!='/' || last < first) {
 
-                m_content_length=number;
-                return *m_content_length;
-            }
+            return std::nullopt;
         }
+        return std::make_pair(first, last);
+    }
+
+    // HTTP/1.1 connections persist unless closed explicitly, HTTP/1.0 ones only on request
+    bool keep_alive() const
+    {
+        auto close=false;
+        auto keep_alive=version==HttpVersion::HTTP_11;
+        for_each_token(get(HeaderField::connection), [&close, &keep_alive](std::string_view option) {
 
-        m_content_length=0;
-        return *m_content_length;
+            close=close || equals_nocase(option, "close"sv);
+            keep_alive=keep_alive || equals_nocase(option, "keep-alive"sv);
+        });
+        return keep_alive && !close;
     }
 };
 
+// Incremental parser: parse() resumes where the previous call stopped, so each
+// header byte is scanned once however the header is split between reads
 class ResponseHeaderParser
 {
 public:
     enum State
     {
         PROTOCOL_STATUS,
-        FILEDS
+        FIELDS,
+        DONE
     };
 
+private:
+    State m_state;
+    size_t m_line_begin;
+    size_t m_scan;
+
 public:
 
     static std::tuple<bool, HttpVersion, size_t> parse_version(const std::string_view& data, size_t pos)
@@ -139,247 +197,1315 @@ public:
         return {true, 0, 0};
     }
 
-    static std::tuple<bool, ResponseHeader> parse(std::string_view data)
+private:
+    static std::string_view trim(std::string_view value)
     {
-        ResponseHeader header;
+        while(!value.empty() && (value.front()==' ' || value.front()=='\t')) {
+
+            value.remove_prefix(1);
+        }
+
+        while(!value.empty() && (value.back()==' ' || value.back()=='\t')) {
+
+            value.remove_suffix(1);
+        }
+        return value;
+    }
 
+    bool parse_status_line(std::string_view line, ResponseHeader& header)
+    {
         auto pos=size_t(0);
-        const auto status_line=data.substr(pos, data.find("\r\n"sv, pos));
-        if(auto [error, version, ppos]=parse_version(status_line, pos); !error) {
+        if(auto [error, version, ppos]=parse_version(line, pos); !error) {
 
             pos=ppos;
             header.version=version;
         } else {
 
-            return {true, {}};
+            return false;
         }
 
-        if(auto [error, status_code, ppos]=parse_status_code(status_line, pos); !error) {
+        if(auto [error, status_code, ppos]=parse_status_code(line, pos); !error) {
 
             pos=ppos;
             header.status_code=status_code;
         } else {
 
-            return {true, {}};
+            return false;
         }
 
-        header.reason_phrase = status_line.substr(pos);
-        pos=status_line.size()+2;
-        for(;pos < data.size();){
+        header.reason_phrase=line.substr(pos);
+        m_state=FIELDS;
+        return true;
+    }
+
+    bool parse_field(std::string_view line, ResponseHeader& header)
+    {
+        if(line.empty()) {
 
-            if(auto ppos=data.find(':', pos); ppos!=std::string_view::npos) {
+            m_state=DONE;
+            return true;
+        }
 
-                ++ppos;
-                if(auto pppos=data.find("\r\n"sv, ppos); pppos!=std::string_view::npos) {
+        // Obsolete line folding is rejected, as is whitespace before the colon
+        auto colon=line.find(':');
+        if(colon==std::string_view::npos || colon==0 || line[0]==' ' || line[0]=='\t' || line[colon-1]==' ' || line[colon-1]=='\t') {
 
-                    header.add(data.substr(pos, ppos-pos-1), data.substr(data.find_first_not_of(' ', ppos), pppos-ppos));
-                    pos=pppos+2;
-                } else {
+            return false;
+        }
+
+        // Lengths that disagree leave the framing open to either reading
+        auto name=line.substr(0, colon);
+        auto value=trim(line.substr(colon+1));
+        if(lookup_field(name)==HeaderField::content_length && header.has(HeaderField::content_length) && header.get(HeaderField::content_length) != value) {
+
+            return false;
+        }
+
+        header.add(name, value);
+        return true;
+    }
+
+public:
+    ResponseHeaderParser():
+        m_state(PROTOCOL_STATUS),
+        m_line_begin(0),
+        m_scan(0)
+    {}
+
+    void reset()
+    {
+        m_state=PROTOCOL_STATUS;
+        m_line_begin=0;
+        m_scan=0;
+    }
+
+    // data is everything received so far; it may only grow between calls and must
+    // stay in place while the header is used. Returns the header size once complete.
+    std::tuple<bool, size_t> parse(std::string_view data, ResponseHeader& header)
+    {
+        while(m_state!=DONE) {
+
+            m_scan=find_control(data.data()+m_scan, data.data()+data.size())-data.data();
+            if(m_scan==data.size()) {
+
+                return {false, 0};
+            }
 
-                    return {true, {}};
+            auto next=m_scan+1;
+            if(data[m_scan]=='\r') {
+
+                if(next==data.size()) {
+
+                    return {false, 0};
+                } else if(data[next]!='\n') {
+
+                    return {true, 0};
                 }
-            } else {
+                ++next;
+            } else if(data[m_scan]!='\n') {
 
-                return {true, {}};
+                return {true, 0};
             }
+
+            auto line=data.substr(m_line_begin, m_scan-m_line_begin);
+            auto ok=m_state==PROTOCOL_STATUS ? parse_status_line(line, header) : parse_field(line, header);
+            if(!ok) {
+
+                return {true, 0};
+            }
+            m_line_begin=m_scan=next;
         }
 
-        return {false, header};
+        return {false, m_line_begin};
+    }
+
+    bool is_done() const
+    {
+        return m_state==DONE;
     }
 };
 
 
-class HttpClient
+// Splits a byte stream into responses: feed() consumes bytes of the current
+// response only, whatever follows belongs to the next one
+class ResponseReader
 {
-private:
+public:
     static constexpr uint32_t MAX_HEADER_SIZE=4096; //bytes
-    static constexpr uint32_t MAX_BODY_SIZE=1024*1024*1024; //bytes
-    static constexpr uint32_t BUFFER_SIZE=1024; //bytes
+    static constexpr uint64_t MAX_BODY_SIZE=1024*1024*1024; //bytes
 
-    Loop& m_loop;
-    TcpStream m_stream;
-    std::shared_ptr<std::vector<char>> buffer;
-    std::shared_ptr<std::vector<char>> header_buffer;
-    HttpUrl m_url;
-    std::function<void(std::string_view, const Error&)> m_load_cb;
-    std::function<void(const Error&)> m_connect_cb;
-    ResponseHeader header;
+    enum State
+    {
+        HEADER,
+        BODY,
+        CHUNKED,
+        UNTIL_CLOSE,
+        DONE
+    };
+
+private:
+    std::vector<char> m_header_buffer;
+    ResponseHeader m_header;
+    ResponseHeaderParser m_parser;
+    ChunkedDecoder m_chunked;
+    ContentDecoder m_decoder;
+    State m_state;
+    bool m_decode;
+    bool m_close_delimited;
+    bool m_truncated;
+    uint64_t m_body_left;
+    uint64_t m_body_size;
 
 private:
-    void read_http_response_body(size_t bytes_alrady_readed)
+    static bool has_body(StatusCode status_code)
+    {
+        return status_code >= 200 && status_code != 204 && status_code != 304;
+    }
+
+    // The buffer never grows past its reserved size, so parsed fields stay valid
+    std::tuple<Error, size_t> feed_header(std::string_view data)
     {
-        m_stream.read_some(*buffer, [this, bytes_alrady_readed](size_t bytes_readed, const Error& error) {
+        auto old_size=m_header_buffer.size();
+        auto size=std::min<size_t>(data.size(), MAX_HEADER_SIZE-old_size);
+        m_header_buffer.insert(m_header_buffer.end(), data.begin(), data.begin()+size);
 
-            if(error) {
+        auto [error, header_size]=m_parser.parse(std::string_view(m_header_buffer.data(), m_header_buffer.size()), m_header);
+        if(error) {
 
-                m_load_cb({}, error);
-                return;
+            return {Error(Error::err_parse_header), 0};
+        } else if(header_size==0) {
+
+            if(m_header_buffer.size() >= MAX_HEADER_SIZE) {
+
+                return {Error(Error::err_large_header), 0};
             }
+            return {Error(Error::ok), size};
+        }
 
-            m_load_cb(std::string_view(buffer->data(), bytes_readed), Error(Error::ok));
-            auto total_readed=bytes_alrady_readed+bytes_readed;
-            if(total_readed <= MAX_BODY_SIZE) {
+        m_header_buffer.resize(header_size);
 
-                if(total_readed<header.content_length()) {
+        // Transfer-Encoding overrides Content-Length
+        if(!has_body(m_header.status_code)) {
 
-                    read_http_response_body(total_readed);
-                }
-            } else {
+            m_state=DONE;
+        } else if(m_header.is_chunked()) {
+
+            m_state=CHUNKED;
+        } else if(m_header.has_content_length() && !m_header.has_transfer_encoding()) {
+
+            auto length=m_header.content_length();
+            if(!length) {
+
+                return {Error(Error::err_parse_header), 0};
+            }
+
+            m_body_left=*length;
+            m_state=m_body_left>0 ? BODY : DONE;
+        } else {
+
+            m_state=UNTIL_CLOSE;
+            m_close_delimited=true;
+        }
+
+        m_decoder.reset(m_decode && m_state!=DONE ? ContentDecoder::format_of(m_header.get(HeaderField::content_encoding)) : ContentDecoder::NONE);
+        return {Error(Error::ok), header_size-old_size};
+    }
+
+    // Passes body bytes on as received, or decoded when a content coding is removed
+    template<typename T>
+    Error deliver(std::string_view part_body, T& handler)
+    {
+        if(!m_decoder.is_active()) {
+
+            handler(part_body);
+            return Error(Error::ok);
+        }
 
-                m_load_cb({}, Error(Error::err_large_body) );
+        // The decoded size is limited as well, a small body may inflate to any size
+        auto too_large=false;
+        auto error=m_decoder.feed(part_body, [this, &handler, &too_large](std::string_view decoded) {
+
+            too_large=too_large || m_decoder.decoded_size() > MAX_BODY_SIZE;
+            if(!too_large) {
+
+                handler(decoded);
             }
         });
+        return too_large ? Error(Error::err_large_body) : error;
     }
 
-    void read_http_response_header()
+public:
+    ResponseReader():
+        m_state(HEADER),
+        m_decode(false),
+        m_close_delimited(false),
+        m_truncated(false),
+        m_body_left(0),
+        m_body_size(0)
     {
-        m_stream.read_some(*buffer, [this](size_t bytes_readed, const Error& error) {
+        m_header_buffer.reserve(MAX_HEADER_SIZE);
+    }
+
+    ResponseReader(const ResponseReader&) = delete;
+    ResponseReader& operator=(const ResponseReader&) = delete;
+
+    void reset()
+    {
+        m_header_buffer.clear();
+        m_header=ResponseHeader();
+        m_parser.reset();
+        m_chunked.reset();
+        m_decoder.reset(ContentDecoder::NONE);
+        m_state=HEADER;
+        m_close_delimited=false;
+        m_truncated=false;
+        m_body_left=0;
+        m_body_size=0;
+    }
+
+    // Returns how many bytes of data belong to the current response; body bytes go to handler
+    template<typename T>
+    std::tuple<Error, size_t> feed(std::string_view data, T&& handler)
+    {
+        auto pos=size_t(0);
+        if(m_state==HEADER) {
 
+            auto [error, consumed]=feed_header(data);
             if(error) {
 
-                m_load_cb({}, error);
-                return;
+                return {error, 0};
+            }
+            pos=consumed;
+        }
+
+        if(m_state==CHUNKED) {
+
+            auto too_large=false;
+            auto body_error=Error(Error::ok);
+            auto [error, consumed]=m_chunked.feed(data.substr(pos), [this, &handler, &too_large, &body_error](std::string_view part_body) {
+
+                m_body_size+=part_body.size();
+                too_large=too_large || m_body_size > MAX_BODY_SIZE;
+                if(!too_large && !body_error && !part_body.empty()) {
+
+                    body_error=deliver(part_body, handler);
+                }
+            });
+
+            if(too_large) {
+
+                return {Error(Error::err_large_body), 0};
+            } else if(error || body_error) {
+
+                return {error ? error : body_error, 0};
             }
 
-            if(bytes_readed == 0) {
+            pos+=consumed;
+            if(m_chunked.is_done()) {
 
-                return ;
+                m_state=DONE;
             }
+        } else if(m_state==BODY || m_state==UNTIL_CLOSE) {
 
-            auto data=std::string_view(buffer->data(), bytes_readed);
-            bool is_finish=false;
-            auto pos=size_t(0);
-            for(; pos<data.size() && !is_finish; pos+=2) {
+            auto size=data.size()-pos;
+            if(m_state==BODY) {
 
-                auto next_pos=data.find("\r\n"sv, pos);
-                if(next_pos==std::string_view::npos) {
+                size=std::min<uint64_t>(size, m_body_left);
+                m_body_left-=size;
+            }
 
-                    m_load_cb({}, Error(Error::err_parse_header));
-                    return;
-                }
+            m_body_size+=size;
+            if(m_body_size > MAX_BODY_SIZE) {
 
-                is_finish=(pos==next_pos);
-                if(!is_finish) {
+                return {Error(Error::err_large_body), 0};
+            }
+
+            if(size > 0) {
 
-                    header_buffer->insert(header_buffer->end(), data.data()+pos, data.data()+next_pos+2);
+                if(auto error=deliver(data.substr(pos, size), handler)) {
+
+                    return {error, 0};
                 }
+                pos+=size;
+            }
 
-                pos=next_pos;
+            if(m_state==BODY && m_body_left==0) {
+
+                m_state=DONE;
             }
+        }
 
-            if(is_finish) {
+        if(m_state==DONE && !m_truncated && !m_decoder.is_complete()) {
 
-                bool error;
-                std::tie(error, header)=ResponseHeaderParser::parse(std::string_view(header_buffer->data(),header_buffer->size()));
-                if(!error) {
+            return {Error(Error::err_decode_body, "compressed body ends early"), 0};
+        }
+        return {Error(Error::ok), pos};
+    }
 
-                    if(header.content_length()>0) {
+    // Decoded bodies are passed on only when a client asks; call between responses
+    void set_decoding(bool decode)
+    {
+        m_decode=decode;
+    }
 
-                        auto bytes_alrady_readed=data.size()-pos;
-                        if(pos!=data.size()) {
+    // End of stream completes a close-delimited body and nothing else
+    bool finish_on_eof()
+    {
+        if(m_state==UNTIL_CLOSE && m_decoder.is_complete()) {
 
-                            m_load_cb(data.substr(pos, bytes_alrady_readed), Error(Error::ok));
-                        }
-                        read_http_response_body(bytes_alrady_readed);
-                    }
-                } else {
+            m_state=DONE;
+            return true;
+        }
+        return false;
+    }
 
-                    m_load_cb({}, Error(Error::err_parse_header));
-                }
-            } else {
+    bool is_started() const
+    {
+        return m_state!=HEADER || !m_header_buffer.empty();
+    }
 
-                if(header_buffer->size() <= MAX_HEADER_SIZE) {
+    bool is_header_done() const
+    {
+        return m_state!=HEADER;
+    }
 
-                    read_http_response_header();
-                } else {
+    bool is_done() const
+    {
+        return m_state==DONE;
+    }
 
-                    m_load_cb({}, Error(Error::err_large_header));
-                }
+    // The connection can carry another response only if this one had explicit framing
+    bool is_reusable() const
+    {
+        return m_state==DONE && !m_close_delimited && !m_truncated;
+    }
+
+    // Identity bodies can be moved past the reader, e.g. spliced into a file
+    bool is_identity_body() const
+    {
+        return (m_state==BODY || m_state==UNTIL_CLOSE) && !m_decoder.is_active();
+    }
+
+    uint64_t body_left() const
+    {
+        return m_state==BODY ? m_body_left : UINT64_MAX;
+    }
+
+    // Ends a length-delimited body after size bytes, or after what was already read
+    // if that is more; returns the new length. The rest stays unread on the connection.
+    uint64_t truncate_body(uint64_t size)
+    {
+        if(m_state!=BODY) {
+
+            return m_state==DONE ? m_body_size : UINT64_MAX;
+        }
+
+        size=std::max(size, m_body_size);
+        if(size < m_body_size+m_body_left) {
+
+            m_body_left=size-m_body_size;
+            m_truncated=true;
+            if(m_body_left==0) {
+
+                m_state=DONE;
             }
-        });
+        }
+        return m_body_size+m_body_left;
     }
 
-    void send_http_request()
+    // Accounts for body bytes that bypassed feed(); they are not limited by MAX_BODY_SIZE
+    void skip_body(uint64_t size)
     {
-        auto http_request = std::make_shared<std::string>();
-        http_request->reserve(MAX_HEADER_SIZE);
-        http_request->append("GET "sv);
-        http_request->append(m_url.target);
-        http_request->append(" HTTP/1.1\r\n"sv);
-        http_request->append("Host: "sv);
-        http_request->append(m_url.host);
-        http_request->append("\r\n"sv);
-        http_request->append("Accept: text/html\r\n"sv);
-        http_request->append("User-Agent: Test\r\n"sv);
-        http_request->append("\n"sv);
-
-        m_stream.write(*http_request, [this, http_request](const Error& error) {
+        m_body_size+=size;
+        if(m_state==BODY) {
 
-            if(error) {
+            m_body_left-=std::min(size, m_body_left);
+            if(m_body_left==0) {
 
-                m_load_cb({}, error);
-                return;
+                m_state=DONE;
             }
+        }
+    }
 
-            read_http_response_header();
-        });
+    const ResponseHeader& header() const
+    {
+        return m_header;
+    }
+
+    uint64_t body_size() const
+    {
+        return m_body_size;
+    }
+};
+
+inline void append_get_request(std::string& out, std::string_view host, std::string_view target, bool keep_alive, bool compressed=false, std::string_view extra_fields={})
+{
+    out.append("GET "sv);
+    out.append(target);
+    out.append(" HTTP/1.1\r\n"sv);
+    out.append("Host: "sv);
+    out.append(host);
+    out.append("\r\n"sv);
+    out.append("Accept: text/html\r\n"sv);
+    out.append("User-Agent: Test\r\n"sv);
+    out.append(keep_alive ? "Connection: keep-alive\r\n"sv : "Connection: close\r\n"sv);
+    if(compressed) {
+
+        out.append("Accept-Encoding: gzip, deflate\r\n"sv);
     }
+    out.append(extra_fields);
+    out.append("\r\n"sv);
+}
+
+// Zero disables a deadline
+struct HttpTimeouts
+{
+    std::chrono::milliseconds resolve=std::chrono::seconds(10);
+    std::chrono::milliseconds connect=std::chrono::seconds(10);
+    std::chrono::milliseconds first_byte=std::chrono::seconds(30);
+    std::chrono::milliseconds idle=std::chrono::seconds(30);
+    std::chrono::milliseconds total=std::chrono::milliseconds(0);
+};
 
+// A body sink takes what a load delivers: Error on_header(const ResponseHeader&),
+// on_body(std::string_view) for each part, on_error(const Error&) when the load
+// fails and on_complete(const Error&) once at the end
+template<typename S, typename=void>
+struct is_body_sink : std::false_type {};
+
+template<typename S>
+struct is_body_sink<S, std::void_t<
+    decltype(Error(std::declval<S&>().on_header(std::declval<const ResponseHeader&>()))),
+    decltype(std::declval<S&>().on_body(std::string_view())),
+    decltype(std::declval<S&>().on_error(std::declval<const Error&>())),
+    decltype(std::declval<S&>().on_complete(std::declval<const Error&>()))>> : std::true_type {};
+
+template<typename S>
+constexpr bool is_body_sink_v=is_body_sink<S>::value;
+
+// Handlers of any type behind load_stream() and set_header_handler(), at the cost
+// of an indirect call per body part
+class FunctionSink
+{
+private:
+    std::function<void(std::string_view, const Error&)> m_body;
+    std::function<void(const Error&)> m_complete;
+    std::function<Error(const ResponseHeader&)> m_header;
 
 public:
-    HttpClient(Loop& loop, HttpUrl&& url):
-        m_loop(loop),
-        m_stream(m_loop),
-        buffer(std::make_shared<std::vector<char>>(BUFFER_SIZE)),
-        header_buffer(std::make_shared<std::vector<char>>()),
-        m_url(std::forward<HttpUrl>(url))
+    template<typename T, typename C>
+    void set_handlers(T&& body_handler, C&& complete_handler)
     {
-        header_buffer->reserve(MAX_HEADER_SIZE);
+        m_body=std::forward<T>(body_handler);
+        m_complete=std::forward<C>(complete_handler);
     }
 
     template<typename T>
-    void connect(T&& handler)
+    void set_header_handler(T&& handler)
     {
-        if(m_connect_cb) {
+        m_header=std::forward<T>(handler);
+    }
 
-            return;
+    Error on_header(const ResponseHeader& header)
+    {
+        return m_header ? m_header(header) : Error(Error::ok);
+    }
+
+    void on_body(std::string_view part_body)
+    {
+        if(m_body) {
+
+            m_body(part_body, Error(Error::ok));
         }
+    }
 
-        m_connect_cb=std::forward<T>(handler);
+    void on_error(const Error& error)
+    {
+        if(m_body) {
 
-        resolve(m_loop, m_url.host, [this](const auto& result, const Error& error) {
+            m_body({}, error);
+        }
+    }
 
-            if(error) {
+    void on_complete(const Error& error)
+    {
+        if(m_complete) {
 
-                m_connect_cb(error);
-                return;
-            }
+            m_complete(error);
+        }
+    }
+};
+
+// The body goes to the sink, or to the file with load_file(); a sink of a
+// concrete type is called directly, so the receive path inlines into it
+template<typename Sink>
+class BasicHttpClient
+{
+    static_assert(is_body_sink_v<Sink>, "Sink has on_header, on_body, on_error and on_complete");
+
+private:
+    static constexpr uint32_t MAX_HEADER_SIZE=4096; //bytes
+
+    Loop& m_loop;
+    ConnectionPool* m_pool;
+    ResolverCache* m_resolver;
+    std::unique_ptr<TcpStream> m_stream;
+    std::vector<TcpEndpoint> m_endpoints;
+    std::optional<TcpEndpoint> m_endpoint;
+    Connector m_connector;
+    PooledBuffer m_buffer;
+    AdaptiveReadSize m_read_size;
+    ResponseReader m_reader;
+    HttpUrl m_url;
+    Sink m_sink;
+    InlineFunction<void(const Error&)> m_connect_cb;
+    bool m_loading;
+    std::string m_fields;
+    ContentCoding m_coding;
+    std::function<void(uint64_t)> m_progress_cb;
+    HttpTimeouts m_timeouts;
+    HttpTimings m_timings;
+    Metrics* m_metrics;
+    Timer m_phase_timer;
+    Timer m_total_timer;
+    ResolveHandle m_resolving;
+    bool m_connecting;
+    bool m_reused;
+    bool m_paused;
+    bool m_read_waiting;
+    OutFileStream* m_file;
+    std::optional<uint64_t> m_file_offset;
+    std::unique_ptr<SplicePipe> m_pipe;
+    std::function<void(const Error&)> m_file_complete_cb;
+    Error m_file_error;
+    size_t m_pending_writes;
+    uint64_t m_file_written;
+    uint64_t m_file_spliced;
+    bool m_loaded;
+
+private:
+    void start_phase(std::chrono::milliseconds timeout, Error::Code code)
+    {
+        if(timeout.count() > 0) {
 
-            m_stream.connect(TcpEndpoint(result.front(), m_url.port), [this](const Error& error) {
+            m_loop.start_timer(m_phase_timer, timeout, [this, code]() {
 
-                m_connect_cb(error);
+                fail(Error(code));
             });
-        });
+        } else {
+
+            m_phase_timer.cancel();
+        }
     }
 
-    template<typename T>
-    void load_stream(T&& handler)
+    void finish()
     {
-        if(m_load_cb) {
+        m_read_waiting=false;
+        if(m_file) {
 
-            return;
+            m_file->cancel_drain(this);
         }
+        m_phase_timer.cancel();
+        m_total_timer.cancel();
+        m_resolving.cancel();
+        m_connector.cancel();
+        if(m_stream) {
 
-        m_load_cb=std::forward<T>(handler);
-        connect([this](const auto& error){
+            m_stream->cancel();
+        }
+        if(m_pipe) {
 
-            if(error) {
+            m_pipe->cancel();
+        }
+        m_buffer.reset();
+    }
 
-                m_load_cb({}, error);
-                return;
-            }
+    // Borrows a block for the next read only, so an idle client holds no buffer
+    template<typename T>
+    void read_some(T&& handler)
+    {
+        if(m_buffer.size() != m_read_size.size()) {
 
-            send_http_request();
-        });
+            m_buffer.reset();
+            m_buffer=m_loop.buffers().acquire(m_read_size.size());
+        }
+        m_stream->read_some(m_buffer.data(), m_buffer.size(), std::forward<T>(handler));
     }
-};
\ No newline at end of file
+
+    // Hands a connection that ended exactly on the response boundary back to the pool
+    void release_stream(bool reusable)
+    {
+        if(!m_pool || !m_stream) {
+
+            return;
+        }
+
+        if(reusable && m_reader.header().keep_alive()) {
+
+            m_pool->release(*m_endpoint, std::move(m_stream));
+        } else {
+
+            retire_stream();
+            m_pool->discard();
+        }
+    }
+
+    // The stream may be the caller of the current handler, close it on the next iteration
+    void retire_stream()
+    {
+        if(m_stream) {
+
+            m_loop.post([stream=std::move(m_stream)]() {});
+        }
+    }
+
+    // A pooled connection may have been closed by the server while idle
+    bool retry_fresh(const Error& error)
+    {
+        if(!m_reused || m_reader.is_started() || error.code()==Error::err_timeout_total) {
+
+            return false;
+        }
+
+        finish();
+        m_reused=false;
+        m_connecting=true;
+        connect_stream(true);
+        return true;
+    }
+
+    // An idle pooled connection to any of the addresses is used first, otherwise they are raced
+    void connect_stream(bool fresh)
+    {
+        retire_stream();
+        for(auto& endpoint : m_endpoints) {
+
+            if(m_pool && !fresh && (m_stream=m_pool->find(endpoint))) {
+
+                m_reused=true;
+                m_endpoint.emplace(endpoint);
+                m_phase_timer.cancel();
+                m_connecting=false;
+                m_timings.connected=HttpTimings::Clock::now();
+                m_connect_cb(Error(Error::ok));
+                return;
+            }
+        }
+
+        start_phase(m_timeouts.connect, Error::err_timeout_connect);
+        m_connector.start(m_endpoints, [this](const Error& error, std::unique_ptr<TcpStream> stream, const TcpEndpoint& endpoint) {
+
+            if(error) {
+
+                fail(error);
+                return;
+            }
+
+            // Later connections try the address that answered first
+            std::stable_partition(m_endpoints.begin(), m_endpoints.end(), [&endpoint](const TcpEndpoint& candidate) {
+
+                return candidate == endpoint;
+            });
+            m_stream=std::move(stream);
+            m_endpoint.emplace(endpoint);
+            m_phase_timer.cancel();
+            m_connecting=false;
+            m_timings.connected=HttpTimings::Clock::now();
+            m_connect_cb(error);
+        });
+    }
+
+    // The request as an async span with its phases nested; phases it skipped, such
+    // as resolving on a reused connection, are left out
+    void trace(Tracer& tracer, const Error& error)
+    {
+        auto id=tracer.next_id();
+        auto host=tracer.intern(m_url.host);
+        auto phase=[&tracer, id, host, start=m_timings.start](const char* name, HttpTimings::Clock::time_point begin, HttpTimings::Clock::time_point end) {
+
+            if(begin >= start && end >= begin) {
+
+                tracer.async(name, "http", id, begin, end, {}, host);
+            }
+        };
+
+        tracer.async("request", "http", id, m_timings.start, m_timings.done, {{"bytes", int64_t(m_reader.body_size())}, {"status", m_reader.header().status_code}, {"error", error.code()}}, host);
+        phase("resolve", m_timings.start, m_timings.resolved);
+        phase("connect", m_timings.resolved, m_timings.connected);
+        phase("first_byte", m_timings.connected, m_timings.first_byte);
+        phase("transfer", m_timings.first_byte, m_timings.done);
+    }
+
+    void complete(const Error& error)
+    {
+        finish();
+        m_loaded=true;
+        m_timings.done=HttpTimings::Clock::now();
+        if(m_metrics) {
+
+            m_metrics->record(m_url.host, m_timings, m_reader.body_size(), error);
+        }
+        if(auto tracer=m_loop.tracer()) {
+
+            trace(*tracer, error);
+        }
+        if(m_file) {
+
+            if(error && !m_file_error) {
+
+                m_file_error=error;
+            }
+            complete_file();
+        } else {
+
+            m_sink.on_complete(error);
+        }
+    }
+
+    void fail_load(const Error& error)
+    {
+        if(!m_file) {
+
+            m_sink.on_error(error);
+        }
+        complete(error);
+    }
+
+    void fail(const Error& error)
+    {
+        finish();
+        if(m_connecting) {
+
+            m_connecting=false;
+            m_connect_cb(error);
+        } else {
+
+            fail_load(error);
+        }
+    }
+
+    Error on_header()
+    {
+        m_timings.header=HttpTimings::Clock::now();
+        return m_sink.on_header(m_reader.header());
+    }
+
+    void on_response_data(size_t bytes_readed)
+    {
+        if(!m_reader.is_started()) {
+
+            m_timings.first_byte=HttpTimings::Clock::now();
+        }
+        m_read_size.update(bytes_readed);
+        auto data=std::string_view(m_buffer.data(), bytes_readed);
+
+        // The header handler sees the header before any of the body is passed on
+        auto header_seen=m_reader.is_header_done();
+        auto header_error=Error(Error::ok);
+        auto [error, consumed]=m_reader.feed(data, [this, &header_seen, &header_error](std::string_view part_body) {
+
+            if(!header_seen) {
+
+                header_seen=true;
+                header_error=on_header();
+            }
+
+            if(header_error) {
+
+                return;
+            } else if(m_file) {
+
+                if(!part_body.empty()) {
+
+                    write_file(part_body);
+                }
+            } else {
+
+                m_sink.on_body(part_body);
+            }
+        });
+
+        if(!error && !header_seen && m_reader.is_header_done()) {
+
+            header_error=on_header();
+        }
+
+        if(error || header_error) {
+
+            fail(error ? error : header_error);
+        } else if(m_reader.is_done()) {
+
+            finish();
+            release_stream(m_reader.is_reusable() && consumed==data.size());
+            complete(Error(Error::ok));
+        } else if(m_reader.is_header_done() && m_file && m_reader.is_identity_body() && open_pipe()) {
+
+            m_buffer.reset();
+            splice_http_response_body();
+        } else if(m_reader.is_header_done()) {
+
+            read_http_response_body();
+        } else {
+
+            start_phase(m_timeouts.idle, Error::err_timeout_idle);
+            read_http_response_header();
+        }
+    }
+
+    void on_body_error(const Error& error)
+    {
+        if(error.code()==Error::err_eof && m_reader.finish_on_eof()) {
+
+            finish();
+            release_stream(false);
+            complete(Error(Error::ok));
+        } else {
+
+            fail(error);
+        }
+    }
+
+    // Waiting for the reader or the disk to catch up is not idling, the idle deadline is off meanwhile
+    bool wait_before_read()
+    {
+        if(!m_paused && !(m_file && m_file->is_congested())) {
+
+            return false;
+        }
+
+        m_read_waiting=true;
+        m_phase_timer.cancel();
+        m_buffer.reset();
+        if(!m_paused) {
+
+            m_file->when_drained(this, [this]() {
+
+                continue_reading();
+            });
+        }
+        return true;
+    }
+
+    void continue_reading()
+    {
+        if(m_read_waiting && !m_paused) {
+
+            m_read_waiting=false;
+            read_http_response_body();
+        }
+    }
+
+    void read_http_response_body()
+    {
+        if(wait_before_read()) {
+
+            return;
+        }
+
+        start_phase(m_timeouts.idle, Error::err_timeout_idle);
+        read_some([this](size_t bytes_readed, const Error& error) {
+
+            if(error) {
+
+                on_body_error(error);
+                return;
+            }
+
+            on_response_data(bytes_readed);
+        });
+    }
+
+    // Without a pipe the body takes the buffered path, as it does without the ring:
+    // there the file side of a splice would block the loop
+    bool open_pipe()
+    {
+        if(!m_loop.ring()) {
+
+            return false;
+        } else if(!m_pipe) {
+
+            try {
+
+                m_pipe=std::make_unique<SplicePipe>(m_loop);
+            } catch(const Error&) {
+
+                // Out of pipes or fds: the buffered path works without them, nothing to report
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Socket to pipe to file, the body never enters user space
+    void splice_http_response_body()
+    {
+        start_phase(m_timeouts.idle, Error::err_timeout_idle);
+        m_stream->splice_some(*m_pipe, size_t(std::min<uint64_t>(m_reader.body_left(), m_pipe->capacity())), [this](size_t bytes_spliced, const Error& error) {
+
+            if(error) {
+
+                on_body_error(error);
+                return;
+            }
+
+            auto on_file=[this, bytes_spliced](size_t moved, const Error& file_error) {
+
+                if(m_file_offset) {
+
+                    *m_file_offset+=moved;
+                }
+                m_file_spliced+=moved;
+                report_progress();
+
+                if(file_error) {
+
+                    m_pipe.reset();
+                    fail(file_error);
+                    return;
+                }
+
+                m_reader.skip_body(bytes_spliced);
+                if(m_reader.is_done()) {
+
+                    finish();
+                    release_stream(m_reader.is_reusable());
+                    complete(Error(Error::ok));
+                } else {
+
+                    splice_http_response_body();
+                }
+            };
+
+            if(m_file_offset) {
+
+                m_file->splice_from(*m_pipe, bytes_spliced, *m_file_offset, std::move(on_file));
+            } else {
+
+                m_file->splice_from(*m_pipe, bytes_spliced, std::move(on_file));
+            }
+        });
+    }
+
+    // Writes complete in order and all come before the first splice, so the count
+    // never covers a byte that is not in the file yet
+    void report_progress()
+    {
+        if(m_progress_cb && !m_file_error) {
+
+            m_progress_cb(m_file_written+(m_pending_writes==0 ? m_file_spliced : 0));
+        }
+    }
+
+    void write_file(std::string_view part_body)
+    {
+        ++m_pending_writes;
+        auto handler=[this](size_t transferd_bytes, const Error& error) {
+
+            --m_pending_writes;
+            if(error && !m_file_error) {
+
+                m_file_error=error;
+            }
+            m_file_written+=transferd_bytes;
+            report_progress();
+            complete_file();
+        };
+
+        if(m_file_offset) {
+
+            m_file->write_at(*m_file_offset, part_body, std::move(handler));
+            *m_file_offset+=part_body.size();
+        } else {
+
+            m_file->write(part_body, std::move(handler));
+        }
+    }
+
+    void complete_file()
+    {
+        if(m_loaded && m_pending_writes==0 && m_file_complete_cb) {
+
+            auto handler=std::move(m_file_complete_cb);
+            m_file_complete_cb=nullptr;
+            handler(m_file_error);
+        }
+    }
+
+    void read_http_response_header()
+    {
+        read_some([this](size_t bytes_readed, const Error& error) {
+
+            if(error) {
+
+                if(!retry_fresh(error)) {
+
+                    fail(error);
+                }
+                return;
+            }
+
+            on_response_data(bytes_readed);
+        });
+    }
+
+    void send_http_request()
+    {
+        auto http_request = std::make_shared<std::string>();
+        http_request->reserve(MAX_HEADER_SIZE);
+        append_get_request(*http_request, m_url.host, m_url.target, m_pool!=nullptr, m_coding!=ContentCoding::IDENTITY, m_fields);
+
+        start_phase(m_timeouts.first_byte, Error::err_timeout_first_byte);
+        m_stream->write(*http_request, [this, http_request](const Error& error) {
+
+            if(error) {
+
+                if(!retry_fresh(error)) {
+
+                    fail(error);
+                }
+                return;
+            }
+
+            read_http_response_header();
+        });
+    }
+
+
+public:
+    BasicHttpClient(Loop& loop, HttpUrl&& url, const HttpTimeouts& timeouts=HttpTimeouts(), ConnectionPool* pool=nullptr, ResolverCache* resolver=nullptr, Sink sink=Sink()):
+        m_loop(loop),
+        m_pool(pool),
+        m_resolver(resolver),
+        m_connector(loop, pool),
+        m_url(std::forward<HttpUrl>(url)),
+        m_sink(std::move(sink)),
+        m_loading(false),
+        m_coding(ContentCoding::DECODE),
+        m_timeouts(timeouts),
+        m_metrics(nullptr),
+        m_connecting(false),
+        m_reused(false),
+        m_paused(false),
+        m_read_waiting(false),
+        m_file(nullptr),
+        m_file_error(Error::ok),
+        m_pending_writes(0),
+        m_file_written(0),
+        m_file_spliced(0),
+        m_loaded(false)
+    {
+        m_reader.set_decoding(true);
+    }
+
+    BasicHttpClient(const BasicHttpClient&) = delete;
+    BasicHttpClient& operator=(const BasicHttpClient&) = delete;
+
+    ~BasicHttpClient()
+    {
+        if(m_file) {
+
+            m_file->cancel_drain(this);
+        }
+    }
+
+    template<typename T>
+    void connect(T&& handler)
+    {
+        if(m_connect_cb) {
+
+            return;
+        }
+
+        m_connect_cb=std::forward<T>(handler);
+        m_connecting=true;
+        m_timings.start=HttpTimings::Clock::now();
+
+        start_phase(m_timeouts.resolve, Error::err_timeout_resolve);
+        auto on_resolved=[this](const std::vector<Endpoint>& result, const Error& error) {
+
+            if(error) {
+
+                fail(error);
+                return;
+            }
+
+            m_timings.resolved=HttpTimings::Clock::now();
+
+            m_endpoints.clear();
+            for(auto& endpoint : result) {
+
+                m_endpoints.emplace_back(endpoint, m_url.port);
+            }
+            connect_stream(false);
+        };
+        m_resolving=m_resolver ? m_resolver->resolve(m_url.host, on_resolved) : resolve(m_loop, m_url.host, on_resolved);
+    }
+
+    const ResponseHeader& response_header() const
+    {
+        return m_reader.header();
+    }
+
+    uint64_t body_size() const
+    {
+        return m_reader.body_size();
+    }
+
+    // Body bytes load_file() has put in the file, decoded ones when decoding
+    uint64_t file_size() const
+    {
+        return m_file_written+m_file_spliced;
+    }
+
+    const HttpTimings& timings() const
+    {
+        return m_timings;
+    }
+
+    Sink& sink()
+    {
+        return m_sink;
+    }
+
+    // Starts the request, the sink gets the rest
+    void load()
+    {
+        if(m_loading) {
+
+            return;
+        }
+
+        m_loading=true;
+        if(m_timeouts.total.count() > 0) {
+
+            m_loop.start_timer(m_total_timer, m_timeouts.total, [this]() {
+
+                fail(Error(Error::err_timeout_total));
+            });
+        }
+
+        connect([this](const auto& error){
+
+            if(error) {
+
+                fail_load(error);
+                return;
+            }
+
+            send_http_request();
+        });
+    }
+
+    template<typename T>
+    void load_stream(T&& handler)
+    {
+        load_stream(std::forward<T>(handler), nullptr);
+    }
+
+    // With a FunctionSink: handler gets each body part, or an empty one with the
+    // error; complete_handler is called once, after the last part or the error
+    template<typename T, typename C>
+    void load_stream(T&& handler, C&& complete_handler)
+    {
+        if(m_loading) {
+
+            return;
+        }
+
+        m_sink.set_handlers(std::forward<T>(handler), std::forward<C>(complete_handler));
+        load();
+    }
+
+    // Extra request header field; call before loading
+    void add_field(std::string_view name, std::string_view value)
+    {
+        m_fields.append(name);
+        m_fields.append(": "sv);
+        m_fields.append(value);
+        m_fields.append("\r\n"sv);
+    }
+
+    // Gzip and deflate bodies are decoded unless told otherwise; call before loading
+    void set_content_coding(ContentCoding coding)
+    {
+        m_coding=coding;
+        m_reader.set_decoding(coding==ContentCoding::DECODE);
+    }
+
+    // Asks for bytes first to last of the resource
+    void set_range(uint64_t first, uint64_t last)
+    {
+        add_field("Range"sv, "bytes="+std::to_string(first)+"-"+std::to_string(last));
+    }
+
+    // Phase timings and the body size go there once the load completes; call before loading
+    void set_metrics(Metrics* metrics)
+    {
+        m_metrics=metrics;
+    }
+
+    // Called with the count of body bytes that have reached the file, all of them before any later ones
+    template<typename T>
+    void set_progress_handler(T&& handler)
+    {
+        m_progress_cb=std::forward<T>(handler);
+    }
+
+    // With a FunctionSink: called once the header is parsed, before any body bytes
+    // are passed on; an error returned by the handler fails the request
+    template<typename T>
+    void set_header_handler(T&& handler)
+    {
+        m_sink.set_header_handler(std::forward<T>(handler));
+    }
+
+    // Flow control for load_stream: after pause(), typically called from the body
+    // handler, no more of the body is read until resume()
+    void pause()
+    {
+        m_paused=true;
+    }
+
+    void resume()
+    {
+        m_paused=false;
+        continue_reading();
+    }
+
+    // Fails the request in progress; its handlers run with the error. Nothing happens
+    // once the load has completed or before it starts.
+    void abort(const Error& error)
+    {
+        if(m_connecting || (m_loading && !m_loaded)) {
+
+            fail(error);
+        }
+    }
+
+    // Stops reading a length-delimited body after size bytes, see ResponseReader::truncate_body
+    uint64_t truncate_body(uint64_t size)
+    {
+        return m_reader.truncate_body(size);
+    }
+
+    // Saves the body to file. Identity bodies are spliced from the socket when the loop
+    // has a ring; otherwise reading stops while the file is congested, see
+    // OutFileStream::set_watermarks. complete_handler runs once everything has reached the file.
+    template<typename C>
+    void load_file(OutFileStream& file, C&& complete_handler)
+    {
+        load_file(file, std::nullopt, std::forward<C>(complete_handler));
+    }
+
+    // Like load_file, but the body is written from offset on instead of appended
+    template<typename C>
+    void load_file(OutFileStream& file, std::optional<uint64_t> offset, C&& complete_handler)
+    {
+        m_file=&file;
+        m_file_offset=offset;
+        m_file_complete_cb=std::forward<C>(complete_handler);
+        load();
+    }
+};
+
+using HttpClient=BasicHttpClient<FunctionSink>;
\ No newline at end of file
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// Fields the client looks at; their values get a fixed slot in Fields
+enum class HeaderField : uint8_t
+{
+    content_length,
+    transfer_encoding,
+    connection,
+    content_encoding,
+    content_type,
+    etag,
+    last_modified,
+    location,
+    content_range,
+    accept_ranges,
+    keep_alive,
+    date,
+    server,
+    cache_control,
+    expires,
+    retry_after,
+    set_cookie,
+    age,
+    vary,
+    content_disposition,
+    unknown
+};
+
+// Lower case names in HeaderField order
+inline constexpr std::string_view KNOWN_FIELDS[]={
+    "content-length",
+    "transfer-encoding",
+    "connection",
+    "content-encoding",
+    "content-type",
+    "etag",
+    "last-modified",
+    "location",
+    "content-range",
+    "accept-ranges",
+    "keep-alive",
+    "date",
+    "server",
+    "cache-control",
+    "expires",
+    "retry-after",
+    "set-cookie",
+    "age",
+    "vary",
+    "content-disposition"
+};
+
+inline constexpr size_t KNOWN_FIELD_COUNT=size_t(HeaderField::unknown);
+static_assert(std::size(KNOWN_FIELDS)==KNOWN_FIELD_COUNT, "a name for every known field");
+
+constexpr char to_lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? char(c-'A'+'a') : c;
+}
+
+constexpr bool equals_nocase(std::string_view a, std::string_view b)
+{
+    if(a.size() != b.size()) {
+
+        return false;
+    }
+
+    for(size_t i=0; i<a.size(); ++i) {
+
+        if(to_lower(a[i]) != to_lower(b[i])) {
+
+            return false;
+        }
+    }
+    return true;
+}
+
+// Length, first and last character give every known name its own slot;
+// the static_assert below keeps it that way when names are added
+inline constexpr size_t FIELD_SLOTS=64;
+
+constexpr size_t field_hash(std::string_view name)
+{
+    return (name.size()+uint8_t(to_lower(name.front()))+25*uint8_t(to_lower(name.back()))) & (FIELD_SLOTS-1);
+}
+
+constexpr std::array<HeaderField, FIELD_SLOTS> make_field_table()
+{
+    std::array<HeaderField, FIELD_SLOTS> table{};
+    for(auto& slot : table) {
+
+        slot=HeaderField::unknown;
+    }
+
+    for(size_t i=0; i<KNOWN_FIELD_COUNT; ++i) {
+
+        table[field_hash(KNOWN_FIELDS[i])]=HeaderField(i);
+    }
+    return table;
+}
+
+inline constexpr auto FIELD_TABLE=make_field_table();
+
+constexpr bool is_perfect_field_table()
+{
+    for(size_t i=0; i<KNOWN_FIELD_COUNT; ++i) {
+
+        if(FIELD_TABLE[field_hash(KNOWN_FIELDS[i])] != HeaderField(i)) {
+
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(is_perfect_field_table(), "known header names collide in FIELD_TABLE");
+
+constexpr HeaderField lookup_field(std::string_view name)
+{
+    if(name.empty()) {
+
+        return HeaderField::unknown;
+    }
+
+    auto field=FIELD_TABLE[field_hash(name)];
+    return field != HeaderField::unknown && equals_nocase(name, KNOWN_FIELDS[size_t(field)]) ? field : HeaderField::unknown;
+}
+
+// Header fields as views into the received header. Known fields are resolved
+// to a slot when added, the rest are kept in order in a small inline array;
+// names compare case-insensitively. Only headers with more than INLINE_FIELDS
+// unknown or repeated fields allocate.
+class Fields
+{
+public:
+    static constexpr size_t INLINE_FIELDS=16;
+
+private:
+    struct Entry
+    {
+        std::string_view name;
+        std::string_view value;
+    };
+
+    std::array<std::string_view, KNOWN_FIELD_COUNT> m_known;
+    uint32_t m_present;
+    std::array<Entry, INLINE_FIELDS> m_inline;
+    size_t m_size;
+    std::vector<Entry> m_overflow;
+
+    static_assert(KNOWN_FIELD_COUNT <= 32, "presence bits fit m_present");
+
+public:
+    Fields():
+        m_known(),
+        m_present(0),
+        m_inline(),
+        m_size(0)
+    {}
+
+    // Repeated known fields keep their first value in the slot
+    void add(std::string_view name, std::string_view value)
+    {
+        if(auto field=lookup_field(name); field != HeaderField::unknown && !has(field)) {
+
+            m_known[size_t(field)]=value;
+            m_present|=uint32_t(1) << size_t(field);
+        } else if(m_size < INLINE_FIELDS) {
+
+            m_inline[m_size++]=Entry{name, value};
+        } else {
+
+            m_overflow.push_back(Entry{name, value});
+        }
+    }
+
+    bool has(HeaderField field) const
+    {
+        return (m_present >> size_t(field)) & 1;
+    }
+
+    // Empty when the field is missing
+    std::string_view get(HeaderField field) const
+    {
+        return has(field) ? m_known[size_t(field)] : std::string_view();
+    }
+
+    std::optional<std::string_view> find(std::string_view name) const
+    {
+        if(auto field=lookup_field(name); field != HeaderField::unknown) {
+
+            return has(field) ? std::optional<std::string_view>(get(field)) : std::nullopt;
+        }
+
+        for(size_t i=0; i<m_size; ++i) {
+
+            if(equals_nocase(m_inline[i].name, name)) {
+
+                return m_inline[i].value;
+            }
+        }
+
+        for(auto& entry : m_overflow) {
+
+            if(equals_nocase(entry.name, name)) {
+
+                return entry.value;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Every value of a field in arrival order, the first one from the slot
+    template<typename T>
+    void for_each_value(HeaderField field, T&& handler) const
+    {
+        if(!has(field)) {
+
+            return;
+        }
+
+        handler(m_known[size_t(field)]);
+        for(size_t i=0; i<m_size; ++i) {
+
+            if(equals_nocase(m_inline[i].name, KNOWN_FIELDS[size_t(field)])) {
+
+                handler(m_inline[i].value);
+            }
+        }
+
+        for(auto& entry : m_overflow) {
+
+            if(equals_nocase(entry.name, KNOWN_FIELDS[size_t(field)])) {
+
+                handler(entry.value);
+            }
+        }
+    }
+
+    // Known fields are reported under their lower case name
+    template<typename T>
+    void for_each(T&& handler) const
+    {
+        for(size_t i=0; i<KNOWN_FIELD_COUNT; ++i) {
+
+            if(has(HeaderField(i))) {
+
+                handler(KNOWN_FIELDS[i], m_known[i]);
+            }
+        }
+
+        for(size_t i=0; i<m_size; ++i) {
+
+            handler(m_inline[i].name, m_inline[i].value);
+        }
+
+        for(auto& entry : m_overflow) {
+
+            handler(entry.name, entry.value);
+        }
+    }
+};
\ No newline at end of file
@@ -0,0 +1,413 @@
+#pragma once
+
+#include "linux_fd.h"
+#include "error.h"
+#include "task.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Target of io_uring completions; a multishot operation stays in flight
+// until its last completion arrives
+class IoOperation
+{
+friend class IoRing;
+
+private:
+    uint32_t m_inflight=0;
+
+public:
+    virtual void on_complete(int32_t result, uint32_t flags)=0;
+
+    bool in_flight() const
+    {
+        return m_inflight > 0;
+    }
+
+protected:
+    ~IoOperation()=default;
+};
+
+// Forwards completions to a callable, usually a lambda capturing the owner
+class IoCallback : public IoOperation
+{
+private:
+    InlineFunction<void(int32_t, uint32_t), 16> m_handler;
+
+public:
+    template<typename T>
+    explicit IoCallback(T&& handler):
+        m_handler(std::forward<T>(handler))
+    {}
+
+    void on_complete(int32_t result, uint32_t flags) override
+    {
+        m_handler(result, flags);
+    }
+};
+
+// Kernel ring memory shared with the process
+class Mapping
+{
+private:
+    void* m_addr;
+    size_t m_size;
+
+public:
+    Mapping(int fd, size_t size, off_t offset):
+        m_addr(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset)),
+        m_size(size)
+    {
+        if(m_addr == MAP_FAILED) {
+
+            throw Error(Error::err_init_loop, strerror(errno));
+        }
+    }
+
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+
+    ~Mapping()
+    {
+        munmap(m_addr, m_size);
+    }
+
+    template<typename T=char>
+    T* at(size_t offset) const
+    {
+        return reinterpret_cast<T*>(static_cast<char*>(m_addr)+offset);
+    }
+};
+
+// io_uring through raw syscalls: submission and completion rings plus a ring
+// of provided receive buffers registered with the kernel. Completions are
+// copied out before they are dispatched, so an operation can be waited for
+// from inside a handler.
+class IoRing
+{
+public:
+    static constexpr unsigned ENTRIES=256;
+    static constexpr unsigned BUFFER_COUNT=256;
+    static constexpr unsigned BUFFER_SIZE=16*1024; //bytes
+    static constexpr uint16_t BUFFER_GROUP=0;
+
+private:
+    static constexpr size_t PAGE=4096; //bytes
+    static_assert(offsetof(io_uring_buf_ring, tail) == offsetof(io_uring_buf, resv), "tail overlays the first entry");
+
+    static constexpr uint32_t REQUIRED_FEATURES=IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL | IORING_FEAT_EXT_ARG;
+
+    struct Free
+    {
+        void operator()(void* memory) const
+        {
+            free(memory);
+        }
+    };
+
+    using Memory=std::unique_ptr<char, Free>;
+
+    struct Completion
+    {
+        IoOperation* op;
+        int32_t result;
+        uint32_t flags;
+    };
+
+    io_uring_params m_params;
+    LinuxFd m_fd;
+    Mapping m_rings;
+    Mapping m_sqes;
+    Memory m_buffer_ring;
+    Memory m_buffers;
+    unsigned m_sq_tail;
+    unsigned m_to_submit;
+    uint16_t m_buffer_tail;
+    std::vector<Completion> m_completions;
+    size_t m_dispatched;
+
+private:
+    static int setup(io_uring_params& params)
+    {
+        // Only the loop thread submits; fall back to plain setup on kernels without these flags
+        params=io_uring_params();
+        params.flags=IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+        int fd=syscall(__NR_io_uring_setup, ENTRIES, &params);
+        if(fd < 0 && errno == EINVAL) {
+
+            params=io_uring_params();
+            fd=syscall(__NR_io_uring_setup, ENTRIES, &params);
+        }
+
+        if(fd < 0) {
+
+            throw Error(Error::err_init_loop, strerror(errno));
+        } else if((params.features & REQUIRED_FEATURES) != REQUIRED_FEATURES) {
+
+            close(fd);
+            throw Error(Error::err_init_loop, "io_uring lacks required features");
+        }
+        return fd;
+    }
+
+    // The buffer ring has to start on a page
+    static Memory allocate(size_t size)
+    {
+        auto memory=static_cast<char*>(aligned_alloc(PAGE, (size+PAGE-1)/PAGE*PAGE));
+        if(!memory) {
+
+            throw Error(Error::err_init_loop, "out of memory");
+        }
+
+        memset(memory, 0, size);
+        return Memory(memory);
+    }
+
+    static size_t rings_size(const io_uring_params& params)
+    {
+        return std::max(params.sq_off.array+params.sq_entries*sizeof(unsigned), params.cq_off.cqes+params.cq_entries*sizeof(io_uring_cqe));
+    }
+
+    template<typename T=unsigned>
+    T* sq(uint32_t offset) const
+    {
+        return m_rings.at<T>(offset);
+    }
+
+    template<typename T=unsigned>
+    T* cq(uint32_t offset) const
+    {
+        return m_rings.at<T>(offset);
+    }
+
+    // Entries overlay the ring header; the flexible array of the C header does not start at 0 in C++
+    io_uring_buf* buffer_ring() const
+    {
+        return reinterpret_cast<io_uring_buf*>(m_buffer_ring.get());
+    }
+
+    void register_buffers()
+    {
+        io_uring_buf_reg reg=io_uring_buf_reg();
+        reg.ring_addr=reinterpret_cast<uint64_t>(buffer_ring());
+        reg.ring_entries=BUFFER_COUNT;
+        reg.bgid=BUFFER_GROUP;
+        if(syscall(__NR_io_uring_register, m_fd.get(), IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+
+            throw Error(Error::err_init_loop, strerror(errno));
+        }
+
+        for(uint16_t id=0; id<BUFFER_COUNT; ++id) {
+
+            recycle(id);
+        }
+    }
+
+    int enter(unsigned to_submit, bool get_events, unsigned wait_nr, int timeout)
+    {
+        __kernel_timespec ts={timeout/1000, (timeout%1000)*1000000LL};
+        io_uring_getevents_arg arg=io_uring_getevents_arg();
+        arg.ts=timeout >= 0 ? reinterpret_cast<uint64_t>(&ts) : 0;
+
+        auto flags=get_events ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+        auto ret=syscall(__NR_io_uring_enter, m_fd.get(), to_submit, wait_nr, flags, &arg, sizeof(arg));
+        if(ret < 0 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+
+            throw Error(Error::err_init_loop, strerror(errno));
+        }
+        return ret < 0 ? 0 : int(ret);
+    }
+
+    void submit_and_wait(int timeout)
+    {
+        auto submitted=enter(m_to_submit, true, timeout != 0 ? 1 : 0, timeout);
+        m_to_submit-=std::min<unsigned>(m_to_submit, submitted);
+    }
+
+public:
+    IoRing():
+        m_fd(setup(m_params)),
+        m_rings(m_fd.get(), rings_size(m_params), IORING_OFF_SQ_RING),
+        m_sqes(m_fd.get(), m_params.sq_entries*sizeof(io_uring_sqe), IORING_OFF_SQES),
+        m_buffer_ring(allocate(BUFFER_COUNT*sizeof(io_uring_buf))),
+        m_buffers(allocate(size_t(BUFFER_COUNT)*BUFFER_SIZE)),
+        m_sq_tail(*sq(m_params.sq_off.tail)),
+        m_to_submit(0),
+        m_buffer_tail(0),
+        m_dispatched(0)
+    {
+        // Submission entries are used in ring order, so the index array is the identity
+        auto array=sq(m_params.sq_off.array);
+        for(unsigned i=0; i<m_params.sq_entries; ++i) {
+
+            array[i]=i;
+        }
+
+        register_buffers();
+        m_completions.reserve(m_params.cq_entries);
+    }
+
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+
+    // The entry is zeroed and tagged with op; it is submitted with the next enter
+    io_uring_sqe* prepare(uint8_t opcode, int fd, IoOperation* op)
+    {
+        auto head=__atomic_load_n(sq(m_params.sq_off.head), __ATOMIC_ACQUIRE);
+        if(m_sq_tail-head >= m_params.sq_entries) {
+
+            submit();
+        }
+
+        auto sqe=m_sqes.at<io_uring_sqe>(0)+(m_sq_tail & *sq(m_params.sq_off.ring_mask));
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode=opcode;
+        sqe->fd=fd;
+        sqe->user_data=reinterpret_cast<uint64_t>(op);
+        if(op) {
+
+            ++op->m_inflight;
+        }
+
+        ++m_sq_tail;
+        ++m_to_submit;
+        __atomic_store_n(sq(m_params.sq_off.tail), m_sq_tail, __ATOMIC_RELEASE);
+        return sqe;
+    }
+
+    // The completion of the cancelled operation still arrives, usually with -ECANCELED
+    void cancel(IoOperation* op)
+    {
+        if(op->in_flight()) {
+
+            auto sqe=prepare(IORING_OP_ASYNC_CANCEL, -1, nullptr);
+            sqe->addr=reinterpret_cast<uint64_t>(op);
+            sqe->cancel_flags=IORING_ASYNC_CANCEL_ALL;
+            sqe->flags=IOSQE_CQE_SKIP_SUCCESS;
+        }
+    }
+
+    bool has_pending() const
+    {
+        return m_to_submit > 0;
+    }
+
+    void submit()
+    {
+        if(m_to_submit > 0) {
+
+            m_to_submit-=std::min<unsigned>(m_to_submit, enter(m_to_submit, false, 0, 0));
+        }
+    }
+
+    // Submits what is pending and waits up to timeout ms (-1 forever) for a completion;
+    // a poll without anything to submit or deferred kernel work needs no syscall.
+    // Completions reaped by wait_for() and not dispatched yet end the wait right away.
+    void wait(int timeout)
+    {
+        if(m_dispatched < m_completions.size()) {
+
+            timeout=0;
+        }
+
+        if(timeout == 0 && m_to_submit == 0 && !(__atomic_load_n(sq(m_params.sq_off.flags), __ATOMIC_RELAXED) & IORING_SQ_TASKRUN)) {
+
+            return;
+        }
+        submit_and_wait(timeout);
+    }
+
+    // Moves completions from the kernel ring to the dispatch list
+    void reap()
+    {
+        auto head=*cq(m_params.cq_off.head);
+        auto tail=__atomic_load_n(cq(m_params.cq_off.tail), __ATOMIC_ACQUIRE);
+        auto mask=*cq(m_params.cq_off.ring_mask);
+        auto cqes=cq<io_uring_cqe>(m_params.cq_off.cqes);
+        for(; head != tail; ++head) {
+
+            auto& cqe=cqes[head & mask];
+            auto op=reinterpret_cast<IoOperation*>(cqe.user_data);
+            if(op && !(cqe.flags & IORING_CQE_F_MORE)) {
+
+                --op->m_inflight;
+            }
+            m_completions.push_back(Completion{op, cqe.res, cqe.flags});
+        }
+        __atomic_store_n(cq(m_params.cq_off.head), head, __ATOMIC_RELEASE);
+    }
+
+    size_t dispatch()
+    {
+        size_t count=0;
+        while(m_dispatched < m_completions.size()) {
+
+            auto completion=m_completions[m_dispatched++];
+            if(completion.op) {
+
+                completion.op->on_complete(completion.result, completion.flags);
+                ++count;
+            }
+        }
+        m_completions.clear();
+        m_dispatched=0;
+        return count;
+    }
+
+    // Blocks until op has nothing in flight and delivers its remaining completions right away
+    void wait_for(IoOperation* op)
+    {
+        while(op->in_flight()) {
+
+            submit_and_wait(-1);
+            reap();
+        }
+
+        for(auto i=m_dispatched; i<m_completions.size(); ++i) {
+
+            if(auto completion=m_completions[i]; completion.op == op) {
+
+                m_completions[i].op=nullptr;
+                op->on_complete(completion.result, completion.flags);
+            }
+        }
+    }
+
+    std::string_view buffer(uint16_t id, size_t size) const
+    {
+        return std::string_view(m_buffers.get()+size_t(id)*BUFFER_SIZE, size);
+    }
+
+    // Hands a provided buffer back to the kernel
+    void recycle(uint16_t id)
+    {
+        auto ring=buffer_ring();
+        auto& entry=ring[m_buffer_tail & (BUFFER_COUNT-1)];
+        entry.addr=reinterpret_cast<uint64_t>(m_buffers.get()+size_t(id)*BUFFER_SIZE);
+        entry.len=BUFFER_SIZE;
+        entry.bid=id;
+        ++m_buffer_tail;
+        __atomic_store_n(&reinterpret_cast<io_uring_buf_ring*>(ring)->tail, m_buffer_tail, __ATOMIC_RELEASE);
+    }
+
+    static bool has_buffer(uint32_t flags)
+    {
+        return flags & IORING_CQE_F_BUFFER;
+    }
+
+    static uint16_t buffer_id(uint32_t flags)
+    {
+        return flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+};
\ No newline at end of file
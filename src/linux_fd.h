@@ -0,0 +1,50 @@
+#pragma once
+
+#include <unistd.h>
+
+class LinuxFd
+{
+private:
+    int m_obj;
+
+public:
+    explicit LinuxFd(int fd):
+        m_obj(fd)
+    {}
+
+    LinuxFd(LinuxFd&& fd):
+        m_obj(fd.m_obj)
+    {
+        fd.m_obj = -1;
+    }
+
+    LinuxFd& operator=(LinuxFd&& fd)
+    {
+        if (this != &fd) {
+
+            if (m_obj != -1) {
+
+                close(m_obj);
+            }
+            m_obj = fd.m_obj;
+            fd.m_obj = -1;
+        }
+        return *this;
+    }
+
+    LinuxFd(const LinuxFd& fd) = delete;
+    LinuxFd& operator=(const LinuxFd& fd) = delete;
+
+    ~LinuxFd()
+    {
+        if (m_obj != -1) {
+
+            close(m_obj);
+        }
+    }
+
+    int get()
+    {
+        return m_obj;
+    }
+};
\ No newline at end of file
@@ -3,58 +3,313 @@
 #include "stream.h"
 #include "url_parser.h"
 #include "http_client.h"
+#include "batch_loader.h"
+#include "segmented_loader.h"
+#include "resume.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <iostream>
+#include <fstream>
 #include <string_view>
 #include <cstring>
+#include <csignal>
 
-int main(int argc, const char* args[])
+namespace
 {
-    if(argc != 2) {
 
-        std::cerr << "Bad input. Correct: file_loader <url>" << std::endl;
-        return 1;
+void usage()
+{
+    std::cerr << "Bad input. Correct: file_loader [-s <connections> | -r <resumable file> | -e <decode|raw|identity>] [-w <write buffer KB>] [-m <metrics json>] [-M <metrics prom>] [-T <trace json>] <url>" << std::endl;
+    std::cerr << "       file_loader -i <url list|-> [-o <out dir>] [-c <concurrency>] [-k <idle connections per host>] [-p <pipeline depth>] [-e <decode|raw|identity>] [-w <write buffer KB>] [-m <metrics json>] [-M <metrics prom>] [-T <trace json>]" << std::endl;
+}
+
+// Metrics are dumped there at exit and on SIGUSR1, the trace at exit; nothing is
+// kept for files left unset
+struct ReportFiles
+{
+    const char* json=nullptr;
+    const char* prometheus=nullptr;
+    const char* trace=nullptr;
+};
+
+// Metrics and tracer of one loop, handed to the loaders when enabled
+class Instruments
+{
+private:
+    const ReportFiles& m_files;
+    Metrics m_metrics;
+    std::unique_ptr<Tracer> m_tracer;
+    std::unique_ptr<SignalWatcher> m_watcher;
+
+private:
+    void dump_metrics() const
+    {
+        for(auto [path, format] : {std::make_pair(m_files.json, Metrics::JSON), std::make_pair(m_files.prometheus, Metrics::PROMETHEUS)}) {
+
+            if(path == nullptr) {
+
+                continue;
+            }
+
+            if(auto error=m_metrics.dump(path, format)) {
+
+                std::cerr << "Can't write metrics " << path << ": " << error.message() << std::endl;
+            }
+        }
     }
 
-    auto [error_url, url] = HttpUrlParser::parse(std::string_view(args[1], std::strlen(args[1])));
+public:
+    // Make right after the loop, before any thread starts: they inherit the blocked signal
+    Instruments(Loop& loop, const ReportFiles& files):
+        m_files(files)
+    {
+        if(files.json != nullptr || files.prometheus != nullptr) {
+
+            loop.set_metrics(&m_metrics);
+            m_watcher=std::make_unique<SignalWatcher>(loop, SIGUSR1, [this]() {
+
+                dump_metrics();
+            });
+        }
+
+        if(files.trace != nullptr) {
+
+            m_tracer=std::make_unique<Tracer>();
+            loop.set_tracer(m_tracer.get());
+        }
+    }
+
+    Metrics* metrics()
+    {
+        return m_watcher ? &m_metrics : nullptr;
+    }
+
+    void dump() const
+    {
+        dump_metrics();
+        if(m_tracer) {
+
+            if(auto error=m_tracer->write(m_files.trace)) {
+
+                std::cerr << "Can't write trace " << m_files.trace << ": " << error.message() << std::endl;
+            }
+        }
+    }
+};
+
+// Complains and fails when the url is not a plain http one
+std::tuple<bool, HttpUrl> parse_url(const char* text)
+{
+    auto [error_url, url] = HttpUrlParser::parse(std::string_view(text, std::strlen(text)));
     if(error_url) {
 
         std::cerr << "Bad url" << std::endl;
-        return 1;
+        return {true, HttpUrl()};
     }
 
     if(url.scheme != "http") {
 
         std::cerr << "Bad url: use http protocol only" << std::endl;
+        return {true, HttpUrl()};
+    }
+    return {false, std::move(url)};
+}
+
+// Keeps what was loaded before, the exit code tells whether to run again
+int load_resumable(const char* text, const char* file_name, const ReportFiles& report_files)
+{
+    auto [error_url, url] = parse_url(text);
+    if(error_url) {
+
         return 1;
     }
 
     Loop loop;
-    HttpClient client(loop, std::move(url));
+    Instruments instruments(loop, report_files);
+    ResumableLoader loader(loop, std::move(url), file_name);
+    loader.set_metrics(instruments.metrics());
+    auto result=Error(Error::ok);
+    loader.load([&result](const Error& error) {
+
+        result=error;
+    });
+    loop.run();
+    instruments.dump();
+
+    std::cerr << "Resumed: " << loader.resumed() << " bytes, attempts: " << loader.attempts() << std::endl;
+    if(result) {
+
+        std::cerr << "Error load data: " << result.message() << std::endl;
+        return 1;
+    }
+
+    std::cout << "Saved: " << file_name << std::endl;
+    return 0;
+}
+
+int load_one(const char* text, size_t connections, ContentCoding coding, uint64_t write_buffer, const ReportFiles& report_files)
+{
+    auto [error_url, url] = parse_url(text);
+    if(error_url) {
+
+        return 1;
+    }
 
+    auto result=Error(Error::ok);
+    auto on_loaded=[&result](const Error& error) {
+
+        result=error;
+    };
+
+    Loop loop;
+    Instruments instruments(loop, report_files);
     auto out=OutFileStream(loop, "result.txt");
-    client.load_stream([&out](std::string_view part_body, const Error& error) {
+    out.set_watermarks(write_buffer, write_buffer/4);
+    if(connections > 1) {
+
+        SegmentedLoader loader(loop, std::move(url), out, connections);
+        loader.set_metrics(instruments.metrics());
+        loader.load(on_loaded);
+        loop.run();
+        std::cerr << "Segments: " << loader.segments() << std::endl;
+    } else {
+
+        HttpClient client(loop, std::move(url));
+        client.set_content_coding(coding);
+        client.set_metrics(instruments.metrics());
+        client.load_file(out, on_loaded);
+        loop.run();
+    }
+    instruments.dump();
+
+    if(result) {
 
-        if(error) {
+        std::cerr << "Error load data: " << result.message() << std::endl;
+        return 1;
+    }
+
+    std::cout << "Saved: result.txt" << std::endl;
+    return 0;
+}
+
+int load_batch(const char* list, const char* out_dir, size_t concurrency, size_t keep_alive, size_t pipeline_depth, ContentCoding coding, uint64_t write_buffer, const ReportFiles& report_files)
+{
+    std::ifstream file;
+    if(std::strcmp(list, "-") != 0) {
 
-            std::cerr << "Error load data" << std::endl;
-            return;
+        file.open(list);
+        if(!file) {
+
+            std::cerr << "Can't open url list: " << list << std::endl;
+            return 1;
         }
+    }
 
-        auto data=std::make_shared<std::string>(part_body.begin(), part_body.end());
-        out.write(*data, [data](size_t transferd_bytes, const Error& error){
+    Loop loop;
+    Instruments instruments(loop, report_files);
+    BatchLoader loader(loop, file.is_open() ? file : std::cin, std::cout, out_dir, concurrency, keep_alive, pipeline_depth);
+    loader.set_content_coding(coding);
+    loader.set_write_buffer(write_buffer);
+    loader.set_metrics(instruments.metrics());
+    loader.run();
+    instruments.dump();
 
-            if(error) {
+    std::cerr << "Loaded: " << loader.total()-loader.failed() << "/" << loader.total() << std::endl;
+    std::cerr << loader.pool_stats() << std::endl;
+    std::cerr << loader.resolver_stats() << std::endl;
 
-                std::cerr << "Error write data" << std::endl;
-                return;
-            }
-        });
-    });
+    return loader.failed() == 0 ? 0 : 2;
+}
 
-    loop.run();
+}
 
-    std::cout << "Saved: result.txt" << std::endl;
+int main(int argc, const char* args[])
+{
+    // A single url comes last, after its options
+    const char* url=nullptr;
+    auto options_end=argc;
+    if(argc % 2 == 0 && args[argc-1][0] != '-') {
 
-    return 0;
+        url=args[argc-1];
+        --options_end;
+    }
+
+    const char* list=nullptr;
+    const char* out_dir=".";
+    size_t concurrency=64;
+    size_t keep_alive=8;
+    size_t pipeline_depth=0;
+    size_t connections=1;
+    const char* resume_file=nullptr;
+    auto coding=ContentCoding::DECODE;
+    uint64_t write_buffer=OutFileStream::HIGH_WATER;
+    ReportFiles report_files;
+    for(int i=1; i+1<options_end; i+=2) {
+
+        auto option=std::string_view(args[i]);
+        if(option == "-i"sv) {
+
+            list=args[i+1];
+        } else if(option == "-o"sv) {
+
+            out_dir=args[i+1];
+        } else if(option == "-c"sv) {
+
+            concurrency=std::strtoul(args[i+1], nullptr, 10);
+        } else if(option == "-k"sv) {
+
+            keep_alive=std::strtoul(args[i+1], nullptr, 10);
+        } else if(option == "-p"sv) {
+
+            pipeline_depth=std::strtoul(args[i+1], nullptr, 10);
+        } else if(option == "-s"sv) {
+
+            connections=std::strtoul(args[i+1], nullptr, 10);
+        } else if(option == "-r"sv) {
+
+            resume_file=args[i+1];
+        } else if(option == "-w"sv) {
+
+            write_buffer=std::strtoull(args[i+1], nullptr, 10)*1024;
+        } else if(option == "-m"sv) {
+
+            report_files.json=args[i+1];
+        } else if(option == "-M"sv) {
+
+            report_files.prometheus=args[i+1];
+        } else if(option == "-T"sv) {
+
+            report_files.trace=args[i+1];
+        } else if(option == "-e"sv && args[i+1] == "raw"sv) {
+
+            coding=ContentCoding::RAW;
+        } else if(option == "-e"sv && args[i+1] == "identity"sv) {
+
+            coding=ContentCoding::IDENTITY;
+        } else if(option == "-e"sv && args[i+1] == "decode"sv) {
+
+            coding=ContentCoding::DECODE;
+        } else {
+
+            usage();
+            return 1;
+        }
+    }
+
+    if(url != nullptr && resume_file != nullptr) {
+
+        return load_resumable(url, resume_file, report_files);
+    } else if(url != nullptr) {
+
+        return load_one(url, connections, coding, write_buffer, report_files);
+    }
+
+    if(list == nullptr || argc % 2 == 0) {
+
+        usage();
+        return 1;
+    }
+
+    return load_batch(list, out_dir, concurrency, keep_alive, pipeline_depth, coding, write_buffer, report_files);
 }
\ No newline at end of file
@@ -0,0 +1,435 @@
+#pragma once
+
+#include "error.h"
+#include "linux_fd.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+// When one load reached each phase; a phase not reached keeps the default time point
+struct HttpTimings
+{
+    using Clock=std::chrono::steady_clock;
+
+    Clock::time_point start;
+    Clock::time_point resolved;
+    Clock::time_point connected;
+    Clock::time_point first_byte;
+    Clock::time_point header;
+    Clock::time_point done;
+};
+
+// Log-linear histogram in the manner of HdrHistogram: values below 2^SUB_BITS are
+// kept exactly, each power of two above is split into 2^SUB_BITS buckets, so a
+// value is reported less than 1/2^SUB_BITS off. One thread records with plain
+// relaxed stores, no locked instructions; any thread may read meanwhile.
+class Histogram
+{
+public:
+    static constexpr unsigned SUB_BITS=5;
+    static constexpr unsigned MAX_BITS=48;
+    static constexpr size_t BUCKETS=size_t(MAX_BITS-SUB_BITS+1) << SUB_BITS;
+    static constexpr uint64_t MAX_VALUE=(uint64_t(1) << MAX_BITS)-1;
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> m_counts;
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_min;
+    std::atomic<uint64_t> m_max;
+
+private:
+    static size_t index_of(uint64_t value)
+    {
+        if(value < (uint64_t(1) << SUB_BITS)) {
+
+            return size_t(value);
+        }
+
+        auto group=unsigned(63-__builtin_clzll(value))-SUB_BITS+1;
+        return (size_t(group) << SUB_BITS)+size_t(value >> (group-1))-(size_t(1) << SUB_BITS);
+    }
+
+    // The largest value that lands in the bucket
+    static uint64_t highest_of(size_t index)
+    {
+        auto group=unsigned(index >> SUB_BITS);
+        auto sub=uint64_t(index & ((size_t(1) << SUB_BITS)-1));
+        if(group==0) {
+
+            return sub;
+        }
+        return (((uint64_t(1) << SUB_BITS)+sub+1) << (group-1))-1;
+    }
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed)+value, std::memory_order_relaxed);
+    }
+
+public:
+    Histogram():
+        m_counts(),
+        m_count(0),
+        m_sum(0),
+        m_min(UINT64_MAX),
+        m_max(0)
+    {}
+
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    // Larger values are kept as MAX_VALUE
+    void record(uint64_t value)
+    {
+        value=std::min(value, MAX_VALUE);
+        add(m_counts[index_of(value)], 1);
+        add(m_count, 1);
+        add(m_sum, value);
+        if(value < m_min.load(std::memory_order_relaxed)) {
+
+            m_min.store(value, std::memory_order_relaxed);
+        }
+        if(value > m_max.load(std::memory_order_relaxed)) {
+
+            m_max.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t count() const
+    {
+        return m_count.load(std::memory_order_relaxed);
+    }
+
+    uint64_t sum() const
+    {
+        return m_sum.load(std::memory_order_relaxed);
+    }
+
+    uint64_t min() const
+    {
+        return count()==0 ? 0 : m_min.load(std::memory_order_relaxed);
+    }
+
+    uint64_t max() const
+    {
+        return m_max.load(std::memory_order_relaxed);
+    }
+
+    // The value at or below which the fraction q of the recorded values lie
+    uint64_t quantile(double q) const
+    {
+        auto total=count();
+        if(total==0) {
+
+            return 0;
+        }
+
+        auto rank=std::max<uint64_t>(uint64_t(std::ceil(q*double(total))), 1);
+        uint64_t seen=0;
+        for(size_t i=0; i<BUCKETS; ++i) {
+
+            seen+=m_counts[i].load(std::memory_order_relaxed);
+            if(seen >= rank) {
+
+                return std::min(highest_of(i), max());
+            }
+        }
+        return max();
+    }
+};
+
+// Request phases, their durations in nanoseconds add up to the total
+struct PhaseHistograms
+{
+    static constexpr size_t PHASES=5;
+    static constexpr std::string_view NAMES[PHASES]={"resolve"sv, "connect"sv, "first_byte"sv, "transfer"sv, "total"sv};
+
+    std::array<Histogram, PHASES> phases;
+    Histogram bytes;
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> failed{0};
+};
+
+// Phase timings and sizes of finished requests, overall and for each of the first
+// MAX_HOSTS hosts seen; the loop adds how long its iterations run and wait.
+// Dumped as JSON or in the Prometheus text format.
+class Metrics
+{
+public:
+    static constexpr size_t MAX_HOSTS=256;
+    static constexpr double QUANTILES[]={0.5, 0.9, 0.99, 0.999};
+
+    enum Format
+    {
+        JSON,
+        PROMETHEUS
+    };
+
+private:
+    PhaseHistograms m_total;
+    std::unordered_map<std::string, std::unique_ptr<PhaseHistograms>> m_hosts;
+    uint64_t m_untracked;
+    Histogram m_loop_busy;
+    Histogram m_loop_wait;
+
+private:
+    static uint64_t nanoseconds(HttpTimings::Clock::time_point from, HttpTimings::Clock::time_point to)
+    {
+        if(from==HttpTimings::Clock::time_point() || to < from) {
+
+            return 0;
+        }
+        return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(to-from).count());
+    }
+
+    static void count(std::atomic<uint64_t>& counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+    }
+
+    // Host names come from the input, keep them from breaking out of a string or label
+    static void write_escaped(std::ostream& out, std::string_view text)
+    {
+        for(auto c : text) {
+
+            if(c=='"' || c=='\\') {
+
+                out << '\\' << c;
+            } else if(c=='\n') {
+
+                out << "\\n";
+            } else if(uint8_t(c) >= 0x20) {
+
+                out << c;
+            }
+        }
+    }
+
+    static void write_json(std::ostream& out, const Histogram& histogram)
+    {
+        out << "{\"count\": " << histogram.count()
+            << ", \"sum\": " << histogram.sum()
+            << ", \"min\": " << histogram.min()
+            << ", \"max\": " << histogram.max();
+        for(auto q : QUANTILES) {
+
+            out << ", \"p" << q*100 << "\": " << histogram.quantile(q);
+        }
+        out << "}";
+    }
+
+    static void write_json(std::ostream& out, const PhaseHistograms& histograms, const char* indent)
+    {
+        out << "{\n"
+            << indent << "  \"requests\": " << histograms.requests.load(std::memory_order_relaxed) << ",\n"
+            << indent << "  \"failed\": " << histograms.failed.load(std::memory_order_relaxed) << ",\n";
+        for(size_t i=0; i<PhaseHistograms::PHASES; ++i) {
+
+            out << indent << "  \"" << PhaseHistograms::NAMES[i] << "_ns\": ";
+            write_json(out, histograms.phases[i]);
+            out << ",\n";
+        }
+        out << indent << "  \"bytes\": ";
+        write_json(out, histograms.bytes);
+        out << "\n" << indent << "}";
+    }
+
+    // A summary: quantiles, sum and count; scale turns nanoseconds into seconds
+    static void write_summary(std::ostream& out, std::string_view name, std::string_view labels, const Histogram& histogram, double scale)
+    {
+        auto separator=labels.empty() ? ""sv : ","sv;
+        for(auto q : QUANTILES) {
+
+            out << name << "{" << labels << separator << "quantile=\"" << q << "\"} " << double(histogram.quantile(q))*scale << "\n";
+        }
+        auto braces=labels.empty() ? std::string() : "{"+std::string(labels)+"}";
+        out << name << "_sum" << braces << " " << double(histogram.sum())*scale << "\n";
+        out << name << "_count" << braces << " " << histogram.count() << "\n";
+    }
+
+    using Labeled=std::vector<std::pair<std::string, const PhaseHistograms*>>;
+
+    // The text format wants each family in one piece, so families go outside and label sets inside
+    static void write_prometheus(std::ostream& out, const std::string& prefix, const Labeled& entries)
+    {
+        out << "# TYPE " << prefix << "phase_seconds summary\n";
+        for(auto& [labels, histograms] : entries) {
+
+            for(size_t i=0; i<PhaseHistograms::PHASES; ++i) {
+
+                auto phase_labels=labels+(labels.empty() ? "" : ",")+"phase=\""+std::string(PhaseHistograms::NAMES[i])+"\"";
+                write_summary(out, prefix+"phase_seconds", phase_labels, histograms->phases[i], 1e-9);
+            }
+        }
+
+        out << "# TYPE " << prefix << "response_bytes summary\n";
+        for(auto& [labels, histograms] : entries) {
+
+            write_summary(out, prefix+"response_bytes", labels, histograms->bytes, 1);
+        }
+
+        for(auto [name, failed] : {std::make_pair("requests_total", false), std::make_pair("requests_failed_total", true)}) {
+
+            out << "# TYPE " << prefix << name << " counter\n";
+            for(auto& [labels, histograms] : entries) {
+
+                auto braces=labels.empty() ? std::string() : "{"+labels+"}";
+                out << prefix << name << braces << " " << (failed ? histograms->failed : histograms->requests).load(std::memory_order_relaxed) << "\n";
+            }
+        }
+    }
+
+    PhaseHistograms* host(std::string_view name)
+    {
+        if(auto it=m_hosts.find(std::string(name)); it!=m_hosts.end()) {
+
+            return it->second.get();
+        }
+
+        if(m_hosts.size() >= MAX_HOSTS) {
+
+            ++m_untracked;
+            return nullptr;
+        }
+        return m_hosts.emplace(name, std::make_unique<PhaseHistograms>()).first->second.get();
+    }
+
+    static void record(PhaseHistograms& histograms, const HttpTimings& timings, uint64_t bytes, bool failed)
+    {
+        count(histograms.requests);
+        if(failed) {
+
+            count(histograms.failed);
+            return;
+        }
+
+        histograms.phases[0].record(nanoseconds(timings.start, timings.resolved));
+        histograms.phases[1].record(nanoseconds(timings.resolved, timings.connected));
+        histograms.phases[2].record(nanoseconds(timings.connected, timings.first_byte));
+        histograms.phases[3].record(nanoseconds(timings.first_byte, timings.done));
+        histograms.phases[4].record(nanoseconds(timings.start, timings.done));
+        histograms.bytes.record(bytes);
+    }
+
+public:
+    Metrics():
+        m_untracked(0)
+    {}
+
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    // Phases are recorded for requests that succeeded, failures are only counted
+    void record(std::string_view host_name, const HttpTimings& timings, uint64_t bytes, const Error& error)
+    {
+        record(m_total, timings, bytes, bool(error));
+        if(auto histograms=host(host_name)) {
+
+            record(*histograms, timings, bytes, bool(error));
+        }
+    }
+
+    // One loop iteration: running tasks and handlers, then waiting for the kernel
+    void record_loop(uint64_t busy_ns, uint64_t wait_ns)
+    {
+        m_loop_busy.record(busy_ns);
+        m_loop_wait.record(wait_ns);
+    }
+
+    const PhaseHistograms& total() const
+    {
+        return m_total;
+    }
+
+    void write_json(std::ostream& out) const
+    {
+        out << "{\n  \"total\": ";
+        write_json(out, m_total, "  ");
+        out << ",\n  \"loop\": {\n    \"busy_ns\": ";
+        write_json(out, m_loop_busy);
+        out << ",\n    \"wait_ns\": ";
+        write_json(out, m_loop_wait);
+        out << "\n  },\n  \"untracked_hosts\": " << m_untracked << ",\n  \"hosts\": {";
+
+        auto first=true;
+        for(auto& [name, histograms] : m_hosts) {
+
+            out << (first ? "\n    \"" : ",\n    \"");
+            write_escaped(out, name);
+            out << "\": ";
+            write_json(out, *histograms, "    ");
+            first=false;
+        }
+        out << (first ? "}\n}\n" : "\n  }\n}\n");
+    }
+
+    void write_prometheus(std::ostream& out) const
+    {
+        write_prometheus(out, "page_loader_", {{std::string(), &m_total}});
+
+        out << "# TYPE page_loader_loop_busy_seconds summary\n";
+        write_summary(out, "page_loader_loop_busy_seconds", {}, m_loop_busy, 1e-9);
+        out << "# TYPE page_loader_loop_wait_seconds summary\n";
+        write_summary(out, "page_loader_loop_wait_seconds", {}, m_loop_wait, 1e-9);
+        out << "# TYPE page_loader_untracked_hosts gauge\n"
+            << "page_loader_untracked_hosts " << m_untracked << "\n";
+
+        Labeled hosts;
+        for(auto& [name, histograms] : m_hosts) {
+
+            std::ostringstream label;
+            label << "host=\"";
+            write_escaped(label, name);
+            label << "\"";
+            hosts.emplace_back(label.str(), histograms.get());
+        }
+        write_prometheus(out, "page_loader_host_", hosts);
+    }
+
+    // Written aside and renamed over the old dump, so readers never see half of one
+    Error dump(const std::string& path, Format format) const
+    {
+        std::ostringstream text;
+        if(format==PROMETHEUS) {
+
+            write_prometheus(text);
+        } else {
+
+            write_json(text);
+        }
+
+        auto temp=path+".tmp";
+        auto data=text.str();
+        LinuxFd fd(open(temp.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+        if(fd.get()==-1 || write(fd.get(), data.data(), data.size())!=ssize_t(data.size())) {
+
+            return Error(Error::err_write_file, strerror(errno));
+        }
+
+        if(rename(temp.c_str(), path.c_str())==-1) {
+
+            return Error(Error::err_write_file, strerror(errno));
+        }
+        return Error(Error::ok);
+    }
+};
\ No newline at end of file
@@ -0,0 +1,516 @@
+#pragma once
+
+#include "http_client.h"
+#include "connection_pool.h"
+
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+
+// Pipelines GET requests to one host: up to `depth` requests are written
+// ahead on a keep-alive connection and responses are matched in order.
+// Requests left unanswered when the server closes are replayed on a new connection.
+class PipelineClient
+{
+private:
+    static constexpr size_t MAX_FAILED_CONNECTIONS=3;
+
+    struct Request
+    {
+        std::string target;
+        std::function<void(std::string_view)> body_cb;
+        std::function<void(const ResponseHeader&, const Error&)> complete_cb;
+        HttpTimings timings;
+    };
+
+    // Handlers may queue new requests; while set they are only queued and picked up on the way out
+    struct Busy
+    {
+        size_t& depth;
+
+        explicit Busy(size_t& value) :
+            depth(value)
+        {
+            ++depth;
+        }
+
+        ~Busy()
+        {
+            --depth;
+        }
+    };
+
+    enum State
+    {
+        IDLE,
+        RESOLVING,
+        CONNECTING,
+        CONNECTED
+    };
+
+    Loop& m_loop;
+    ConnectionPool* m_pool;
+    ResolverCache* m_resolver;
+    std::string m_host;
+    uint16_t m_port;
+    ContentCoding m_coding;
+    size_t m_depth;
+    HttpTimeouts m_timeouts;
+    Metrics* m_metrics;
+    HttpTimings::Clock::time_point m_resolved;
+    std::deque<Request> m_queue;
+    std::deque<Request> m_in_flight;
+    std::vector<TcpEndpoint> m_endpoints;
+    std::optional<TcpEndpoint> m_endpoint;
+    Connector m_connector;
+    std::unique_ptr<TcpStream> m_stream;
+    PooledBuffer m_buffer;
+    AdaptiveReadSize m_read_size;
+    std::string m_output;
+    std::string m_pending_output;
+    bool m_writing;
+    bool m_keep_alive;
+    bool m_paused;
+    bool m_read_waiting;
+    ResponseReader m_reader;
+    Timer m_timer;
+    ResolveHandle m_resolving;
+    State m_state;
+    size_t m_answered;
+    size_t m_failed_connections;
+    size_t m_busy;
+
+private:
+    void start_timer(std::chrono::milliseconds timeout, Error::Code code)
+    {
+        if(timeout.count() > 0) {
+
+            m_loop.start_timer(m_timer, timeout, [this, code]() {
+
+                if(m_state==CONNECTED) {
+
+                    connection_lost(Error(code), false);
+                } else {
+
+                    fail_all(Error(code));
+                }
+            });
+        } else {
+
+            m_timer.cancel();
+        }
+    }
+
+    void retire_stream()
+    {
+        m_connector.cancel();
+        if(m_stream) {
+
+            m_stream->cancel();
+            m_loop.post([stream=std::move(m_stream)]() {});
+        }
+        m_buffer.reset();
+        m_writing=false;
+        m_read_waiting=false;
+        m_output.clear();
+        m_pending_output.clear();
+    }
+
+    // A request shares the connection, so connect runs until it is written and takes
+    // the wait for a pipeline slot; first_byte runs from there to its response
+    void record(Request& request, const Error& error)
+    {
+        request.timings.done=HttpTimings::Clock::now();
+        if(m_metrics) {
+
+            m_metrics->record(m_host, request.timings, m_reader.body_size(), error);
+        }
+    }
+
+    void complete_front(const Error& error)
+    {
+        auto request=std::move(m_in_flight.front());
+        m_in_flight.pop_front();
+        record(request, error);
+        request.complete_cb(m_reader.header(), error);
+    }
+
+    void fail_all(const Error& error)
+    {
+        Busy busy(m_busy);
+        m_timer.cancel();
+        m_resolving.cancel();
+        retire_stream();
+        if(m_pool && m_state==CONNECTED) {
+
+            m_pool->discard();
+        }
+        m_state=IDLE;
+
+        auto requests=std::move(m_in_flight);
+        m_in_flight.clear();
+        for(auto& request : m_queue) {
+
+            requests.push_back(std::move(request));
+        }
+        m_queue.clear();
+
+        m_reader.reset();
+        for(auto& request : requests) {
+
+            record(request, error);
+            request.complete_cb(m_reader.header(), error);
+        }
+
+        if(!m_queue.empty()) {
+
+            start();
+        }
+    }
+
+    // The connection is gone: finish what can't be replayed and move the rest back to the queue.
+    // Without replay (the server stalled) the requests in flight fail instead.
+    void connection_lost(const Error& error, bool replay=true)
+    {
+        Busy busy(m_busy);
+        m_timer.cancel();
+        retire_stream();
+        if(m_pool) {
+
+            m_pool->discard();
+        }
+        m_state=IDLE;
+
+        if(!m_in_flight.empty() && m_reader.body_size() > 0) {
+
+            complete_front(error ? error : Error(Error::err_eof));
+        }
+        while(!replay && !m_in_flight.empty()) {
+
+            complete_front(error);
+        }
+        m_reader.reset();
+
+        m_failed_connections=m_answered>0 ? 0 : m_failed_connections+1;
+        while(!m_in_flight.empty()) {
+
+            m_queue.push_front(std::move(m_in_flight.back()));
+            m_in_flight.pop_back();
+        }
+
+        if(m_failed_connections >= MAX_FAILED_CONNECTIONS) {
+
+            fail_all(error ? error : Error(Error::err_eof));
+        } else if(!m_queue.empty()) {
+
+            open_connection();
+        }
+    }
+
+    void release_connection()
+    {
+        m_timer.cancel();
+        m_buffer.reset();
+        m_state=IDLE;
+        if(m_pool && m_keep_alive && !m_reader.is_started() && !m_writing) {
+
+            m_pool->release(*m_endpoint, std::move(m_stream));
+        } else {
+
+            retire_stream();
+            if(m_pool) {
+
+                m_pool->discard();
+            }
+        }
+    }
+
+    void open_connection()
+    {
+        retire_stream();
+        m_reader.reset();
+        m_answered=0;
+        m_keep_alive=true;
+        m_state=CONNECTING;
+
+        for(auto& endpoint : m_endpoints) {
+
+            if(m_pool && (m_stream=m_pool->find(endpoint))) {
+
+                m_endpoint.emplace(endpoint);
+                on_connected();
+                return;
+            }
+        }
+
+        start_timer(m_timeouts.connect, Error::err_timeout_connect);
+        m_connector.start(m_endpoints, [this](const Error& error, std::unique_ptr<TcpStream> stream, const TcpEndpoint& endpoint) {
+
+            if(error) {
+
+                fail_all(error);
+                return;
+            }
+
+            // Later connections try the address that answered first
+            std::stable_partition(m_endpoints.begin(), m_endpoints.end(), [&endpoint](const TcpEndpoint& candidate) {
+
+                return candidate == endpoint;
+            });
+            m_stream=std::move(stream);
+            m_endpoint.emplace(endpoint);
+            on_connected();
+        });
+    }
+
+    void on_connected()
+    {
+        m_state=CONNECTED;
+        send_requests();
+        read_responses();
+    }
+
+    void send_requests()
+    {
+        while(m_in_flight.size() < m_depth && !m_queue.empty() && m_keep_alive) {
+
+            auto& timings=m_queue.front().timings;
+            timings.resolved=std::max(timings.start, m_resolved);
+            timings.connected=HttpTimings::Clock::now();
+            timings.first_byte=HttpTimings::Clock::time_point();
+            append_get_request(m_pending_output, m_host, m_queue.front().target, true, m_coding!=ContentCoding::IDENTITY);
+            m_in_flight.push_back(std::move(m_queue.front()));
+            m_queue.pop_front();
+        }
+        flush_output();
+    }
+
+    void flush_output()
+    {
+        if(m_writing || m_pending_output.empty()) {
+
+            return;
+        }
+
+        m_output.swap(m_pending_output);
+        m_pending_output.clear();
+        m_writing=true;
+        m_stream->write(m_output, [this](const Error& error) {
+
+            m_writing=false;
+            if(error) {
+
+                connection_lost(error);
+                return;
+            }
+
+            m_output.clear();
+            flush_output();
+        });
+    }
+
+    void read_responses()
+    {
+        // Paused readers are not idle, the deadline starts again on resume
+        if(m_paused) {
+
+            m_read_waiting=true;
+            m_timer.cancel();
+            m_buffer.reset();
+            return;
+        }
+
+        start_timer(m_answered==0 ? m_timeouts.first_byte : m_timeouts.idle, m_answered==0 ? Error::err_timeout_first_byte : Error::err_timeout_idle);
+        // A block is held only while responses are outstanding
+        if(m_buffer.size() != m_read_size.size()) {
+
+            m_buffer.reset();
+            m_buffer=m_loop.buffers().acquire(m_read_size.size());
+        }
+
+        m_stream->read_some(m_buffer.data(), m_buffer.size(), [this](size_t bytes_readed, const Error& error) {
+
+            Busy busy(m_busy);
+            if(error) {
+
+                if(error.code()==Error::err_eof && m_reader.finish_on_eof()) {
+
+                    ++m_answered;
+                    complete_front(Error(Error::ok));
+                    m_reader.reset();
+                    connection_lost(Error(Error::ok));
+                } else {
+
+                    connection_lost(error);
+                }
+                return;
+            }
+
+            m_read_size.update(bytes_readed);
+            on_response_data(std::string_view(m_buffer.data(), bytes_readed));
+        });
+    }
+
+    void on_response_data(std::string_view data)
+    {
+        for(auto pos=size_t(0); pos < data.size(); ) {
+
+            if(m_in_flight.empty()) {
+
+                connection_lost(Error(Error::err_parse_header));
+                return;
+            }
+
+            if(auto& timings=m_in_flight.front().timings; timings.first_byte==HttpTimings::Clock::time_point()) {
+
+                timings.first_byte=HttpTimings::Clock::now();
+            }
+
+            auto [error, consumed]=m_reader.feed(data.substr(pos), m_in_flight.front().body_cb);
+            if(error) {
+
+                complete_front(error);
+                connection_lost(error);
+                return;
+            }
+            pos+=consumed;
+
+            if(m_reader.is_done()) {
+
+                ++m_answered;
+                m_keep_alive=m_reader.is_reusable() && m_reader.header().keep_alive();
+                complete_front(Error(Error::ok));
+                m_reader.reset();
+
+                if(!m_keep_alive) {
+
+                    connection_lost(Error(Error::ok));
+                    return;
+                }
+            }
+        }
+
+        send_requests();
+        if(!m_in_flight.empty()) {
+
+            read_responses();
+        } else if(m_queue.empty()) {
+
+            release_connection();
+        }
+    }
+
+    void start()
+    {
+        if(!m_endpoints.empty()) {
+
+            open_connection();
+            return;
+        }
+
+        m_state=RESOLVING;
+        start_timer(m_timeouts.resolve, Error::err_timeout_resolve);
+        auto on_resolved=[this](const std::vector<Endpoint>& result, const Error& error) {
+
+            if(error) {
+
+                fail_all(error);
+                return;
+            }
+
+            m_resolved=HttpTimings::Clock::now();
+            m_endpoints.clear();
+            for(auto& endpoint : result) {
+
+                m_endpoints.emplace_back(endpoint, m_port);
+            }
+            open_connection();
+        };
+        m_resolving=m_resolver ? m_resolver->resolve(m_host, on_resolved) : resolve(m_loop, m_host, on_resolved);
+    }
+
+public:
+    PipelineClient(Loop& loop, std::string host, uint16_t port, size_t depth, const HttpTimeouts& timeouts=HttpTimeouts(), ConnectionPool* pool=nullptr, ResolverCache* resolver=nullptr):
+        m_loop(loop),
+        m_pool(pool),
+        m_resolver(resolver),
+        m_host(std::move(host)),
+        m_port(port),
+        m_coding(ContentCoding::DECODE),
+        m_depth(std::max<size_t>(depth, 1)),
+        m_timeouts(timeouts),
+        m_metrics(nullptr),
+        m_connector(loop, pool),
+        m_writing(false),
+        m_keep_alive(true),
+        m_paused(false),
+        m_read_waiting(false),
+        m_state(IDLE),
+        m_answered(0),
+        m_failed_connections(0),
+        m_busy(0)
+    {
+        m_reader.set_decoding(true);
+    }
+
+    PipelineClient(const PipelineClient&) = delete;
+    PipelineClient& operator=(const PipelineClient&) = delete;
+
+    // Applies to requests sent from now on; like HttpClient, decodes unless told otherwise
+    void set_content_coding(ContentCoding coding)
+    {
+        m_coding=coding;
+        m_reader.set_decoding(coding==ContentCoding::DECODE);
+    }
+
+    // Each request is recorded there as it completes, under the host of the pipeline; call before get()
+    void set_metrics(Metrics* metrics)
+    {
+        m_metrics=metrics;
+    }
+
+    // body_handler gets the response body in pieces, complete_handler is called once per request
+    template<typename T, typename C>
+    void get(std::string target, T&& body_handler, C&& complete_handler)
+    {
+        m_queue.push_back(Request{std::move(target), std::forward<T>(body_handler), std::forward<C>(complete_handler), HttpTimings()});
+        m_queue.back().timings.start=HttpTimings::Clock::now();
+        if(m_busy > 0) {
+
+            return;
+        } else if(m_state==IDLE) {
+
+            start();
+        } else if(m_state==CONNECTED) {
+
+            auto was_waiting=!m_in_flight.empty();
+            send_requests();
+            if(!was_waiting && !m_in_flight.empty()) {
+
+                read_responses();
+            }
+        }
+    }
+
+    // Flow control: after pause(), e.g. from a body handler, responses are not read until resume()
+    void pause()
+    {
+        m_paused=true;
+    }
+
+    void resume()
+    {
+        m_paused=false;
+        if(m_read_waiting && m_state==CONNECTED) {
+
+            m_read_waiting=false;
+            read_responses();
+        }
+    }
+
+    bool is_idle() const
+    {
+        return m_state==IDLE && m_queue.empty() && m_in_flight.empty();
+    }
+};
\ No newline at end of file
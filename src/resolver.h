@@ -5,17 +5,19 @@
 #include "executor.h"
 
 #include <string_view>
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <iostream>
 #include <netdb.h>
+#include <signal.h>
 #include <optional>
+#include <vector>
+#include <functional>
+#include <tuple>
 
 using namespace std::string_literals;
 
-namespace
-{
-
 class RequestResolve
 {
 friend int async_resolve_request(RequestResolve& );
@@ -26,82 +28,167 @@ private:
     std::unique_ptr<gaicb[]> m_request;
     gaicb* m_ptr;
     std::string_view m_hostname;
+    addrinfo m_hints;
+    sigevent m_sigevent;
+    std::unique_ptr<Notifier> m_notifier;
+
+    static void notify(sigval value)
+    {
+        static_cast<Notifier*>(value.sival_ptr)->notify();
+    }
 
 public:
-    RequestResolve(std::string_view hostname) :
+    template<typename T>
+    RequestResolve(Loop& loop, std::string_view hostname, T&& handler) :
         m_request(std::make_unique<gaicb[]>(1)),
         m_ptr(m_request.get()),
-        m_hostname(hostname)
+        m_hostname(hostname),
+        m_hints(),
+        m_sigevent(),
+        m_notifier(std::make_unique<Notifier>(loop, std::forward<T>(handler)))
     {
         m_request[0].ar_name = hostname.data();
+        m_hints.ai_family = AF_UNSPEC;
+        m_hints.ai_socktype = SOCK_STREAM;
+        m_request[0].ar_request = &m_hints;
+        m_sigevent.sigev_notify = SIGEV_THREAD;
+        m_sigevent.sigev_notify_function = &RequestResolve::notify;
+        m_sigevent.sigev_value.sival_ptr = m_notifier.get();
+    }
+
+    ~RequestResolve()
+    {
+        if(m_request[0].ar_result) {
+
+            freeaddrinfo(m_request[0].ar_result);
+        }
     }
 };
 
-int async_resolve_request(RequestResolve& request)
+inline int async_resolve_request(RequestResolve& request)
 {
-    return getaddrinfo_a(GAI_NOWAIT, &request.m_ptr, 1, nullptr);
+    return getaddrinfo_a(GAI_NOWAIT, &request.m_ptr, 1, &request.m_sigevent);
 }
 
-int chack_resolve(RequestResolve& request)
+inline int chack_resolve(RequestResolve& request)
 {
     return gai_error(request.m_request.get());
 }
 
-std::tuple<bool, std::vector<Endpoint>> get_result(RequestResolve& request)
+// Addresses in the resolver's preference order with the families interleaved, as RFC 8305 asks
+inline std::tuple<bool, std::vector<Endpoint>> get_result(RequestResolve& request)
 {
-    std::vector<Endpoint> result;
-    std::vector<char> m_addr_buff(NI_MAXHOST);
+    std::vector<Endpoint> primary;
+    std::vector<Endpoint> secondary;
 
     for(auto it=request.m_request[0].ar_result; it != nullptr; it=it->ai_next) {
 
-        auto ret=getnameinfo(it->ai_addr, it->ai_addrlen, m_addr_buff.data(), m_addr_buff.size(), nullptr, 0, NI_NUMERICHOST);
-        if(ret == 0) {
+        if(it->ai_family != AF_INET && it->ai_family != AF_INET6) {
 
-            result.emplace_back(std::string_view(m_addr_buff.data(), m_addr_buff.size()));
-        } else {
+            continue;
+        }
+
+        auto& family=primary.empty() || primary.front().family() == it->ai_family ? primary : secondary;
+        family.emplace_back(it->ai_addr, it->ai_addrlen);
+    }
+
+    std::vector<Endpoint> result;
+    result.reserve(primary.size()+secondary.size());
+    for(size_t i=0; i < std::max(primary.size(), secondary.size()); ++i) {
+
+        if(i < primary.size()) {
 
-            return {true, {}};
+            result.push_back(primary[i]);
+        }
+        if(i < secondary.size()) {
+
+            result.push_back(secondary[i]);
         }
     }
 
-    return {false, std::move(result)};
+    return {result.empty(), std::move(result)};
 }
 
-}
+using ResolveHandler=std::function<void(const std::vector<Endpoint>&, const Error&)>;
+
+struct ResolveState
+{
+    std::unique_ptr<RequestResolve> request;
+    std::shared_ptr<ResolveHandler> handler;
+};
+
+
+class ResolveHandle
+{
+private:
+    std::weak_ptr<ResolveHandler> m_handler;
+
+public:
+    ResolveHandle()
+    {}
+
+    explicit ResolveHandle(std::weak_ptr<ResolveHandler> handler) :
+        m_handler(std::move(handler))
+    {}
+
+    // The lookup itself runs to completion, only the handler is dropped
+    void cancel()
+    {
+        if(auto handler=m_handler.lock()) {
+
+            *handler=nullptr;
+        }
+        m_handler.reset();
+    }
+};
 
 template<typename T>
-void resolve(Loop& loop, std::string_view hostname, T&& handler)
+ResolveHandle resolve(Loop& loop, std::string_view hostname, T&& handler)
 {
-    auto request=std::make_shared<RequestResolve>(hostname);
-    auto ret=async_resolve_request(*request);
+    auto state=std::make_shared<ResolveState>();
+    state->handler=std::make_shared<ResolveHandler>(std::forward<T>(handler));
+    state->request=std::make_unique<RequestResolve>(loop, hostname, [&loop, state](uint64_t) {
 
-    if (!ret) {
+        auto ret=chack_resolve(*state->request);
+        if(ret==EAI_INPROGRESS) {
+
+            return;
+        }
 
-        auto task=[request, handler=std::forward<T>(handler)]() -> bool {
+        loop.release();
+        loop.post([state]() {
 
-            auto ret=chack_resolve(*request);
-            if (ret==EAI_INPROGRESS) {
+            state->request.reset();
+        });
 
-                return false;
-            } else if(ret == 0) {
+        TraceScope trace(loop.tracer(), "resolve");
+        auto handler=std::move(*state->handler);
+        if(!handler) {
 
-                if(auto [error, result]=get_result(*request); !error) {
+            return;
+        } else if(ret == 0) {
 
-                    handler(result, Error(Error::ok));
-                }
-                return true;
+            if(auto [error, result]=get_result(*state->request); !error) {
+
+                handler(result, Error(Error::ok));
             } else {
 
-                handler(std::vector<Endpoint>(), Error(Error::err_hostname_resolve, gai_strerror(ret)));
-                return true;
+                handler(std::vector<Endpoint>(), Error(Error::err_hostname_resolve));
             }
+        } else {
 
-            return false;
-        };
+            handler(std::vector<Endpoint>(), Error(Error::err_hostname_resolve, gai_strerror(ret)));
+        }
+    });
 
-        loop.post(std::move(task));
-    } else {
+    auto ret=async_resolve_request(*state->request);
+    if (!ret) {
 
-        handler(std::vector<Endpoint>(), Error(Error::err_hostname_resolve, gai_strerror(ret)));
+        loop.hold();
+        return ResolveHandle(state->handler);
     }
+
+    state->request.reset();
+    (*state->handler)(std::vector<Endpoint>(), Error(Error::err_hostname_resolve, gai_strerror(ret)));
+    return ResolveHandle();
 }
\ No newline at end of file
@@ -0,0 +1,174 @@
+#pragma once
+
+#include "resolver.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct ResolverStats
+{
+    size_t lookups=0;
+    size_t hits=0;
+    size_t negative_hits=0;
+    size_t coalesced=0;
+    size_t prefetched=0;
+
+    friend std::ostream& operator<<(std::ostream& out, const ResolverStats& stats)
+    {
+        return out << "resolver: lookups=" << stats.lookups
+            << " hits=" << stats.hits
+            << " negative_hits=" << stats.negative_hits
+            << " coalesced=" << stats.coalesced
+            << " prefetched=" << stats.prefetched;
+    }
+};
+
+// Resolved addresses keyed by hostname. getaddrinfo reports no record TTL, so
+// answers live for a fixed time and failures for a shorter one. Lookups of a
+// name that is already being resolved wait for the running one.
+class ResolverCache
+{
+public:
+    using Clock=std::chrono::steady_clock;
+
+private:
+    static constexpr size_t MAX_ENTRIES=4096;
+
+    struct Entry
+    {
+        std::vector<Endpoint> endpoints;
+        Error error=Error(Error::ok);
+        Clock::time_point expires;
+        std::vector<std::shared_ptr<ResolveHandler>> waiters;
+        bool resolving=false;
+    };
+
+    Loop& m_loop;
+    std::chrono::milliseconds m_ttl;
+    std::chrono::milliseconds m_negative_ttl;
+    std::unordered_map<std::string, Entry> m_entries;
+    ResolverStats m_stats;
+
+private:
+    static std::string key(std::string_view hostname)
+    {
+        std::string name(hostname.begin(), hostname.end());
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) {
+
+            return std::tolower(c);
+        });
+        return name;
+    }
+
+    bool is_fresh(const Entry& entry) const
+    {
+        return !entry.resolving && Clock::now() < entry.expires;
+    }
+
+    void purge()
+    {
+        auto now=Clock::now();
+        for(auto it=m_entries.begin(); it!=m_entries.end(); ) {
+
+            it=!it->second.resolving && it->second.expires <= now ? m_entries.erase(it) : std::next(it);
+        }
+    }
+
+    // Entries are never erased while resolving, so the node and its key outlive the lookup
+    void start_lookup(const std::string& name, Entry& entry)
+    {
+        entry.resolving=true;
+        ++m_stats.lookups;
+        ::resolve(m_loop, name, [this, &entry](const std::vector<Endpoint>& result, const Error& error) {
+
+            entry.resolving=false;
+            entry.endpoints=std::vector<Endpoint>(result);
+            entry.error=error;
+            entry.expires=Clock::now()+(error ? m_negative_ttl : m_ttl);
+
+            auto waiters=std::move(entry.waiters);
+            entry.waiters.clear();
+            for(auto& waiter : waiters) {
+
+                if(auto handler=std::move(*waiter)) {
+
+                    handler(result, error);
+                }
+            }
+        });
+    }
+
+    std::unordered_map<std::string, Entry>::value_type& find_or_add(std::string_view hostname)
+    {
+        auto name=key(hostname);
+        auto it=m_entries.find(name);
+        if(it==m_entries.end()) {
+
+            if(m_entries.size() >= MAX_ENTRIES) {
+
+                purge();
+            }
+            it=m_entries.emplace(std::move(name), Entry()).first;
+        }
+        return *it;
+    }
+
+public:
+    explicit ResolverCache(Loop& loop, std::chrono::milliseconds ttl=std::chrono::seconds(60), std::chrono::milliseconds negative_ttl=std::chrono::seconds(5)):
+        m_loop(loop),
+        m_ttl(ttl),
+        m_negative_ttl(negative_ttl)
+    {}
+
+    ResolverCache(const ResolverCache&) = delete;
+    ResolverCache& operator=(const ResolverCache&) = delete;
+
+    // A fresh answer is handed over before returning, otherwise when the lookup completes
+    template<typename T>
+    ResolveHandle resolve(std::string_view hostname, T&& handler)
+    {
+        auto& [name, entry]=find_or_add(hostname);
+        if(is_fresh(entry)) {
+
+            ++(entry.error ? m_stats.negative_hits : m_stats.hits);
+            auto endpoints=entry.endpoints;
+            auto error=entry.error;
+            handler(endpoints, error);
+            return ResolveHandle();
+        }
+
+        auto waiter=std::make_shared<ResolveHandler>(std::forward<T>(handler));
+        entry.waiters.push_back(waiter);
+        if(entry.resolving) {
+
+            ++m_stats.coalesced;
+        } else {
+
+            start_lookup(name, entry);
+        }
+        return ResolveHandle(waiter);
+    }
+
+    // Warms the cache for a name that will be needed soon
+    void prefetch(std::string_view hostname)
+    {
+        auto& [name, entry]=find_or_add(hostname);
+        if(!entry.resolving && !is_fresh(entry)) {
+
+            ++m_stats.prefetched;
+            start_lookup(name, entry);
+        }
+    }
+
+    const ResolverStats& stats() const
+    {
+        return m_stats;
+    }
+};
\ No newline at end of file
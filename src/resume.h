@@ -0,0 +1,298 @@
+#pragma once
+
+#include "executor.h"
+#include "stream.h"
+#include "url_parser.h"
+#include "http_client.h"
+#include "linux_fd.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+
+// What is known about a partial download. It is kept next to the file as three
+// lines: the validator the server sent, the length already committed to disk and
+// the full length, zero when the server did not tell.
+struct ResumeState
+{
+    std::string validator;
+    uint64_t committed=0;
+    uint64_t length=0;
+
+    static std::string path_for(const std::string& file_name)
+    {
+        return file_name+".resume";
+    }
+
+    // An empty state when the file is missing or damaged
+    static ResumeState load(const std::string& path)
+    {
+        ResumeState state;
+        std::ifstream in(path);
+        if(!std::getline(in, state.validator) || !(in >> state.committed >> state.length)) {
+
+            return ResumeState();
+        }
+        return state;
+    }
+
+    // Written aside and renamed over the old one, so a crash leaves either of them whole
+    Error save(const std::string& path) const
+    {
+        auto temp=path+".tmp";
+        auto text=validator+"\n"+std::to_string(committed)+"\n"+std::to_string(length)+"\n";
+
+        LinuxFd fd(open(temp.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR));
+        if(fd.get()==-1 || write(fd.get(), text.data(), text.size())!=ssize_t(text.size()) || fdatasync(fd.get())==-1) {
+
+            return Error(Error::err_write_file, strerror(errno));
+        }
+
+        if(rename(temp.c_str(), path.c_str())==-1) {
+
+            return Error(Error::err_write_file, strerror(errno));
+        }
+        return Error(Error::ok);
+    }
+};
+
+// Loads one resource into a file that survives interruptions. The committed length
+// only moves once the bytes before it are written, and it is synced to disk with
+// the file every SAVE_INTERVAL. A later run, or a retry after a network error, asks
+// for the rest with If-Range: a 206 appends, a 200 means the resource changed and
+// the file starts over.
+class ResumableLoader
+{
+public:
+    static constexpr uint64_t SAVE_INTERVAL=8*1024*1024; //bytes
+    // Attempts in a row that may fail without adding a byte
+    static constexpr size_t MAX_STALLED=3;
+
+private:
+    Loop& m_loop;
+    HttpUrl m_url;
+    std::string m_state_path;
+    OutFileStream m_file;
+    HttpTimeouts m_timeouts;
+    Metrics* m_metrics;
+    ResumeState m_state;
+    std::unique_ptr<HttpClient> m_client;
+    std::function<void(const Error&)> m_complete_cb;
+    uint64_t m_base;
+    uint64_t m_saved;
+    uint64_t m_resumed;
+    size_t m_attempts;
+    size_t m_stalled;
+
+private:
+    // A strong ETag, else Last-Modified; empty when neither can guard a range
+    static std::string validator_of(const ResponseHeader& header)
+    {
+        auto etag=header.get(HeaderField::etag);
+        if(!etag.empty() && etag.substr(0, 2)!="W/") {
+
+            return std::string(etag);
+        }
+        return std::string(header.get(HeaderField::last_modified));
+    }
+
+    static bool is_retryable(const Error& error)
+    {
+        switch(error.code()) {
+
+        case Error::err_connect:
+        case Error::err_read_file:
+        case Error::err_eof:
+        case Error::err_timeout_connect:
+        case Error::err_timeout_first_byte:
+        case Error::err_timeout_idle:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // The file data goes to disk before the length that vouches for it; without a
+    // validator a later run could not resume, so no state is kept
+    Error save()
+    {
+        if(m_state.validator.empty()) {
+
+            return Error(Error::ok);
+        }
+
+        if(auto error=m_file.sync()) {
+
+            return error;
+        }
+
+        m_saved=m_state.committed;
+        return m_state.save(m_state_path);
+    }
+
+    void start_attempt()
+    {
+        ++m_attempts;
+        m_base=m_state.validator.empty() ? 0 : m_state.committed;
+        m_state.committed=m_base;
+        if(auto error=m_file.truncate(m_base)) {
+
+            complete(error);
+            return;
+        }
+
+        m_client=std::make_unique<HttpClient>(m_loop, HttpUrl(m_url), m_timeouts);
+        m_client->set_content_coding(ContentCoding::IDENTITY);
+        m_client->set_metrics(m_metrics);
+        if(m_base > 0) {
+
+            m_client->add_field("Range", "bytes="+std::to_string(m_base)+"-");
+            m_client->add_field("If-Range", m_state.validator);
+        }
+        m_client->set_header_handler([this](const ResponseHeader& header) {
+
+            return on_header(header);
+        });
+        m_client->set_progress_handler([this](uint64_t written) {
+
+            m_state.committed=m_base+written;
+            if(m_state.committed-m_saved >= SAVE_INTERVAL) {
+
+                save();
+            }
+        });
+        m_client->load_file(m_file, std::nullopt, [this](const Error& error) {
+
+            on_loaded(error);
+        });
+    }
+
+    Error on_header(const ResponseHeader& header)
+    {
+        if(header.status_code==206) {
+
+            auto range=header.content_range();
+            if(m_base==0 || !range || range->first!=m_base) {
+
+                return Error(Error::err_parse_header, "unexpected content range");
+            }
+            m_resumed+=m_base;
+            return Error(Error::ok);
+        }
+
+        if(header.status_code!=200) {
+
+            return Error(Error::err_parse_header, "unexpected status "+std::to_string(header.status_code));
+        }
+
+        // A new or changed resource, whatever was kept is stale
+        m_base=0;
+        m_state.committed=0;
+        m_state.validator=validator_of(header);
+        m_state.length=header.content_length().value_or(0);
+        if(auto error=m_file.truncate(0)) {
+
+            return error;
+        }
+        return save();
+    }
+
+    void on_loaded(const Error& error)
+    {
+        // The client is on the call stack, release it on the next iteration
+        m_loop.post([client=std::move(m_client)]() {});
+
+        if(!error) {
+
+            if(auto sync_error=m_file.sync()) {
+
+                complete(sync_error);
+                return;
+            }
+            remove(m_state_path.c_str());
+            complete(Error(Error::ok));
+            return;
+        }
+
+        save();
+        m_stalled=m_state.committed > m_base ? 0 : m_stalled+1;
+        if(is_retryable(error) && !m_state.validator.empty() && m_stalled < MAX_STALLED) {
+
+            start_attempt();
+        } else {
+
+            complete(error);
+        }
+    }
+
+    void complete(const Error& error)
+    {
+        auto handler=std::move(m_complete_cb);
+        m_complete_cb=nullptr;
+        if(handler) {
+
+            handler(error);
+        }
+    }
+
+public:
+    ResumableLoader(Loop& loop, HttpUrl url, const std::string& file_name, const HttpTimeouts& timeouts=HttpTimeouts()):
+        m_loop(loop),
+        m_url(std::move(url)),
+        m_state_path(ResumeState::path_for(file_name)),
+        m_file(loop, file_name.c_str(), OutFileStream::KEEP),
+        m_timeouts(timeouts),
+        m_metrics(nullptr),
+        m_state(ResumeState::load(m_state_path)),
+        m_base(0),
+        m_saved(0),
+        m_resumed(0),
+        m_attempts(0),
+        m_stalled(0)
+    {
+        // Bytes past what the file holds were never synced
+        m_state.committed=std::min(m_state.committed, m_file.size());
+        m_saved=m_state.committed;
+    }
+
+    ResumableLoader(const ResumableLoader&) = delete;
+    ResumableLoader& operator=(const ResumableLoader&) = delete;
+
+    // Every attempt is recorded there; call before load()
+    void set_metrics(Metrics* metrics)
+    {
+        m_metrics=metrics;
+    }
+
+    template<typename C>
+    void load(C&& complete_handler)
+    {
+        m_complete_cb=std::forward<C>(complete_handler);
+        if(!m_state.validator.empty() && m_state.length > 0 && m_state.committed==m_state.length) {
+
+            // Finished before but the sidecar outlived it
+            m_resumed=m_state.committed;
+            on_loaded(m_file.truncate(m_state.committed));
+            return;
+        }
+        start_attempt();
+    }
+
+    // Bytes kept from earlier runs or attempts instead of fetched again
+    uint64_t resumed() const
+    {
+        return m_resumed;
+    }
+
+    size_t attempts() const
+    {
+        return m_attempts;
+    }
+};
\ No newline at end of file
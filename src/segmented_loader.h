@@ -0,0 +1,232 @@
+#pragma once
+
+#include "executor.h"
+#include "stream.h"
+#include "url_parser.h"
+#include "http_client.h"
+#include "connection_pool.h"
+#include "resolver_cache.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Downloads one resource over several connections. The first request is a plain
+// GET; when its header shows byte ranges and a length, its body is cut short and
+// the rest is fetched in ranges that write to their own offsets in the file. A
+// segment that finishes takes over the second half of the one with most left.
+class SegmentedLoader
+{
+public:
+    static constexpr uint64_t MIN_SEGMENT_SIZE=1024*1024; //bytes
+
+private:
+    struct Segment
+    {
+        uint64_t begin;
+        uint64_t end;
+        std::unique_ptr<HttpClient> client;
+        bool done=false;
+
+        uint64_t position() const
+        {
+            return begin+(client ? client->body_size() : 0);
+        }
+    };
+
+    Loop& m_loop;
+    HttpUrl m_url;
+    OutFileStream& m_file;
+    size_t m_connections;
+    HttpTimeouts m_timeouts;
+    Metrics* m_metrics;
+    ConnectionPool m_pool;
+    ResolverCache m_resolver;
+    std::vector<std::unique_ptr<Segment>> m_segments;
+    std::function<void(const Error&)> m_complete_cb;
+    uint64_t m_length;
+    size_t m_running;
+    Error m_error;
+
+private:
+    // Segments are byte ranges of the resource as stored, so it is asked for uncompressed
+    std::unique_ptr<HttpClient> make_client()
+    {
+        auto client=std::make_unique<HttpClient>(m_loop, HttpUrl(m_url), m_timeouts, &m_pool, &m_resolver);
+        client->set_content_coding(ContentCoding::IDENTITY);
+        client->set_metrics(m_metrics);
+        return client;
+    }
+
+    // Splits the first response once its header shows the resource can be fetched in ranges
+    Error on_first_header(Segment& first, const ResponseHeader& header)
+    {
+        auto length=header.content_length();
+        if(header.status_code!=200 || !length || !header.accepts_ranges() || m_connections < 2 || *length < 2*MIN_SEGMENT_SIZE) {
+
+            first.end=length.value_or(UINT64_MAX);
+            return Error(Error::ok);
+        }
+
+        m_length=*length;
+        auto size=std::max(m_length/m_connections, MIN_SEGMENT_SIZE);
+        first.end=first.client->truncate_body(size);
+        for(auto begin=first.end; begin < m_length; ) {
+
+            auto end=m_length-begin < size+MIN_SEGMENT_SIZE ? m_length : begin+size;
+            start_segment(begin, end);
+            begin=end;
+        }
+        return Error(Error::ok);
+    }
+
+    void start_segment(uint64_t begin, uint64_t end)
+    {
+        auto& segment=*m_segments.emplace_back(std::make_unique<Segment>(Segment{begin, end, make_client()}));
+        segment.client->set_range(begin, end-1);
+        segment.client->set_header_handler([&segment](const ResponseHeader& header) {
+
+            auto range=header.content_range();
+            if(header.status_code!=206 || !range || range->first!=segment.begin || range->second+1 < segment.end) {
+
+                return Error(Error::err_parse_header, "range not honoured");
+            }
+            return Error(Error::ok);
+        });
+        start_client(segment);
+    }
+
+    void start_client(Segment& segment)
+    {
+        ++m_running;
+        segment.client->load_file(m_file, segment.begin, [this, &segment](const Error& error) {
+
+            --m_running;
+            on_segment_done(segment, error);
+        });
+    }
+
+    void on_segment_done(Segment& segment, const Error& error)
+    {
+        segment.done=true;
+        if(!error && m_length!=UINT64_MAX && segment.position() < segment.end) {
+
+            m_error=Error(Error::err_eof, "segment ended early");
+        } else if(error && !m_error) {
+
+            m_error=error;
+        }
+
+        // The client is on the call stack, release it on the next iteration
+        m_loop.post([client=std::move(segment.client)]() {});
+
+        if(m_error) {
+
+            cancel();
+        } else {
+
+            steal();
+        }
+
+        if(m_running==0) {
+
+            auto handler=std::move(m_complete_cb);
+            m_complete_cb=nullptr;
+            if(handler) {
+
+                handler(m_error);
+            }
+        }
+    }
+
+    // Halves the unfinished segment with the most bytes left whose body is under way
+    void steal()
+    {
+        std::vector<Segment*> victims;
+        for(auto& segment : m_segments) {
+
+            if(!segment->done && segment->client && segment->end-segment->position() >= 2*MIN_SEGMENT_SIZE) {
+
+                victims.push_back(segment.get());
+            }
+        }
+
+        std::sort(victims.begin(), victims.end(), [](const Segment* left, const Segment* right) {
+
+            return left->end-left->position() > right->end-right->position();
+        });
+
+        for(auto victim : victims) {
+
+            auto old_end=victim->end;
+            auto split=victim->position()+(old_end-victim->position())/2;
+            auto length=victim->client->truncate_body(split-victim->begin);
+            if(length!=UINT64_MAX && victim->begin+length < old_end) {
+
+                victim->end=victim->begin+length;
+                start_segment(victim->end, old_end);
+                return;
+            }
+        }
+    }
+
+    // Every client still runs its completion, so writes in flight finish first
+    void cancel()
+    {
+        for(auto& segment : m_segments) {
+
+            if(!segment->done && segment->client) {
+
+                segment->client->abort(m_error);
+            }
+        }
+    }
+
+public:
+    SegmentedLoader(Loop& loop, HttpUrl url, OutFileStream& file, size_t connections, const HttpTimeouts& timeouts=HttpTimeouts()):
+        m_loop(loop),
+        m_url(std::move(url)),
+        m_file(file),
+        m_connections(std::max<size_t>(connections, 1)),
+        m_timeouts(timeouts),
+        m_metrics(nullptr),
+        m_pool(loop, m_connections, m_connections),
+        m_resolver(loop),
+        m_length(UINT64_MAX),
+        m_running(0),
+        m_error(Error::ok)
+    {}
+
+    SegmentedLoader(const SegmentedLoader&) = delete;
+    SegmentedLoader& operator=(const SegmentedLoader&) = delete;
+
+    // Every ranged request is recorded there; call before load()
+    void set_metrics(Metrics* metrics)
+    {
+        m_metrics=metrics;
+    }
+
+    // complete_handler runs once every segment has reached the file
+    template<typename C>
+    void load(C&& complete_handler)
+    {
+        m_complete_cb=std::forward<C>(complete_handler);
+        auto& first=*m_segments.emplace_back(std::make_unique<Segment>(Segment{0, UINT64_MAX, make_client()}));
+        first.client->set_header_handler([this, &first](const ResponseHeader& header) {
+
+            return on_first_header(first, header);
+        });
+        start_client(first);
+    }
+
+    size_t segments() const
+    {
+        return m_segments.size();
+    }
+
+    const PoolStats& pool_stats() const
+    {
+        return m_pool.stats();
+    }
+};
\ No newline at end of file
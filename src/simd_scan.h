@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PAGE_LOADER_X86 1
+#endif
+
+// Searches for the first control character other than HT (this includes CR, LF
+// and DEL): it ends every header line and is invalid anywhere else.
+// The vector versions are compiled with target attributes and picked at runtime.
+
+inline bool is_control(uint8_t c)
+{
+    return (c < 0x20 && c != '\t') || c == 0x7f;
+}
+
+inline const char* find_control_scalar(const char* p, const char* end)
+{
+    for(; p != end; ++p) {
+
+        if(is_control(static_cast<uint8_t>(*p))) {
+
+            return p;
+        }
+    }
+    return end;
+}
+
+#ifdef PAGE_LOADER_X86
+
+__attribute__((target("sse4.2")))
+inline const char* find_control_sse42(const char* p, const char* end)
+{
+    // Byte ranges 0x00-0x08, 0x0a-0x1f and 0x7f
+    alignas(16) static const char ranges[16]="\x00\x08\x0a\x1f\x7f\x7f";
+    const auto set=_mm_load_si128(reinterpret_cast<const __m128i*>(ranges));
+    for(; end-p >= 16; p+=16) {
+
+        auto chunk=_mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        auto index=_mm_cmpestri(set, 6, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if(index != 16) {
+
+            return p+index;
+        }
+    }
+    return find_control_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+inline const char* find_control_avx2(const char* p, const char* end)
+{
+    const auto space=_mm256_set1_epi8(0x20);
+    const auto tab=_mm256_set1_epi8('\t');
+    const auto del=_mm256_set1_epi8(0x7f);
+    for(; end-p >= 32; p+=32) {
+
+        auto chunk=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        auto printable=_mm256_cmpeq_epi8(_mm256_max_epu8(chunk, space), chunk);
+        auto allowed=_mm256_or_si256(printable, _mm256_cmpeq_epi8(chunk, tab));
+        auto control=_mm256_or_si256(_mm256_andnot_si256(allowed, _mm256_set1_epi8(-1)), _mm256_cmpeq_epi8(chunk, del));
+        if(auto mask=uint32_t(_mm256_movemask_epi8(control)); mask != 0) {
+
+            return p+__builtin_ctz(mask);
+        }
+    }
+    return find_control_sse42(p, end);
+}
+
+#endif
+
+using FindControl=const char* (*)(const char*, const char*);
+
+inline FindControl select_find_control()
+{
+#ifdef PAGE_LOADER_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+
+        return &find_control_avx2;
+    } else if(__builtin_cpu_supports("sse4.2")) {
+
+        return &find_control_sse42;
+    }
+#endif
+    return &find_control_scalar;
+}
+
+inline const char* find_control(const char* p, const char* end)
+{
+    static const FindControl implementation=select_find_control();
+    return implementation(p, end);
+}
\ No newline at end of file
@@ -1,238 +1,954 @@
 #pragma once
 
+#include "linux_fd.h"
+#include "executor.h"
+#include "endpoint.h"
+
 #include <sys/socket.h>
-#include <sys/epoll.h>
 #include <iostream>
 #include <string.h>
+#include <array>
 #include <deque>
+#include <memory>
+#include <vector>
+#include <functional>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <aio.h>
 
-class LinuxFd
+// Kernel buffer for moving data from a socket to a file with splice(). Needs the
+// ring: the pipe drains into the file with IORING_OP_SPLICE, off the loop thread;
+// a drain in flight is waited for when the pipe goes.
+class SplicePipe
 {
 private:
-    int m_obj;
+    static constexpr int PIPE_SIZE=1024*1024; //bytes
+
+    using Handler=InlineFunction<void(size_t, const Error&)>;
+
+    Loop& m_loop;
+    IoRing* m_ring;
+    LinuxFd m_read_end;
+    LinuxFd m_write_end;
+    size_t m_capacity;
+    IoCallback m_drain_op;
+    Handler m_handler;
+    int m_file;
+    uint64_t m_position;
+    size_t m_size;
+    size_t m_moved;
+    bool m_draining;
+
+private:
+    static std::array<int, 2> create_pipe()
+    {
+        std::array<int, 2> fds;
+        if(pipe2(fds.data(), O_NONBLOCK | O_CLOEXEC) == -1) {
+
+            throw Error(Error::err_init_pipe, strerror(errno));
+        }
+
+        // A bigger pipe moves more per call; the default size is kept when it is not allowed
+        fcntl(fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+        return fds;
+    }
+
+    SplicePipe(Loop& loop, std::array<int, 2> fds):
+        m_loop(loop),
+        m_ring(loop.ring()),
+        m_read_end(fds[0]),
+        m_write_end(fds[1]),
+        m_capacity(std::max(fcntl(fds[1], F_GETPIPE_SZ), 4096)),
+        m_drain_op([this](int32_t result, uint32_t flags) {
+
+            on_drained(result);
+        }),
+        m_file(-1),
+        m_position(0),
+        m_size(0),
+        m_moved(0),
+        m_draining(false)
+    {}
+
+    void submit_drain()
+    {
+        auto sqe=m_ring->prepare(IORING_OP_SPLICE, m_file, &m_drain_op);
+        sqe->splice_fd_in=m_read_end.get();
+        sqe->splice_off_in=uint64_t(-1);
+        sqe->off=m_position+m_moved;
+        sqe->len=uint32_t(m_size-m_moved);
+        sqe->splice_flags=SPLICE_F_MOVE;
+    }
+
+    void on_drained(int32_t result)
+    {
+        if(!m_draining) {
+
+            return;
+        }
+
+        if(result > 0) {
+
+            m_moved+=size_t(result);
+        }
+
+        auto error=Error(Error::ok);
+        if(result == 0) {
+
+            error=Error(Error::err_write_file, "pipe is empty");
+        } else if(result < 0 && result != -EINTR && result != -EAGAIN) {
+
+            error=Error(Error::err_write_file, strerror(-result));
+        } else if(m_moved < m_size) {
+
+            submit_drain();
+            return;
+        }
+
+        TraceScope trace(m_loop.tracer(), "splice");
+        m_draining=false;
+        m_loop.release();
+
+        // The handler may drop the pipe
+        auto handler=std::move(m_handler);
+        handler(m_moved, error);
+    }
 
 public:
-    explicit LinuxFd(int fd):
-        m_obj(fd)
+    explicit SplicePipe(Loop& loop):
+        SplicePipe(loop, create_pipe())
     {}
 
-    LinuxFd(LinuxFd&& fd):
-        m_obj(fd.m_obj)
+    SplicePipe(const SplicePipe&) = delete;
+    SplicePipe& operator=(const SplicePipe&) = delete;
+
+    ~SplicePipe()
     {
-        fd.m_obj = -1;
+        cancel();
     }
 
-    LinuxFd(const LinuxFd& fd) = delete;
-    LinuxFd& operator=(const LinuxFd& fd) = delete;
+    // Moves size bytes from the pipe to the file at position, handler gets the count
+    // moved and runs on a later iteration. One drain at a time.
+    template<typename T>
+    void drain_to(int file, uint64_t position, size_t size, T&& handler)
+    {
+        m_handler=Handler(std::forward<T>(handler));
+        m_file=file;
+        m_position=position;
+        m_size=size;
+        m_moved=0;
+        m_draining=true;
+        m_loop.hold();
+        submit_drain();
+    }
 
-    ~LinuxFd()
+    // Drops the handler; a splice in flight is waited for, it still reads the pipe
+    void cancel()
     {
-        if (m_obj != -1) {
+        if(!m_draining) {
 
-            close(m_obj);
+            return;
         }
+
+        m_draining=false;
+        m_handler=nullptr;
+        m_loop.release();
+        m_ring->wait_for(&m_drain_op);
     }
 
-    int get()
+    int read_end()
     {
-        return m_obj;
+        return m_read_end.get();
     }
-};
 
+    int write_end()
+    {
+        return m_write_end.get();
+    }
+
+    size_t capacity() const
+    {
+        return m_capacity;
+    }
+};
 
-class TcpStream
+class TcpStream : public EventHandler
 {
 private:
-    static const size_t EPOLL_SIZE = 10;
+    static constexpr uint32_t EVENTS=EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    static constexpr size_t MAX_RECEIVED=4; //ring buffers
 
 private:
     Loop& m_loop;
     LinuxFd m_sock;
-    LinuxFd m_epfd;
+    bool m_registered;
+    bool m_readable;
+    bool m_writable;
+    InlineFunction<void(const Error&)> m_connect_handler;
+    InlineFunction<void(const Error&)> m_write_handler;
+    const char* m_write_data;
+    size_t m_write_len;
+    InlineFunction<void(size_t, const Error&)> m_read_handler;
+    char* m_read_data;
+    size_t m_read_len;
+    int m_splice_fd;
+
+    // io_uring state: received data waits in provided buffers until it is read
+    struct Received
+    {
+        uint16_t id;
+        size_t offset;
+        size_t size;
+    };
+
+    IoRing* m_ring;
+    TcpEndpoint m_peer;
+    IoCallback m_connect_op;
+    IoCallback m_send_op;
+    IoCallback m_recv_op;
+    IoCallback m_poll_op;
+    std::deque<Received> m_received;
+    Error m_recv_error;
+    bool m_recv_armed;
+    bool m_out_of_buffers;
 
 private:
-    LinuxFd create_socket()
+    // The socket is opened by connect, once the address family is known
+    Error open_socket(int family)
     {
-        int sock=socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int sock=socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
         if(sock < 0) {
 
-            throw Error(Error::err_init_socket, strerror(errno));
+            return Error(Error::err_init_socket, strerror(errno));
         }
 
-        return LinuxFd(sock);
+        int enable=1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+        m_sock=LinuxFd(sock);
+        return Error(Error::ok);
     }
 
-    LinuxFd create_epoll(size_t size)
+    void register_socket()
     {
-        int epfd=epoll_create(size);
-        if(epfd < 0) {
+        if(!m_registered) {
 
-            throw Error(Error::err_init_socket, strerror(errno));
+            m_loop.add(m_sock.get(), EVENTS, this);
+            m_registered=true;
         }
+    }
+
+    void complete_connect()
+    {
+        int error=0;
+        socklen_t len=sizeof(error);
+        if(getsockopt(m_sock.get(), SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
 
-        return LinuxFd(epfd);
+            error=errno;
+        }
+
+        TraceScope trace(m_loop.tracer(), "connect");
+        auto handler=std::move(m_connect_handler);
+        m_connect_handler=nullptr;
+        m_loop.release();
+
+        if(error) {
+
+            handler(Error(Error::err_connect, strerror(error)));
+        } else {
+
+            m_readable=true;
+            m_writable=true;
+            handler(Error(Error::ok));
+        }
     }
 
-public:
-    explicit TcpStream(Loop& loop):
-        m_loop(loop),
-        m_sock(create_socket()),
-        m_epfd(create_epoll(EPOLL_SIZE))
+    void complete_write()
     {
-        epoll_event ev;
-        ev.events=EPOLLOUT | EPOLLIN;
-        ev.data.fd=m_sock.get();
-        if(epoll_ctl(m_epfd.get(), EPOLL_CTL_ADD, m_sock.get(), &ev) < 0) {
+        while(m_write_len > 0) {
+
+            auto ret=::send(m_sock.get(), m_write_data, m_write_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if(ret == -1) {
+
+                if(errno == EAGAIN || errno == EWOULDBLOCK) {
 
-            throw Error(Error::err_init_socket, strerror(errno));
+                    m_writable=false;
+                    return;
+                } else if(errno == EINTR) {
+
+                    continue;
+                }
+
+                TraceScope trace(m_loop.tracer(), "write");
+                auto handler=std::move(m_write_handler);
+                m_write_handler=nullptr;
+                m_loop.release();
+                handler(Error(Error::err_write_file, strerror(errno)));
+                return;
+            }
+
+            m_write_data+=ret;
+            m_write_len-=ret;
         }
+
+        TraceScope trace(m_loop.tracer(), "write");
+        auto handler=std::move(m_write_handler);
+        m_write_handler=nullptr;
+        m_loop.release();
+        handler(Error(Error::ok));
     }
 
-    TcpStream(TcpStream&& other) :
-        m_loop(other.m_loop),
-        m_sock(std::move(other.m_sock)),
-        m_epfd(std::move(other.m_epfd))
+    // Drains the socket until the buffer is full or nothing is left; data goes out
+    // first and an end of stream or error met on the way shows up on the next read
+    void complete_read()
     {
+        size_t total=0;
+        ssize_t ret=0;
+        int error=0;
+        while(total < m_read_len) {
+
+            ret=m_splice_fd==-1
+                ? ::recv(m_sock.get(), m_read_data+total, m_read_len-total, MSG_DONTWAIT)
+                : ::splice(m_sock.get(), nullptr, m_splice_fd, nullptr, m_read_len-total, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(ret <= 0) {
+
+                error=ret == -1 ? errno : 0;
+                if(error == EINTR) {
+
+                    continue;
+                }
+                break;
+            }
+            total+=ret;
+        }
+
+        if(ret == -1 && (error == EAGAIN || error == EWOULDBLOCK)) {
+
+            m_readable=false;
+            if(total == 0) {
+
+                return;
+            }
+        }
+
+        TraceScope trace(m_loop.tracer(), "read_some");
+        auto handler=std::move(m_read_handler);
+        m_read_handler=nullptr;
+        m_loop.release();
+
+        if(total > 0) {
+
+            handler(total, Error(Error::ok));
+        } else if(ret == -1) {
+
+            handler(0, Error(Error::err_read_file, strerror(error)));
+        } else {
+
+            handler(0, Error(Error::err_eof));
+        }
     }
 
-    ~TcpStream()
+    void on_connect(int32_t result)
     {
+        if(!m_connect_handler) {
+
+            return;
+        }
+
+        TraceScope trace(m_loop.tracer(), "connect");
+        auto handler=std::move(m_connect_handler);
+        m_connect_handler=nullptr;
+        m_loop.release();
+
+        if(result < 0) {
+
+            handler(Error(Error::err_connect, strerror(-result)));
+        } else {
+
+            handler(Error(Error::ok));
+        }
     }
 
-    TcpStream(const TcpStream&) = delete;
-    TcpStream& operator=(const TcpStream&) = delete;
+    void submit_send()
+    {
+        auto sqe=m_ring->prepare(IORING_OP_SEND, m_sock.get(), &m_send_op);
+        sqe->addr=reinterpret_cast<uint64_t>(m_write_data);
+        sqe->len=uint32_t(std::min<size_t>(m_write_len, UINT32_MAX));
+        sqe->msg_flags=MSG_NOSIGNAL;
+    }
 
-    template<typename T>
-    void connect(const TcpEndpoint& ep, T&& handler)
+    void on_send(int32_t result)
     {
-        sockaddr_in addr;
-        addr.sin_family=AF_INET;
-        addr.sin_port=htons(ep.port());
-        addr.sin_addr.s_addr=ep.addr();
+        if(!m_write_handler) {
 
-        auto ret=::connect(m_sock.get(), (struct sockaddr *)&addr, sizeof(addr));
-        if(ret < 0 && errno != EINPROGRESS) {
+            return;
+        }
 
-            handler(Error(Error::err_connect, strerror(errno)));
+        if(result > 0 && size_t(result) < m_write_len) {
+
+            m_write_data+=result;
+            m_write_len-=result;
+            submit_send();
             return;
-        } else if(ret == 0) {
+        }
+
+        TraceScope trace(m_loop.tracer(), "write");
+        auto handler=std::move(m_write_handler);
+        m_write_handler=nullptr;
+        m_loop.release();
+
+        if(result < 0) {
+
+            handler(Error(Error::err_write_file, strerror(-result)));
+        } else {
 
             handler(Error(Error::ok));
+        }
+    }
+
+    // One multishot receive keeps the socket drained into provided buffers
+    void on_recv(int32_t result, uint32_t flags)
+    {
+        if(!(flags & IORING_CQE_F_MORE)) {
+
+            m_recv_armed=false;
+        }
+
+        if(result > 0 && IoRing::has_buffer(flags)) {
+
+            m_received.push_back(Received{IoRing::buffer_id(flags), 0, size_t(result)});
+        } else if(result == 0) {
+
+            m_recv_error=Error(Error::err_eof);
+        } else if(result == -ENOBUFS) {
+
+            m_out_of_buffers=true;
+        } else if(result < 0 && result != -ECANCELED) {
+
+            m_recv_error=Error(Error::err_read_file, strerror(-result));
+        }
+
+        // The buffers are shared by all streams: one that is not read, e.g. paused,
+        // stops receiving and receive() arms it again once the queue is taken
+        if(!m_read_handler && m_recv_armed && m_received.size() == MAX_RECEIVED) {
+
+            m_ring->cancel(&m_recv_op);
+        }
+
+        receive();
+    }
+
+    // A multishot poll serves splicing; after its last completion receive() arms it again if needed
+    void on_poll(int32_t result)
+    {
+        if(result > 0) {
+
+            m_readable=true;
+        }
+        receive();
+    }
+
+    // Copies received data to the reader, or into the pipe when splicing, until
+    // the reader's buffer is full or the queue runs dry
+    void take_received()
+    {
+        size_t total=0;
+        ssize_t ret=0;
+        while(!m_received.empty() && total < m_read_len) {
+
+            auto& front=m_received.front();
+            auto data=m_ring->buffer(front.id, front.offset+front.size).substr(front.offset);
+            auto size=std::min(data.size(), m_read_len-total);
+
+            ret=size;
+            if(m_splice_fd == -1) {
+
+                memcpy(m_read_data+total, data.data(), size);
+            } else {
+
+                ret=::write(m_splice_fd, data.data(), size);
+            }
+
+            if(ret <= 0) {
+
+                break;
+            }
+
+            total+=ret;
+            front.offset+=ret;
+            front.size-=ret;
+            if(front.size == 0) {
+
+                m_ring->recycle(front.id);
+                m_received.pop_front();
+            }
+        }
+
+        TraceScope trace(m_loop.tracer(), "read_some");
+        auto handler=std::move(m_read_handler);
+        m_read_handler=nullptr;
+        m_loop.release();
+
+        if(total == 0 && ret == -1) {
+
+            handler(0, Error(Error::err_read_file, strerror(errno)));
+        } else {
+
+            handler(total, Error(Error::ok));
+        }
+    }
+
+    void receive()
+    {
+        if(!m_read_handler) {
+
+            return;
+        } else if(!m_received.empty()) {
+
+            take_received();
+            return;
+        } else if(m_recv_error) {
+
+            TraceScope trace(m_loop.tracer(), "read_some");
+            auto handler=std::move(m_read_handler);
+            m_read_handler=nullptr;
+            m_loop.release();
+            handler(0, m_recv_error);
+            return;
+        }
+
+        if(m_splice_fd == -1 && !m_out_of_buffers) {
+
+            if(m_poll_op.in_flight()) {
+
+                m_ring->cancel(&m_poll_op);
+            }
+
+            if(!m_recv_armed) {
+
+                auto sqe=m_ring->prepare(IORING_OP_RECV, m_sock.get(), &m_recv_op);
+                sqe->ioprio=IORING_RECV_MULTISHOT;
+                sqe->flags=IOSQE_BUFFER_SELECT;
+                sqe->buf_group=IoRing::BUFFER_GROUP;
+                m_recv_armed=true;
+            }
             return;
         }
 
-        auto task=[this, handler=std::forward<T>(handler)](){
+        // Splicing reads the socket directly: the multishot receive stops first and
+        // hands over what it got, its last completion calls receive() again
+        if(m_recv_armed) {
 
-            epoll_event event;
-            int nfds=epoll_wait(m_epfd.get(), &event, 10, 500);
-            if(nfds > 0) {
+            m_ring->cancel(&m_recv_op);
+            m_ring->wait_for(&m_recv_op);
+            return;
+        }
+
+        // Without buffers to select or while splicing: wait for data and read it in place
+        if(m_readable) {
 
-                handler(Error(Error::ok));
-                return true;
-            } else if(nfds < 0) {
+            complete_read();
+            if(!m_read_handler) {
 
-                handler(Error(Error::err_connect, strerror(errno)));
-                return true;
+                m_out_of_buffers=false;
+                return;
             }
+        }
 
-            return false;
-        };
+        if(!m_poll_op.in_flight()) {
 
-        m_loop.post(std::move(task));
+            auto sqe=m_ring->prepare(IORING_OP_POLL_ADD, m_sock.get(), &m_poll_op);
+            sqe->poll32_events=POLLIN | POLLRDHUP;
+            sqe->len=IORING_POLL_ADD_MULTI;
+        }
     }
 
-    template<typename T>
-    void write(std::string& data, T&& handler)
+public:
+    explicit TcpStream(Loop& loop):
+        m_loop(loop),
+        m_sock(-1),
+        m_registered(false),
+        m_readable(false),
+        m_writable(false),
+        m_write_data(nullptr),
+        m_write_len(0),
+        m_read_data(nullptr),
+        m_read_len(0),
+        m_splice_fd(-1),
+        m_ring(loop.ring()),
+        m_connect_op([this](int32_t result, uint32_t flags) { on_connect(result); }),
+        m_send_op([this](int32_t result, uint32_t flags) { on_send(result); }),
+        m_recv_op([this](int32_t result, uint32_t flags) { on_recv(result, flags); }),
+        m_poll_op([this](int32_t result, uint32_t flags) { on_poll(result); }),
+        m_recv_error(Error::ok),
+        m_recv_armed(false),
+        m_out_of_buffers(false)
+    {
+    }
+
+    TcpStream(TcpStream&& other) = delete;
+
+    ~TcpStream()
     {
-        auto ret=::send(m_sock.get(), data.data(), data.size(), MSG_DONTWAIT);
-        if(ret == -1) {
+        if(m_registered) {
 
-            handler(Error(Error::err_write_file, strerror(errno)));
-            return ;
+            m_loop.remove(m_sock.get(), this);
+        } else {
+
+            m_loop.forget(this);
         }
 
-        auto task=[this, handler=std::forward<T>(handler)]() {
+        for(bool pending : {bool(m_connect_handler), bool(m_write_handler), bool(m_read_handler)}) {
 
-            epoll_event event;
-            int nfds=epoll_wait(m_epfd.get(), &event, 10, 100);
-            if(nfds > 0) {
+            if(pending) {
 
-                if(event.events & EPOLLOUT) {
+                m_loop.release();
+            }
+        }
 
-                    handler(Error(Error::ok));
-                    return true;
-                }
-                return false;
-            } else if(nfds < 0) {
+        // The kernel may still use the operations and the receive buffers
+        if(m_ring) {
 
-                handler(Error(Error::err_write_file, strerror(errno)));
-                return true;
+            m_connect_handler=nullptr;
+            m_write_handler=nullptr;
+            m_read_handler=nullptr;
+            for(auto op : {&m_connect_op, &m_send_op, &m_recv_op, &m_poll_op}) {
+
+                m_ring->cancel(op);
+            }
+
+            for(auto op : {&m_connect_op, &m_send_op, &m_recv_op, &m_poll_op}) {
+
+                m_ring->wait_for(op);
+            }
+
+            for(auto& received : m_received) {
+
+                m_ring->recycle(received.id);
             }
+        }
+    }
+
+    TcpStream(const TcpStream&) = delete;
+    TcpStream& operator=(const TcpStream&) = delete;
+
+    // An idle keep-alive connection has nothing to read: EOF or stray bytes make it unusable
+    bool is_open()
+    {
+        if(!m_received.empty() || m_recv_error) {
 
             return false;
-        };
+        }
 
-        m_loop.post(std::move(task));
+        char byte;
+        auto ret=::recv(m_sock.get(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        return ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
     }
 
-    template<typename T>
-    void read_some(std::vector<char>& buffer, T&& handler)
+    // Drops pending operations; their handlers are never called
+    void cancel()
     {
-        auto task=[this, buffer_data=buffer.data(), buffer_len=buffer.size(), handler=std::forward<T>(handler)]() {
+        for(bool pending : {bool(m_connect_handler), bool(m_write_handler), bool(m_read_handler)}) {
 
-            epoll_event event;
-            auto nfds=epoll_wait(m_epfd.get(), &event, 10, 100);
-            if(nfds > 0) {
+            if(pending) {
 
-                if(event.events & EPOLLIN) {
+                m_loop.release();
+            }
+        }
 
-                    auto ret=::recv(m_sock.get(), buffer_data, buffer_len, MSG_DONTWAIT);
-                    if(ret == -1 && errno != EAGAIN) {
+        m_connect_handler=nullptr;
+        m_write_handler=nullptr;
+        m_read_handler=nullptr;
+        m_loop.forget(this);
 
-                        handler(0, Error(Error::err_read_file, strerror(errno)));
-                    } else if(ret == 0) {
+        // A multishot receive keeps running, what it gets makes the stream unusable
+        if(m_ring) {
+
+            m_ring->cancel(&m_connect_op);
+            m_ring->cancel(&m_send_op);
+        }
+    }
 
-                        handler(0, Error(Error::err_eof));
-                    } else {
+    // Drops a pending connect; its handler is never called
+    void cancel_connect()
+    {
+        if(m_connect_handler) {
 
-                        handler(ret, Error(Error::ok));
-                    }
-                    return true;
-                } else {
+            m_connect_handler=nullptr;
+            m_loop.release();
+        }
 
-                    return false;
-                }
-                return true;
-            } else if(nfds < 0) {
+        if(m_ring) {
+
+            m_ring->cancel(&m_connect_op);
+        }
+    }
+
+    // Drops a pending write; a send in flight is waited for, the data has to stay until then
+    void cancel_write()
+    {
+        if(m_write_handler) {
+
+            m_write_handler=nullptr;
+            m_loop.release();
+        }
+
+        if(m_ring) {
+
+            m_ring->cancel(&m_send_op);
+            m_ring->wait_for(&m_send_op);
+        }
+    }
+
+    // Drops a pending read; received data stays queued for the next one
+    void cancel_read()
+    {
+        if(m_read_handler) {
+
+            m_read_handler=nullptr;
+            m_loop.release();
+        }
+    }
+
+    void on_events(uint32_t events) override
+    {
+        if(m_ring) {
+
+            receive();
+            return;
+        }
 
-                handler(0, Error(Error::err_read_file, strerror(errno)));
-                return true;
+        if(m_connect_handler) {
+
+            if(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+
+                complete_connect();
             }
+            return;
+        }
 
-            return false;
-        };
+        if(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+
+            m_writable=true;
+            if(m_write_handler) {
+
+                complete_write();
+            }
+        }
+
+        if(events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+
+            m_readable=true;
+            if(m_read_handler) {
+
+                complete_read();
+            }
+        }
+    }
+
+    template<typename T>
+    void connect(const TcpEndpoint& ep, T&& handler)
+    {
+        if(m_ring) {
+
+            m_ring->wait_for(&m_connect_op);
+        }
+
+        m_peer=ep;
+        if(auto error=open_socket(ep.family())) {
+
+            handler(error);
+            return;
+        }
+
+        if(m_ring) {
+
+            m_connect_handler=std::forward<T>(handler);
+            m_loop.hold();
+
+            auto sqe=m_ring->prepare(IORING_OP_CONNECT, m_sock.get(), &m_connect_op);
+            sqe->addr=reinterpret_cast<uint64_t>(m_peer.address());
+            sqe->off=m_peer.size();
+            return;
+        }
 
-        m_loop.post(std::move(task));
+        auto ret=::connect(m_sock.get(), m_peer.address(), m_peer.size());
+        if(ret < 0 && errno != EINPROGRESS) {
+
+            handler(Error(Error::err_connect, strerror(errno)));
+            return;
+        }
+
+        register_socket();
+        if(ret == 0) {
+
+            m_readable=true;
+            m_writable=true;
+            handler(Error(Error::ok));
+            return;
+        }
+
+        m_connect_handler=std::forward<T>(handler);
+        m_loop.hold();
+    }
+
+    template<typename T>
+    void write(std::string& data, T&& handler)
+    {
+        if(m_ring) {
+
+            m_ring->wait_for(&m_send_op);
+        }
+
+        m_write_handler=std::forward<T>(handler);
+        m_write_data=data.data();
+        m_write_len=data.size();
+        m_loop.hold();
+
+        if(m_ring) {
+
+            submit_send();
+        } else if(m_writable) {
+
+            m_loop.schedule(this, EPOLLOUT);
+        }
+    }
+
+    template<typename T>
+    void read_some(std::vector<char>& buffer, T&& handler)
+    {
+        read_some(buffer.data(), buffer.size(), std::forward<T>(handler));
+    }
+
+    // Fills as much of the buffer as the socket has ready, see complete_read
+    template<typename T>
+    void read_some(char* data, size_t size, T&& handler)
+    {
+        m_read_handler=std::forward<T>(handler);
+        m_read_data=data;
+        m_read_len=size;
+        m_splice_fd=-1;
+        m_loop.hold();
+
+        if(m_readable || m_ring) {
+
+            m_loop.schedule(this, EPOLLIN);
+        }
+    }
+
+    // Like read_some, but up to size bytes are moved into the empty pipe without a copy
+    template<typename T>
+    void splice_some(SplicePipe& pipe, size_t size, T&& handler)
+    {
+        m_read_handler=std::forward<T>(handler);
+        m_read_data=nullptr;
+        m_read_len=std::min(size, pipe.capacity());
+        m_splice_fd=pipe.write_end();
+        m_loop.hold();
+
+        if(m_readable || m_ring) {
+
+            m_loop.schedule(this, EPOLLIN);
+        }
     }
 };
 
 
 class OutFileStream
 {
+public:
+    // REPLACE starts an empty file, KEEP opens what is there for resuming
+    enum Mode
+    {
+        REPLACE,
+        KEEP
+    };
+
+    static constexpr size_t SLOT_SIZE=BufferPool::MAX_BLOCK; //bytes
+    static constexpr size_t MAX_IN_FLIGHT=4;
+    static constexpr uint64_t HIGH_WATER=2*1024*1024; //bytes
+    static constexpr uint64_t LOW_WATER=512*1024; //bytes
+
 private:
+    using Handler=InlineFunction<void(size_t, const Error&)>;
+
+    struct Pending
+    {
+        size_t size;
+        Handler handler;
+    };
+
+    struct DrainWaiter
+    {
+        const void* owner;
+        InlineFunction<void()> handler;
+    };
+
+    // One submission: adjacent writes gathered in a pooled block, plus the handlers of
+    // the writes that end in it. Slots are reused once their write has completed.
+    struct Slot
+    {
+        PooledBuffer buffer;
+        uint64_t offset;
+        size_t size;
+        std::vector<Pending> pending;
+        aiocb cb;
+        IoCallback op;
+        int32_t result;
+        bool done;
+
+        explicit Slot(OutFileStream* owner):
+            offset(0),
+            size(0),
+            cb(),
+            op([this, owner](int32_t result, uint32_t flags) {
+
+                this->result=result;
+                done=true;
+                owner->complete_ring_writes();
+            }),
+            result(0),
+            done(false)
+        {}
+    };
+
     Loop& m_loop;
+    IoRing* m_ring;
     LinuxFd m_file;
-    std::deque<aiocb> m_queue_cb;
+    std::vector<std::unique_ptr<Slot>> m_slots;
+    std::vector<Slot*> m_free;
+    std::deque<Slot*> m_queue;
+    std::vector<Pending> m_completed;
+    std::vector<DrainWaiter> m_drain_waiters;
+    std::unique_ptr<Notifier> m_notifier;
+    size_t m_in_flight;
+    uint64_t m_queued_bytes;
+    uint64_t m_high_water;
+    uint64_t m_low_water;
+    uint64_t m_submitted;
+    uint64_t m_notified;
+    uint64_t m_offset;
+    Error m_error;
+    bool m_closing;
 
 private:
-    LinuxFd create_file(const char* file_name)
+    LinuxFd create_file(const char* file_name, Mode mode)
     {
-        int fd=open(file_name, O_CREAT | O_APPEND | O_WRONLY | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if(mode==KEEP) {
+
+            int fd=open(file_name, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if(fd==-1) {
+
+                throw Error(Error::err_init_out_file, strerror(errno));
+            }
+            return LinuxFd(fd);
+        }
+
+        int fd=open(file_name, O_CREAT | O_WRONLY | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
         if(fd==-1) {
 
             if(errno==EEXIST) {
@@ -242,7 +958,7 @@ private:
                     throw Error(Error::err_init_out_file, strerror(errno));
                 }
 
-                int fd=open(file_name, O_CREAT | O_APPEND | O_WRONLY | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+                int fd=open(file_name, O_CREAT | O_WRONLY | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
                 if(fd==-1) {
 
                     throw Error(Error::err_init_out_file, strerror(errno));
@@ -254,63 +970,382 @@ private:
         return LinuxFd(fd);
     }
 
+    static void notify(sigval value)
+    {
+        static_cast<Notifier*>(value.sival_ptr)->notify();
+    }
+
+    Slot& new_slot(uint64_t offset)
+    {
+        if(m_free.empty()) {
+
+            m_slots.push_back(std::make_unique<Slot>(this));
+            m_free.push_back(m_slots.back().get());
+        }
+
+        auto slot=m_free.back();
+        m_free.pop_back();
+        slot->buffer=m_loop.buffers().acquire(SLOT_SIZE);
+        slot->offset=offset;
+        slot->size=0;
+        slot->result=0;
+        slot->done=false;
+        m_queue.push_back(slot);
+        return *slot;
+    }
+
+    // An idle stream holds no block
+    void release_slot(Slot& slot)
+    {
+        slot.buffer.reset();
+        m_free.push_back(&slot);
+    }
+
+    // The last slot takes more data while it is not submitted and the data follows on
+    Slot& slot_for(uint64_t offset)
+    {
+        if(m_queue.size() > m_in_flight) {
+
+            auto& last=*m_queue.back();
+            if(last.size < SLOT_SIZE && last.offset+last.size == offset) {
+
+                return last;
+            }
+        }
+        return new_slot(offset);
+    }
+
+    // Full slots go out right away and the last one when the disk is idle, so small
+    // writes gather while earlier ones are in flight
+    void submit()
+    {
+        while(m_in_flight < MAX_IN_FLIGHT && m_in_flight < m_queue.size()) {
+
+            auto& slot=*m_queue[m_in_flight];
+            if(slot.done || (m_in_flight+1 == m_queue.size() && slot.size < SLOT_SIZE && m_in_flight > 0)) {
+
+                return;
+            }
+
+            if(!start_write(slot)) {
+
+                complete_slots();
+                return;
+            }
+            ++m_in_flight;
+            m_loop.hold();
+        }
+    }
+
+    bool start_write(Slot& slot)
+    {
+        if(m_ring) {
+
+            auto sqe=m_ring->prepare(IORING_OP_WRITE, m_file.get(), &slot.op);
+            sqe->addr=reinterpret_cast<uint64_t>(slot.buffer.data());
+            sqe->len=uint32_t(slot.size);
+            sqe->off=slot.offset;
+            return true;
+        }
+
+        slot.cb=aiocb();
+        slot.cb.aio_nbytes = slot.size;
+        slot.cb.aio_fildes = m_file.get();
+        slot.cb.aio_offset = slot.offset;
+        slot.cb.aio_buf = slot.buffer.data();
+        slot.cb.aio_sigevent.sigev_notify = SIGEV_THREAD;
+        slot.cb.aio_sigevent.sigev_notify_function = &OutFileStream::notify;
+        slot.cb.aio_sigevent.sigev_value.sival_ptr = m_notifier.get();
+
+        if(::aio_write(&slot.cb) == -1) {
+
+            // Fails this slot and the ones behind it once the slots before it are done
+            slot.result=-errno;
+            slot.done=true;
+            return false;
+        }
+
+        ++m_submitted;
+        return true;
+    }
+
+    void complete_writes(uint64_t notified)
+    {
+        TraceScope trace(m_loop.tracer(), "aio");
+        m_notified+=notified;
+        for(size_t i=0; i < m_in_flight; ++i) {
+
+            auto& slot=*m_queue[i];
+            if(auto res=slot.done ? EINPROGRESS : aio_error(&slot.cb); res != EINPROGRESS) {
+
+                auto res_bytes=aio_return(&slot.cb);
+                slot.result=res==0 ? int32_t(res_bytes) : -res;
+                slot.done=true;
+            }
+        }
+        complete_slots();
+    }
+
+    // Ring writes may finish out of order, handlers are still called in order
+    void complete_ring_writes()
+    {
+        TraceScope trace(m_loop.tracer(), "aio");
+        if(!m_closing) {
+
+            complete_slots();
+        }
+    }
+
+    void complete_slots()
+    {
+        while(!m_queue.empty() && m_queue.front()->done) {
+
+            auto& slot=*m_queue.front();
+            m_queue.pop_front();
+            if(m_in_flight > 0) {
+
+                --m_in_flight;
+                m_loop.release();
+            }
+            m_queued_bytes-=slot.size;
+
+            if(slot.result < 0 && !m_error) {
+
+                m_error=Error(Error::err_write_file, strerror(-slot.result));
+            } else if(slot.result >= 0 && size_t(slot.result) != slot.size && !m_error) {
+
+                m_error=Error(Error::err_write_file, "short write");
+            }
+
+            // Handlers may write again, so the slot is free before they run
+            m_completed.swap(slot.pending);
+            release_slot(slot);
+            for(auto& pending : m_completed) {
+
+                pending.handler(m_error ? 0 : pending.size, m_error);
+            }
+            m_completed.clear();
+        }
+
+        if(m_error) {
+
+            fail_queued();
+        } else {
+
+            submit();
+        }
+        notify_drained();
+    }
+
+    void notify_drained()
+    {
+        if(m_drain_waiters.empty() || (m_queued_bytes > m_low_water && !m_error)) {
+
+            return;
+        }
+
+        // Handlers may write and wait again
+        auto waiters=std::move(m_drain_waiters);
+        m_drain_waiters.clear();
+        for(auto& waiter : waiters) {
+
+            waiter.handler();
+        }
+    }
+
+    // After a failed write nothing more is written, whatever waits fails in order
+    void fail_queued()
+    {
+        while(m_queue.size() > m_in_flight) {
+
+            auto& slot=*m_queue.back();
+            m_queue.pop_back();
+            m_queued_bytes-=slot.size;
+            m_completed.swap(slot.pending);
+            release_slot(slot);
+            for(auto& pending : m_completed) {
+
+                pending.handler(0, m_error);
+            }
+            m_completed.clear();
+        }
+    }
+
 public:
-    explicit OutFileStream(Loop& loop, const char* file_name):
+    explicit OutFileStream(Loop& loop, const char* file_name, Mode mode=REPLACE):
         m_loop(loop),
-        m_file(create_file(file_name))
+        m_ring(loop.ring()),
+        m_file(create_file(file_name, mode)),
+        m_notifier(m_ring ? nullptr : std::make_unique<Notifier>(m_loop, [this](uint64_t notified) {
+
+            complete_writes(notified);
+        })),
+        m_in_flight(0),
+        m_queued_bytes(0),
+        m_high_water(HIGH_WATER),
+        m_low_water(LOW_WATER),
+        m_submitted(0),
+        m_notified(0),
+        m_offset(0),
+        m_error(Error::ok),
+        m_closing(false)
     {
     }
 
-    OutFileStream(OutFileStream&& other) :
-        m_loop(other.m_loop),
-        m_file(std::move(other.m_file))
+    OutFileStream(OutFileStream&& other) = delete;
+
+    // Writes in flight are waited for, their handlers are not called
+    ~OutFileStream()
     {
+        m_closing=true;
+        if(m_ring) {
+
+            for(size_t i=0; i < m_in_flight; ++i) {
+
+                m_ring->wait_for(&m_queue[i]->op);
+            }
+        } else {
+
+            for(; m_notified < m_submitted; ) {
+
+                m_notified+=m_notifier->wait();
+            }
+
+            for(size_t i=0; i < m_in_flight; ++i) {
+
+                if(!m_queue[i]->done) {
+
+                    aio_return(&m_queue[i]->cb);
+                }
+            }
+        }
+
+        for(size_t i=0; i < m_in_flight; ++i) {
+
+            m_loop.release();
+        }
     }
 
-    ~OutFileStream()
+    // Appends; data is copied, handler runs once it is in the file
+    template<typename T>
+    void write(std::string_view data, T&& handler)
     {
+        auto offset=m_offset;
+        m_offset+=data.size();
+        write_at(offset, data, std::forward<T>(handler));
     }
 
+    // Writes at a fixed position, the append position is left alone. Handlers run in
+    // the order of the writes; after a failure every later one gets the error.
     template<typename T>
-    void write(std::string& data, T&& handler)
+    void write_at(uint64_t offset, std::string_view data, T&& handler)
     {
-        m_queue_cb.emplace_back();
-        aiocb& ocb=m_queue_cb.back();
-        ocb.aio_nbytes = data.size();
-        ocb.aio_fildes = m_file.get();
-        ocb.aio_offset = 0;
-        ocb.aio_buf = data.data();
+        if(m_error || data.empty()) {
+
+            handler(0, m_error);
+            return;
+        }
 
-        auto ret=::aio_write(&ocb);
-        if(ret == -1) {
+        auto size=data.size();
+        while(!data.empty()) {
 
-            handler(0, Error(Error::err_write_file, strerror(errno)));
-            return ;
+            auto& slot=slot_for(offset);
+            auto part=std::min(data.size(), SLOT_SIZE-slot.size);
+            memcpy(slot.buffer.data()+slot.size, data.data(), part);
+            slot.size+=part;
+            offset+=part;
+            data.remove_prefix(part);
         }
 
-        auto task=[this, ocb_ptr=&ocb, handler=std::forward<T>(handler)]() {
+        m_queue.back()->pending.push_back(Pending{size, Handler(std::forward<T>(handler))});
+        m_queued_bytes+=size;
+        submit();
+    }
 
-            auto res=aio_error(ocb_ptr);
-            if(res==0) {
+    // Slots waiting or being written
+    size_t queue_depth() const
+    {
+        return m_queue.size();
+    }
 
-                int res_bytes=aio_return(ocb_ptr);
-                if(res_bytes!=-1){
+    // Bytes accepted and not yet in the file
+    uint64_t queued_bytes() const
+    {
+        return m_queued_bytes;
+    }
 
-                    handler(res_bytes, Error(Error::ok));
-                    return true;
-                } else {
+    // Writers should stop at high bytes queued and go on once it is down to low
+    void set_watermarks(uint64_t high, uint64_t low)
+    {
+        m_high_water=std::max<uint64_t>(high, 1);
+        m_low_water=std::min(low, m_high_water-1);
+    }
 
-                    handler(0, Error(Error::err_write_file, strerror(errno)));
-                    return true;
-                }
-            } else if(res==EINPROGRESS) {
+    bool is_congested() const
+    {
+        return m_queued_bytes >= m_high_water;
+    }
 
-                return false;
-            }
-            handler(0, Error(Error::err_write_file));
-            return true;
-        };
+    // handler runs once the queue is down to the low-water mark, or a write failed;
+    // a writer waits for one drain at a time
+    template<typename T>
+    void when_drained(const void* owner, T&& handler)
+    {
+        cancel_drain(owner);
+        m_drain_waiters.push_back(DrainWaiter{owner, InlineFunction<void()>(std::forward<T>(handler))});
+        notify_drained();
+    }
+
+    void cancel_drain(const void* owner)
+    {
+        m_drain_waiters.erase(std::remove_if(m_drain_waiters.begin(), m_drain_waiters.end(), [owner](const DrainWaiter& waiter) {
 
-        m_loop.post(std::move(task));
+            return waiter.owner == owner;
+        }), m_drain_waiters.end());
+    }
+
+    uint64_t size()
+    {
+        struct stat st;
+        return fstat(m_file.get(), &st)==0 ? uint64_t(st.st_size) : 0;
+    }
+
+    // Cuts the file to size bytes and appends from there; writes in flight are not waited for
+    Error truncate(uint64_t size)
+    {
+        if(ftruncate(m_file.get(), off_t(size))==-1) {
+
+            return Error(Error::err_write_file, strerror(errno));
+        }
+
+        m_offset=size;
+        return Error(Error::ok);
+    }
+
+    // Blocks until completed writes are on disk
+    Error sync()
+    {
+        if(fdatasync(m_file.get())==-1) {
+
+            return Error(Error::err_write_file, strerror(errno));
+        }
+        return Error(Error::ok);
+    }
+
+    // Drains size bytes from the pipe into the file, see SplicePipe::drain_to. Writes
+    // already queued keep their place in the file.
+    template<typename T>
+    void splice_from(SplicePipe& pipe, size_t size, T&& handler)
+    {
+        auto position=m_offset;
+        m_offset+=size;
+        pipe.drain_to(m_file.get(), position, size, std::forward<T>(handler));
+    }
+
+    // Like splice_from, but at a fixed position
+    template<typename T>
+    void splice_from(SplicePipe& pipe, size_t size, uint64_t position, T&& handler)
+    {
+        pipe.drain_to(m_file.get(), position, size, std::forward<T>(handler));
     }
 };
\ No newline at end of file
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template<typename Signature, size_t Capacity=64>
+class InlineFunction;
+
+// Move-only callable wrapper; callables up to Capacity bytes are stored inline
+template<typename R, typename... Args, size_t Capacity>
+class InlineFunction<R(Args...), Capacity>
+{
+private:
+    struct VTable
+    {
+        R (*invoke)(void*, Args&&...);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void*);
+    };
+
+    template<typename F>
+    static constexpr bool is_inline=sizeof(F) <= Capacity
+        && alignof(F) <= alignof(std::max_align_t)
+        && std::is_nothrow_move_constructible_v<F>;
+
+    template<typename F>
+    struct Inline
+    {
+        static R invoke(void* storage, Args&&... args)
+        {
+            return (*static_cast<F*>(storage))(std::forward<Args>(args)...);
+        }
+
+        static void move(void* dst, void* src)
+        {
+            new (dst) F(std::move(*static_cast<F*>(src)));
+            static_cast<F*>(src)->~F();
+        }
+
+        static void destroy(void* storage)
+        {
+            static_cast<F*>(storage)->~F();
+        }
+
+        static constexpr VTable vtable={&invoke, &move, &destroy};
+    };
+
+    template<typename F>
+    struct Heap
+    {
+        static R invoke(void* storage, Args&&... args)
+        {
+            return (**static_cast<F**>(storage))(std::forward<Args>(args)...);
+        }
+
+        static void move(void* dst, void* src)
+        {
+            *static_cast<F**>(dst)=*static_cast<F**>(src);
+        }
+
+        static void destroy(void* storage)
+        {
+            delete *static_cast<F**>(storage);
+        }
+
+        static constexpr VTable vtable={&invoke, &move, &destroy};
+    };
+
+    alignas(std::max_align_t) unsigned char m_storage[Capacity];
+    const VTable* m_vtable;
+
+private:
+    void reset()
+    {
+        if(m_vtable) {
+
+            m_vtable->destroy(m_storage);
+            m_vtable=nullptr;
+        }
+    }
+
+    template<typename T>
+    void assign(T&& callable)
+    {
+        using F=std::decay_t<T>;
+        if constexpr(is_inline<F>) {
+
+            new (m_storage) F(std::forward<T>(callable));
+            m_vtable=&Inline<F>::vtable;
+        } else {
+
+            *reinterpret_cast<F**>(m_storage)=new F(std::forward<T>(callable));
+            m_vtable=&Heap<F>::vtable;
+        }
+    }
+
+public:
+    InlineFunction():
+        m_vtable(nullptr)
+    {}
+
+    InlineFunction(std::nullptr_t):
+        m_vtable(nullptr)
+    {}
+
+    template<typename T, typename=std::enable_if_t<!std::is_same_v<std::decay_t<T>, InlineFunction>>>
+    InlineFunction(T&& callable):
+        m_vtable(nullptr)
+    {
+        assign(std::forward<T>(callable));
+    }
+
+    InlineFunction(InlineFunction&& other):
+        m_vtable(other.m_vtable)
+    {
+        if(m_vtable) {
+
+            m_vtable->move(m_storage, other.m_storage);
+            other.m_vtable=nullptr;
+        }
+    }
+
+    InlineFunction(const InlineFunction&) = delete;
+    InlineFunction& operator=(const InlineFunction&) = delete;
+
+    ~InlineFunction()
+    {
+        reset();
+    }
+
+    InlineFunction& operator=(InlineFunction&& other)
+    {
+        if(this != &other) {
+
+            reset();
+            m_vtable=other.m_vtable;
+            if(m_vtable) {
+
+                m_vtable->move(m_storage, other.m_storage);
+                other.m_vtable=nullptr;
+            }
+        }
+        return *this;
+    }
+
+    InlineFunction& operator=(std::nullptr_t)
+    {
+        reset();
+        return *this;
+    }
+
+    template<typename T, typename=std::enable_if_t<!std::is_same_v<std::decay_t<T>, InlineFunction>>>
+    InlineFunction& operator=(T&& callable)
+    {
+        reset();
+        assign(std::forward<T>(callable));
+        return *this;
+    }
+
+    explicit operator bool() const
+    {
+        return m_vtable != nullptr;
+    }
+
+    R operator()(Args... args)
+    {
+        return m_vtable->invoke(m_storage, std::forward<Args>(args)...);
+    }
+};
+
+// FIFO on a power of two ring; the storage only grows, so a steady state
+// of posts and pops does not allocate
+template<typename T>
+class RingQueue
+{
+private:
+    std::vector<T> m_items;
+    size_t m_head;
+    size_t m_size;
+
+private:
+    void grow()
+    {
+        std::vector<T> items(m_items.empty() ? 64 : m_items.size()*2);
+        for(size_t i=0; i<m_size; ++i) {
+
+            items[i]=std::move(m_items[(m_head+i) & (m_items.size()-1)]);
+        }
+        m_items.swap(items);
+        m_head=0;
+    }
+
+public:
+    RingQueue():
+        m_head(0),
+        m_size(0)
+    {}
+
+    template<typename U>
+    void emplace_back(U&& item)
+    {
+        if(m_size == m_items.size()) {
+
+            grow();
+        }
+        m_items[(m_head+m_size) & (m_items.size()-1)]=std::forward<U>(item);
+        ++m_size;
+    }
+
+    T& front()
+    {
+        return m_items[m_head];
+    }
+
+    void pop_front()
+    {
+        m_items[m_head]=T();
+        m_head=(m_head+1) & (m_items.size()-1);
+        --m_size;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+};
\ No newline at end of file
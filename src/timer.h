@@ -0,0 +1,280 @@
+#pragma once
+
+#include "task.h"
+
+#include <array>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+class TimerWheel;
+
+class Timer
+{
+friend class TimerWheel;
+
+private:
+    Timer* m_prev;
+    Timer* m_next;
+    Timer** m_head;
+    TimerWheel* m_wheel;
+    uint64_t m_expires;
+    InlineFunction<void()> m_handler;
+
+public:
+    Timer():
+        m_prev(nullptr),
+        m_next(nullptr),
+        m_head(nullptr),
+        m_wheel(nullptr),
+        m_expires(0)
+    {}
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    inline ~Timer();
+
+    bool active() const
+    {
+        return m_wheel != nullptr;
+    }
+
+    inline void cancel();
+};
+
+// Hierarchical timing wheel with 1 ms ticks: LEVELS wheels of SLOTS buckets each.
+// Timers live in intrusive lists, so start and cancel are O(1); far timers
+// cascade to finer wheels as time advances.
+class TimerWheel
+{
+friend class Timer;
+
+public:
+    using Clock=std::chrono::steady_clock;
+
+private:
+    static constexpr uint32_t SLOT_BITS=6;
+    static constexpr uint32_t SLOTS=1 << SLOT_BITS;
+    static constexpr uint32_t LEVELS=4;
+    static constexpr uint64_t MAX_DELAY=(uint64_t(1) << (SLOT_BITS*LEVELS))-1; //ticks
+
+    std::array<std::array<Timer*, SLOTS>, LEVELS> m_slots;
+    Clock::time_point m_start;
+    uint64_t m_now;
+    size_t m_count;
+
+private:
+    static uint32_t index(uint64_t tick, uint32_t level)
+    {
+        return (tick >> (SLOT_BITS*level)) & (SLOTS-1);
+    }
+
+    uint64_t ticks(Clock::time_point time) const
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(time-m_start).count();
+    }
+
+    // A timer past the reach of the wheels waits in the farthest slot and is linked
+    // again, closer to its expiry, when that slot cascades
+    void link(Timer& timer)
+    {
+        auto delta=std::min(timer.m_expires-m_now, MAX_DELAY);
+        uint32_t level=0;
+        for(; level+1<LEVELS && delta >= (uint64_t(1) << (SLOT_BITS*(level+1))); ++level) {}
+
+        auto& head=m_slots[level][index(m_now+delta, level)];
+        timer.m_prev=nullptr;
+        timer.m_next=head;
+        timer.m_head=&head;
+        if(head) {
+
+            head->m_prev=&timer;
+        }
+        head=&timer;
+    }
+
+    void unlink(Timer& timer)
+    {
+        if(timer.m_prev) {
+
+            timer.m_prev->m_next=timer.m_next;
+        } else {
+
+            *timer.m_head=timer.m_next;
+        }
+
+        if(timer.m_next) {
+
+            timer.m_next->m_prev=timer.m_prev;
+        }
+        timer.m_prev=nullptr;
+        timer.m_next=nullptr;
+        timer.m_head=nullptr;
+    }
+
+    void cascade(uint32_t level)
+    {
+        auto& head=m_slots[level][index(m_now, level)];
+        auto timer=head;
+        head=nullptr;
+        while(timer) {
+
+            auto next=timer->m_next;
+            link(*timer);
+            timer=next;
+        }
+    }
+
+    void expire()
+    {
+        auto& head=m_slots[0][index(m_now, 0)];
+        while(auto timer=head) {
+
+            unlink(*timer);
+            timer->m_wheel=nullptr;
+            --m_count;
+
+            auto handler=std::move(timer->m_handler);
+            timer->m_handler=nullptr;
+            handler();
+        }
+    }
+
+    // First tick at which some slot has to be cascaded or expired
+    uint64_t next_tick() const
+    {
+        auto next=m_now+MAX_DELAY+1;
+        for(uint32_t level=0; level<LEVELS; ++level) {
+
+            auto shift=SLOT_BITS*level;
+            auto base=m_now >> shift;
+            for(uint32_t i=1; i<=SLOTS; ++i) {
+
+                auto position=base+i;
+                if(m_slots[level][position & (SLOTS-1)]) {
+
+                    next=std::min(next, position << shift);
+                    break;
+                }
+            }
+        }
+        return next;
+    }
+
+public:
+    TimerWheel():
+        m_slots(),
+        m_start(Clock::now()),
+        m_now(0),
+        m_count(0)
+    {}
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    ~TimerWheel()
+    {
+        for(auto& level : m_slots) {
+
+            for(auto head : level) {
+
+                for(auto timer=head; timer; timer=timer->m_next) {
+
+                    timer->m_wheel=nullptr;
+                }
+            }
+        }
+    }
+
+    size_t size() const
+    {
+        return m_count;
+    }
+
+    template<typename T>
+    void start(Timer& timer, std::chrono::milliseconds timeout, T&& handler)
+    {
+        timer.cancel();
+
+        // The loop may have slept for hours on an empty wheel, before advance() ran
+        auto now=ticks(Clock::now());
+        if(m_count == 0) {
+
+            m_now=std::max(m_now, now);
+        }
+
+        timer.m_expires=std::max(now+uint64_t(std::max<int64_t>(timeout.count(), 0)), m_now+1);
+        timer.m_handler=std::forward<T>(handler);
+        timer.m_wheel=this;
+        link(timer);
+        ++m_count;
+    }
+
+    void cancel(Timer& timer)
+    {
+        unlink(timer);
+        timer.m_wheel=nullptr;
+        timer.m_handler=nullptr;
+        --m_count;
+    }
+
+    // Milliseconds until the wheel needs to advance, -1 when it is empty
+    int timeout() const
+    {
+        if(m_count == 0) {
+
+            return -1;
+        }
+
+        auto now=ticks(Clock::now());
+        auto next=next_tick();
+        return next > now ? int(std::min<uint64_t>(next-now, MAX_DELAY)) : 0;
+    }
+
+    // An empty wheel still keeps time, later delays are measured from now
+    void advance()
+    {
+        auto now=ticks(Clock::now());
+        if(m_count == 0) {
+
+            m_now=std::max(m_now, now);
+            return;
+        }
+
+        while(m_now < now && m_count > 0) {
+
+            auto next=next_tick();
+            if(next > now) {
+
+                m_now=now;
+                break;
+            }
+
+            m_now=next;
+            for(uint32_t level=1; level<LEVELS && index(m_now, level-1) == 0; ++level) {
+
+                cascade(level);
+            }
+            expire();
+        }
+
+        if(m_count == 0) {
+
+            m_now=std::max(m_now, now);
+        }
+    }
+};
+
+Timer::~Timer()
+{
+    cancel();
+}
+
+void Timer::cancel()
+{
+    if(m_wheel) {
+
+        m_wheel->cancel(*this);
+    }
+}
\ No newline at end of file
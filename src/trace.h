@@ -0,0 +1,260 @@
+#pragma once
+
+#include "error.h"
+
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <initializer_list>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+struct TraceArg
+{
+    const char* name;
+    int64_t value;
+};
+
+// Loop activity in the Chrome trace event format, for chrome://tracing or Perfetto.
+// Events go into a ring allocated up front and the oldest are overwritten once it
+// is full; names must be literals and other strings are interned, so recording
+// allocates nothing. Single threaded, like the loop.
+class Tracer
+{
+public:
+    using Clock=std::chrono::steady_clock;
+
+    static constexpr size_t DEFAULT_CAPACITY=256*1024; //events
+    static constexpr size_t MAX_ARGS=3;
+
+private:
+    struct Event
+    {
+        const char* name;
+        const char* category;
+        const char* label;
+        int64_t start;
+        int64_t duration;
+        uint64_t id;
+        TraceArg args[MAX_ARGS];
+        uint8_t arg_count;
+        char phase;
+    };
+
+    Clock::time_point m_origin;
+    std::vector<Event> m_events;
+    size_t m_next;
+    uint64_t m_recorded;
+    uint64_t m_next_id;
+    uint64_t m_callbacks;
+    uint64_t m_iterations;
+    uint64_t m_idle_wakeups;
+    std::unordered_set<std::string> m_strings;
+
+private:
+    int64_t since_origin(Clock::time_point point) const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(point-m_origin).count();
+    }
+
+    Event& next()
+    {
+        auto& event=m_events[m_next];
+        m_next=m_next+1==m_events.size() ? 0 : m_next+1;
+        ++m_recorded;
+        return event;
+    }
+
+    void record(char phase, const char* name, const char* category, Clock::time_point begin, Clock::time_point end, uint64_t id, std::initializer_list<TraceArg> args, const char* label)
+    {
+        auto& event=next();
+        event.name=name;
+        event.category=category;
+        event.label=label;
+        event.start=since_origin(begin);
+        event.duration=std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+        event.id=id;
+        event.arg_count=uint8_t(std::min(args.size(), MAX_ARGS));
+        std::copy_n(args.begin(), event.arg_count, event.args);
+        event.phase=phase;
+    }
+
+    static void write_escaped(std::ostream& out, std::string_view text)
+    {
+        for(auto c : text) {
+
+            if(c=='"' || c=='\\') {
+
+                out << '\\' << c;
+            } else if(uint8_t(c) >= 0x20) {
+
+                out << c;
+            }
+        }
+    }
+
+    // Microseconds with the nanoseconds kept as a fraction
+    static void write_time(std::ostream& out, int64_t ns)
+    {
+        out << ns/1000 << '.' << char('0'+(ns/100)%10) << char('0'+(ns/10)%10) << char('0'+ns%10);
+    }
+
+    static void write_event(std::ostream& out, const Event& event)
+    {
+        out << "{\"ph\":\"" << event.phase << "\",\"name\":\"" << event.name << "\",\"cat\":\"" << event.category << "\",\"pid\":1,\"tid\":1,\"ts\":";
+        write_time(out, event.phase=='e' ? event.start+event.duration : event.start);
+        if(event.phase=='X') {
+
+            out << ",\"dur\":";
+            write_time(out, event.duration);
+        } else {
+
+            out << ",\"id\":\"0x" << std::hex << event.id << std::dec << "\"";
+        }
+
+        out << ",\"args\":{";
+        for(size_t i=0; i<event.arg_count; ++i) {
+
+            out << (i>0 ? "," : "") << "\"" << event.args[i].name << "\":" << event.args[i].value;
+        }
+        if(event.label) {
+
+            out << (event.arg_count>0 ? "," : "") << "\"label\":\"";
+            write_escaped(out, event.label);
+            out << "\"";
+        }
+        out << "}}";
+    }
+
+public:
+    explicit Tracer(size_t capacity=DEFAULT_CAPACITY):
+        m_origin(Clock::now()),
+        m_events(std::max<size_t>(capacity, 1)),
+        m_next(0),
+        m_recorded(0),
+        m_next_id(0),
+        m_callbacks(0),
+        m_iterations(0),
+        m_idle_wakeups(0)
+    {}
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    // A span on the loop thread
+    void complete(const char* name, const char* category, Clock::time_point begin, Clock::time_point end, std::initializer_list<TraceArg> args={}, const char* label=nullptr)
+    {
+        record('X', name, category, begin, end, 0, args, label);
+    }
+
+    // A span that outlives callbacks, such as a request; spans with one id nest
+    void async(const char* name, const char* category, uint64_t id, Clock::time_point begin, Clock::time_point end, std::initializer_list<TraceArg> args={}, const char* label=nullptr)
+    {
+        record('b', name, category, begin, end, id, args, label);
+        record('e', name, category, begin, end, id, {}, nullptr);
+    }
+
+    // One loop iteration; it woke for nothing when handlers ran but no callback or task did
+    void iteration(Clock::time_point begin, size_t tasks, size_t handlers, uint64_t callbacks)
+    {
+        ++m_iterations;
+        if(handlers > 0 && tasks==0 && callbacks==0) {
+
+            ++m_idle_wakeups;
+        }
+        complete("iteration", "loop", begin, Clock::now(), {{"tasks", int64_t(tasks)}, {"handlers", int64_t(handlers)}, {"callbacks", int64_t(callbacks)}});
+    }
+
+    void count_callback()
+    {
+        ++m_callbacks;
+    }
+
+    uint64_t callbacks() const
+    {
+        return m_callbacks;
+    }
+
+    uint64_t next_id()
+    {
+        return ++m_next_id;
+    }
+
+    // The same pointer for equal strings, valid as long as the tracer
+    const char* intern(std::string_view text)
+    {
+        return m_strings.emplace(text).first->c_str();
+    }
+
+    void write(std::ostream& out) const
+    {
+        auto size=std::min<uint64_t>(m_recorded, m_events.size());
+        auto first=m_recorded > m_events.size() ? m_next : 0;
+
+        out << "{\"displayTimeUnit\":\"ns\",\"otherData\":{"
+            << "\"recorded\":" << m_recorded
+            << ",\"dropped\":" << m_recorded-size
+            << ",\"iterations\":" << m_iterations
+            << ",\"idle_wakeups\":" << m_idle_wakeups
+            << ",\"callbacks\":" << m_callbacks
+            << "},\"traceEvents\":[\n"
+            << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"loop\"}}";
+        for(uint64_t i=0; i<size; ++i) {
+
+            out << ",\n";
+            write_event(out, m_events[(first+i) % m_events.size()]);
+        }
+        out << "\n]}\n";
+    }
+
+    Error write(const std::string& path) const
+    {
+        std::ofstream out(path);
+        write(out);
+        out.close();
+        if(!out) {
+
+            return Error(Error::err_write_file, strerror(errno));
+        }
+        return Error(Error::ok);
+    }
+};
+
+// Times a callback and counts it as progress of the loop iteration; costs a null
+// check when tracing is off
+class TraceScope
+{
+private:
+    Tracer* m_tracer;
+    const char* m_name;
+    Tracer::Clock::time_point m_begin;
+
+public:
+    TraceScope(Tracer* tracer, const char* name):
+        m_tracer(tracer),
+        m_name(name)
+    {
+        if(m_tracer) {
+
+            m_tracer->count_callback();
+            m_begin=Tracer::Clock::now();
+        }
+    }
+
+    ~TraceScope()
+    {
+        if(m_tracer) {
+
+            m_tracer->complete(m_name, "callback", m_begin, Tracer::Clock::now());
+        }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+};
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <charconv>
 #include <system_error>
+#include <tuple>
 
 using namespace std::literals;
 
@@ -19,6 +20,8 @@ struct HttpUrl
         port(0)
     {}
 
+    HttpUrl(const HttpUrl& other) = default;
+
     HttpUrl(HttpUrl&& other):
         scheme(std::move(other.scheme)),
         port(other.port),